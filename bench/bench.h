@@ -0,0 +1,31 @@
+#ifndef MJS_BENCH_H
+#define MJS_BENCH_H
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+namespace mjs::bench {
+
+// Returns the fastest of 'runs' runs of 'f' in nanoseconds per iteration (f is expected to do 'iterations' iterations)
+template<typename F>
+double time_per_iteration(F&& f, uint64_t iterations, int runs = 5) {
+    double best = 0;
+    for (int run = 0; run < runs; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+        if (!run || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+inline void report(const char* name, uint64_t n, double ns) {
+    std::cout << std::left << std::setw(40) << name << std::right << std::setw(10) << n << std::setw(12) << std::fixed << std::setprecision(1) << ns << " ns/op\n";
+}
+
+} // namespace mjs::bench
+
+#endif
@@ -0,0 +1,384 @@
+#include "bench.h"
+#include <mjs/gc_heap.h>
+#include <mjs/value.h>
+#include <mjs/object.h>
+#include <mjs/interpreter.h>
+#include <mjs/parser.h>
+#include <mjs/allocation_profiler.h>
+#include <vector>
+#include <random>
+#include <fstream>
+
+using namespace mjs;
+
+// Cost of creating/destroying tracked pointers with 'n' other tracked pointers alive. Pointers die in
+// random order (not just LIFO) like values stored in containers do.
+void tracked_pointer_bench(uint64_t n) {
+    constexpr uint64_t iterations = 1'000'000;
+    gc_heap h{1<<16};
+    {
+        const string s{h, "test"};
+        std::vector<string> live(n, s);
+        std::mt19937 rng{42};
+        std::uniform_int_distribution<size_t> dist{0, n-1};
+        std::vector<size_t> indices(iterations);
+        for (auto& i: indices) i = dist(rng);
+        const auto ns = bench::time_per_iteration([&] {
+            for (const auto i: indices) {
+                // Replacing an element destroys a pointer that was created at some random point in the past
+                live[i] = string{live[(i * 7) % n]};
+            }
+        }, iterations);
+        bench::report("tracked pointer copy/destroy", n, ns);
+    }
+    h.garbage_collect();
+}
+
+// Cost of a short lived local root (tracked pointer vs. handle in its own scope)
+void local_root_bench() {
+    constexpr uint64_t iterations = 10'000'000;
+    gc_heap h{1<<16};
+    {
+        const auto o = object::make(h, string{h, "Object"}, nullptr);
+        // Some long lived roots
+        std::vector<gc_heap_ptr<object>> live(1000, o);
+        volatile uintptr_t sink = 0;
+        const auto tracked_ns = bench::time_per_iteration([&] {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                const gc_heap_ptr<object> p{o};
+                sink = reinterpret_cast<uintptr_t>(p.get());
+            }
+        }, iterations);
+        bench::report("local root (gc_heap_ptr)", 1, tracked_ns);
+        const auto handle_ns = bench::time_per_iteration([&] {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                gc_handle_scope scope{h};
+                const gc_handle<object> p{o};
+                sink = reinterpret_cast<uintptr_t>(p.get());
+            }
+        }, iterations);
+        bench::report("local root (gc_handle)", 1, handle_ns);
+    }
+    h.garbage_collect();
+}
+
+// Interpreter throughput with 'n' tracked values kept alive by the embedder
+void interpreter_bench(uint64_t n) {
+    constexpr uint64_t iterations = 20000;
+    gc_heap h{1<<24};
+    {
+        std::vector<value> live;
+        for (uint64_t i = 0; i < n; ++i) {
+            live.push_back(value{string{h, "x" + std::to_string(i)}});
+        }
+        const auto source = L"var s = 0; for (var j = 0; j < " + std::to_wstring(iterations) + L"; ++j) { var o = new Object(); o.x = j; s += o.x; }";
+        const auto ns = bench::time_per_iteration([&] {
+            auto bs = parse(std::make_shared<source_file>(L"bench", source));
+            interpreter i{h, *bs};
+            i.eval(*bs);
+        }, iterations, 3);
+        bench::report("interpreter loop iteration", n, ns);
+    }
+    h.garbage_collect();
+}
+
+// Interpreter throughput with allocations sampled every 'interval' bytes (0: not profiling)
+void allocation_profiler_bench(uint64_t interval) {
+    constexpr uint64_t iterations = 20000;
+    gc_heap h{1<<24};
+    {
+        const auto source = L"function f(j) { var o = new Object(); o.x = 'value ' + j; return o; }\n"
+            L"var s = 0; for (var j = 0; j < " + std::to_wstring(iterations) + L"; ++j) { s += f(j).x.length; }";
+        const auto ns = bench::time_per_iteration([&] {
+            auto bs = parse(std::make_shared<source_file>(L"bench", source));
+            interpreter i{h, *bs};
+            std::unique_ptr<allocation_profiler> profiler;
+            if (interval) {
+                profiler = std::make_unique<allocation_profiler>(h, i, interval);
+            }
+            i.eval(*bs);
+        }, iterations, 5);
+        bench::report("interpreter loop (allocation profiling)", interval, ns);
+    }
+    h.garbage_collect();
+}
+
+// Cost of appending to a string of 'n' lines built in a loop (the result is used once at the end)
+void string_concatenation_bench(uint64_t n) {
+    gc_heap h{1<<24};
+    {
+        const auto source = L"var s = ''; for (var j = 0; j < " + std::to_wstring(n) + L"; ++j) { s = s + 'line of text ' + j + '\\n'; } s.charAt(s.length - 2)";
+        const auto ns = bench::time_per_iteration([&] {
+            auto bs = parse(std::make_shared<source_file>(L"bench", source));
+            interpreter i{h, *bs};
+            i.eval(*bs);
+        }, n, 3);
+        bench::report("string concatenation (lines)", n, ns);
+    }
+    h.garbage_collect();
+}
+
+// Cost of taking substrings of a string of 'n' lines: splitting it and repeatedly dropping the first line
+void substring_bench(uint64_t n) {
+    gc_heap h{1<<24};
+    {
+        const auto source = L"var s = ''; for (var j = 0; j < " + std::to_wstring(n) + L"; ++j) { s = s + 'line of text number ' + j + '\\n'; }\n"
+            L"var l = s.split('\\n'); var c = 0; for (var j = 0; j < l.length; ++j) { c += l[j].substring(8).length; }\n"
+            L"while (s.length) { s = s.substring(s.indexOf('\\n') + 1); }";
+        const auto ns = bench::time_per_iteration([&] {
+            auto bs = parse(std::make_shared<source_file>(L"bench", source));
+            interpreter i{h, *bs};
+            i.eval(*bs);
+        }, n, 3);
+        bench::report("substrings (lines)", n, ns);
+    }
+    h.garbage_collect();
+}
+
+// Cost of indexing arrays: 'n' element stores, loads and joined elements (spread over arrays of 100 elements)
+void array_index_bench(uint64_t n) {
+    gc_heap h{1<<24};
+    {
+        const auto source = L"var c = 0; for (var j = 0; j < " + std::to_wstring(n / 100) + L"; ++j) {\n"
+            L"var a = new Array(100); for (var i = 0; i < a.length; ++i) { a[i] = i; }\n"
+            L"for (var i = 0; i < a.length; ++i) { c += a[i]; } c += a.join().length; }";
+        const auto ns = bench::time_per_iteration([&] {
+            auto bs = parse(std::make_shared<source_file>(L"bench", source));
+            interpreter i{h, *bs};
+            i.eval(*bs);
+        }, n, 3);
+        bench::report("array indexing (elements)", n, ns);
+    }
+    h.garbage_collect();
+}
+
+// Pause time of a full collection of a large heap with 'threads' GC threads
+void parallel_collection_bench(uint32_t threads) {
+    auto config = gc_heap_config::fixed(1<<25);
+    config.gc_threads = threads;
+    gc_heap h{config};
+    {
+        // A wide tree, so there's plenty of work to distribute
+        auto root = object::make(h, string{h, "Object"}, nullptr);
+        for (uint32_t i = 0; i < 1000; ++i) {
+            auto child = object::make(h, string{h, "Object"}, nullptr);
+            for (uint32_t j = 0; j < 100; ++j) {
+                child->put(string{h, "p" + std::to_string(j)}, value{string{h, "value " + std::to_string(j)}});
+            }
+            root->put(string{h, "c" + std::to_string(i)}, value{child});
+        }
+        const auto ns = bench::time_per_iteration([&] { h.garbage_collect(); }, 1);
+        bench::report("full collection pause (threads)", threads, ns);
+    }
+    h.garbage_collect();
+}
+
+// Pause time of a full collection of a heap dominated by large strings, with and without the large object space
+void large_object_bench(bool large_object_space) {
+    gc_heap_config config{};
+    config.nursery_capacity = 0;
+    config.max_capacity = 1<<24;
+    if (!large_object_space) {
+        config.large_object_capacity = 0;
+    }
+    gc_heap h{config};
+    {
+        std::vector<string> live;
+        for (int i = 0; i < 500; ++i) {
+            live.push_back(string{h, std::string(50'000, static_cast<char>('a' + i % 26))});
+        }
+        h.garbage_collect();
+        const auto ns = bench::time_per_iteration([&] { h.garbage_collect(); }, 1, 10);
+        bench::report("full collection pause (large object space)", large_object_space, ns);
+    }
+    h.garbage_collect();
+}
+
+// Pause time of a full collection after 'n' short strings died (with a few live objects around)
+void dead_object_bench(uint64_t n) {
+    gc_heap h{gc_heap_config::fixed(1<<25)};
+    {
+        const auto o = object::make(h, string{h, "Object"}, nullptr);
+        double best = 0;
+        for (int run = 0; run < 5; ++run) {
+            for (uint64_t i = 0; i < n; ++i) {
+                string{h, "garbage"};
+            }
+            const auto start = std::chrono::steady_clock::now();
+            h.garbage_collect();
+            const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if (!run || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        bench::report("full collection pause (dead objects)", n, best);
+    }
+    h.garbage_collect();
+}
+
+// Pause time of a full collection of a heap of many small strings or of objects with many properties (tables)
+void copying_collection_bench(bool tables) {
+    gc_heap h{gc_heap_config::fixed(1<<24)};
+    {
+        auto root = object::make(h, string{h, "Object"}, nullptr);
+        std::vector<string> keys;
+        for (uint32_t j = 0; j < 100; ++j) {
+            keys.push_back(string{h, "p" + std::to_string(j)});
+        }
+        for (uint32_t i = 0; i < 1000; ++i) {
+            auto child = object::make(h, string{h, "Object"}, nullptr);
+            for (uint32_t j = 0; j < 100; ++j) {
+                if (tables) {
+                    // Shared keys and numbers, so the tables make up most of the heap
+                    child->put(keys[j], value{static_cast<double>(j)});
+                } else {
+                    child->put(keys[j % 4], value{string{h, "string value " + std::to_string(i * 100 + j)}});
+                    child->put(string{h, "key " + std::to_string(j)}, value{string{h, "another string value"}});
+                }
+            }
+            root->put(string{h, "c" + std::to_string(i)}, value{child});
+        }
+        h.garbage_collect();
+        const auto ns = bench::time_per_iteration([&] { h.garbage_collect(); }, 1, 10);
+        bench::report(tables ? "full collection pause (tables)" : "full collection pause (strings)", 1000, ns);
+    }
+    h.garbage_collect();
+}
+
+// Cost of looking up a property of an object with 'n' properties (found in the object itself or through its prototype)
+void property_lookup_bench(uint32_t n) {
+    constexpr uint64_t iterations = 1'000'000;
+    gc_heap h{1<<20};
+    {
+        auto proto = object::make(h, string{h, "Object"}, nullptr);
+        auto o = object::make(h, string{h, "Object"}, proto);
+        std::vector<string> keys;
+        std::vector<std::wstring> key_chars;
+        for (uint32_t i = 0; i < n; ++i) {
+            keys.push_back(atomize(h, std::string_view{"property" + std::to_string(i)}));
+            key_chars.push_back(L"property" + std::to_wstring(i));
+            (i % 2 ? proto : o)->put(string{h, "property" + std::to_string(i)}, value{static_cast<double>(i)});
+        }
+        double sum = 0;
+        const auto ns = bench::time_per_iteration([&] {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                sum += o->get(keys[i % n]).number_value();
+            }
+        }, iterations);
+        bench::report("property lookup", n, ns);
+        const auto view_ns = bench::time_per_iteration([&] {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                sum += o->get(key_chars[i % n]).number_value();
+            }
+        }, iterations);
+        bench::report("property lookup (by contents)", n, view_ns);
+    }
+    h.garbage_collect();
+}
+
+// Heap used by 'n' objects with the same 20 properties when each object gets its own copy of the names
+void property_memory_bench(uint32_t n) {
+    gc_heap h{gc_heap_config::fixed(1<<24)};
+    {
+        std::vector<object_ptr> objects;
+        for (uint32_t i = 0; i < n; ++i) {
+            auto o = object::make(h, string{h, "Object"}, nullptr);
+            for (uint32_t j = 0; j < 20; ++j) {
+                o->put(string{h, "property" + std::to_string(j)}, value{static_cast<double>(j)});
+            }
+            objects.push_back(o);
+        }
+        h.garbage_collect();
+        std::cout << std::left << std::setw(40) << "heap used by objects" << std::right << std::setw(10) << n << std::setw(12) << (h.calc_used() * gc_heap::slot_size / 1024) << " KB\n";
+    }
+    h.garbage_collect();
+}
+
+// Heap used by 'n' short strings (like the values of parsed records)
+void string_memory_bench(uint32_t n) {
+    gc_heap h{gc_heap_config::fixed(1<<24)};
+    {
+        std::vector<string> strings;
+        for (uint32_t i = 0; i < n; ++i) {
+            strings.push_back(string{h, "record " + std::to_string(i) + ": some text"});
+        }
+        h.garbage_collect();
+        std::cout << std::left << std::setw(40) << "heap used by strings" << std::right << std::setw(10) << n << std::setw(12) << (h.calc_used() * gc_heap::slot_size / 1024) << " KB\n";
+    }
+    h.garbage_collect();
+}
+
+// Resident memory (in KB) of the process, 0 if it can't be determined
+uint64_t resident_kb() {
+    std::ifstream statm{"/proc/self/statm"};
+    uint64_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * 4;
+}
+
+// Resident memory held by the heap once it has shrunk after most of a large old generation died
+void released_memory_bench(bool release_memory) {
+    gc_heap_config config{};
+    config.nursery_capacity = 0;
+    config.max_capacity = 1<<24;
+    config.release_memory = release_memory;
+    const auto before = resident_kb();
+    gc_heap h{config};
+    {
+        std::vector<string> live;
+        for (int i = 0; i < 10'000; ++i) {
+            string s{h, std::string(2'000, 'x')};
+            if (i % 100 == 0) {
+                live.push_back(s);
+            }
+        }
+        // The heap shrinks gradually
+        for (int i = 0; i < 10; ++i) {
+            h.garbage_collect();
+        }
+        std::cout << std::left << std::setw(40) << "resident memory after collection" << std::right << std::setw(10) << (release_memory ? "release" : "keep") << std::setw(12) << (resident_kb() - before) << " KB\n";
+    }
+    h.garbage_collect();
+}
+
+int main() {
+    for (const uint64_t n: {100, 1'000, 10'000, 100'000}) {
+        tracked_pointer_bench(n);
+    }
+    local_root_bench();
+    for (const uint64_t n: {100, 1'000, 10'000, 100'000}) {
+        interpreter_bench(n);
+    }
+    for (const uint64_t interval: {0, 512 << 10, 64 << 10}) {
+        allocation_profiler_bench(interval);
+    }
+    for (const uint64_t n: {1'000, 10'000, 100'000}) {
+        string_concatenation_bench(n);
+    }
+    for (const uint64_t n: {1'000, 10'000}) {
+        substring_bench(n);
+    }
+    for (const uint64_t n: {1'000, 10'000, 100'000}) {
+        array_index_bench(n);
+    }
+    for (const uint32_t threads: {1, 2, 4, 8}) {
+        parallel_collection_bench(threads);
+    }
+    for (const bool large_object_space: {false, true}) {
+        large_object_bench(large_object_space);
+    }
+    for (const uint64_t n: {10'000, 100'000, 1'000'000}) {
+        dead_object_bench(n);
+    }
+    for (const bool tables: {false, true}) {
+        copying_collection_bench(tables);
+    }
+    for (const bool release_memory: {false, true}) {
+        released_memory_bench(release_memory);
+    }
+    for (const uint32_t n: {4, 16, 64}) {
+        property_lookup_bench(n);
+    }
+    property_memory_bench(10'000);
+    string_memory_bench(100'000);
+}
@@ -0,0 +1,152 @@
+#include "bench.h"
+#include <mjs/gc_heap.h>
+#include <mjs/value.h>
+#include <mjs/lexer.h>
+#include <vector>
+#include <random>
+#include <sstream>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+
+using namespace mjs;
+
+// The number to string conversion value.cpp used to do: find the shortest precision that round trips with string streams,
+// then format that many digits with ecvt
+std::wstring stream_number_to_string(double m) {
+    if (std::isnan(m)) {
+        return L"NaN";
+    }
+    if (m == 0) {
+        return L"0";
+    }
+    if (m < 0) {
+        return L"-" + stream_number_to_string(-m);
+    }
+    if (std::isinf(m)) {
+        return L"Infinity";
+    }
+    int k = 1;
+    for (; k < 17; ++k) {
+        std::ostringstream oss;
+        oss.precision(k);
+        oss << std::defaultfloat << m;
+        if (double t; std::istringstream{oss.str()} >> t && t == m) {
+            break;
+        }
+    }
+    int n, sign;
+#ifdef _MSC_VER
+    char s[_CVTBUFSIZE + 1];
+    _ecvt_s(s, m, k, &n, &sign);
+#else
+    const char* s = ecvt(m, k, &n, &sign);
+#endif
+    std::wostringstream woss;
+    if (k <= n && n <= 21) {
+        woss << s << std::wstring(n-k, '0');
+    } else if (0 < n && n <= 21) {
+        woss << std::wstring(s, s + n) << '.' << std::wstring(s + n, s + std::strlen(s));
+    } else if (-6 < n && n <= 0) {
+        woss << "0." << std::wstring(-n, '0') << s;
+    } else if (k == 1) {
+        woss << s << 'e' << (n-1>=0?'+':'-') << std::abs(n-1);
+    } else {
+        woss << s[0] << '.' << s+1 << 'e' << (n-1>=0?'+':'-') << std::abs(n-1);
+    }
+    return woss.str();
+}
+
+// Numbers like those found in reports: integers, amounts with two decimals and arbitrary doubles
+std::vector<double> bench_numbers(const char* kind) {
+    std::mt19937_64 rng{42};
+    std::vector<double> res(100'000);
+    for (auto& m: res) {
+        if (!std::strcmp(kind, "integers")) {
+            m = static_cast<double>(rng() % 1'000'000);
+        } else if (!std::strcmp(kind, "decimals")) {
+            m = static_cast<double>(rng() % 10'000'000) / 100;
+        } else {
+            do {
+                const uint64_t bits = rng();
+                std::memcpy(&m, &bits, sizeof(m));
+            } while (!std::isfinite(m));
+        }
+    }
+    return res;
+}
+
+void number_to_string_bench(const char* kind) {
+    const auto numbers = bench_numbers(kind);
+    size_t total = 0;
+    const auto stream_ns = bench::time_per_iteration([&] {
+        for (const auto m: numbers) {
+            total += stream_number_to_string(m).length();
+        }
+    }, numbers.size());
+    const auto ns = bench::time_per_iteration([&] {
+        char buf[max_number_chars];
+        for (const auto m: numbers) {
+            total += number_to_chars(buf, m) - buf;
+        }
+    }, numbers.size());
+    gc_heap h{1<<20};
+    const auto heap_ns = bench::time_per_iteration([&] {
+        for (const auto m: numbers) {
+            total += to_string(h, m).length();
+        }
+        h.garbage_collect();
+    }, numbers.size());
+    std::cout << "number to string (" << kind << ")\n";
+    bench::report("  streams and ecvt (old)", numbers.size(), stream_ns);
+    bench::report("  number_to_chars", numbers.size(), ns);
+    bench::report("  to_string (heap string)", numbers.size(), heap_ns);
+    if (!total) {
+        std::abort();
+    }
+}
+
+void string_to_number_bench(const char* kind) {
+    std::vector<std::wstring> strings;
+    for (const auto m: bench_numbers(kind)) {
+        char buf[max_number_chars];
+        strings.emplace_back(buf, number_to_chars(buf, m));
+    }
+    double total = 0;
+    // What the lexer used to do (std::stod, which throws for denormals, calls strtod)
+    const auto stod_ns = bench::time_per_iteration([&] {
+        for (const auto& s: strings) {
+            total += std::strtod(std::string(s.begin(), s.end()).c_str(), nullptr);
+        }
+    }, strings.size());
+    // What parseFloat and to_number used to do
+    const auto stream_ns = bench::time_per_iteration([&] {
+        for (const auto& s: strings) {
+            std::wistringstream wiss{s};
+            double d;
+            wiss >> d;
+            total += d;
+        }
+    }, strings.size());
+    const auto ns = bench::time_per_iteration([&] {
+        for (const auto& s: strings) {
+            total += parse_decimal(std::wstring_view{s}).first;
+        }
+    }, strings.size());
+    std::cout << "string to number (" << kind << ")\n";
+    bench::report("  strtod (old lexer)", strings.size(), stod_ns);
+    bench::report("  wistringstream (old parseFloat)", strings.size(), stream_ns);
+    bench::report("  parse_decimal", strings.size(), ns);
+    if (total == 0) {
+        std::abort();
+    }
+}
+
+int main() {
+    for (const char* kind: {"integers", "decimals", "random bits"}) {
+        number_to_string_bench(kind);
+    }
+    for (const char* kind: {"integers", "decimals", "random bits"}) {
+        string_to_number_bench(kind);
+    }
+}
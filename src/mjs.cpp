@@ -11,6 +11,7 @@
 #include <mjs/parser.h>
 #include <mjs/interpreter.h>
 #include <mjs/printer.h>
+#include <mjs/allocation_profiler.h>
 
 #include <fstream>
 #include <streambuf>
@@ -26,10 +27,62 @@ std::shared_ptr<mjs::source_file> make_source(const std::wstring_view& s) {
     return std::make_shared<mjs::source_file>(std::wstring(L"inline code"), std::wstring(s));
 }
 
-int interpret_file(const std::shared_ptr<mjs::source_file>& source) {
-    mjs::gc_heap heap{1<<24}; // TODO: Do something sane
+void print_gc_stats(const mjs::gc_heap& heap) {
+    std::wcerr << heap.stats();
+    auto types = heap.type_statistics();
+    std::sort(types.begin(), types.end(), [](const auto& l, const auto& r) { return l.bytes > r.bytes; });
+    std::wcerr << "Live objects:\n";
+    for (const auto& t: types) {
+        if (t.count) {
+            std::wcerr << "  " << t.name << ": " << t.count << " (" << t.bytes << " bytes)\n";
+        }
+    }
+}
+
+struct options {
+    bool        gc_stats = false;        // Print a summary of the garbage collector's work at exit
+    const char* heap_snapshot = nullptr; // Write a heap snapshot (see mjs_heapdump) to this file at exit
+    const char* alloc_profile = nullptr; // Sample allocations and write the profile (in collapsed stack format) to this file at exit
+};
+
+// Reports on the heap when going out of scope (as requested by the options)
+struct exit_report {
+    explicit exit_report(mjs::gc_heap& heap, const mjs::interpreter& i, const options& opts) : heap(heap), opts(opts) {
+        if (opts.alloc_profile) {
+            profiler = std::make_unique<mjs::allocation_profiler>(heap, i);
+        }
+    }
+
+    mjs::gc_heap& heap;
+    const options& opts;
+    std::unique_ptr<mjs::allocation_profiler> profiler;
+
+    ~exit_report() {
+        if (profiler) {
+            std::ofstream out{opts.alloc_profile};
+            profiler->write_collapsed(out);
+            if (!out) {
+                std::wcerr << "Could not write allocation profile to " << opts.alloc_profile << "\n";
+            }
+        }
+        if (opts.gc_stats) {
+            print_gc_stats(heap);
+        }
+        if (opts.heap_snapshot) {
+            std::ofstream out{opts.heap_snapshot, std::ios::binary};
+            heap.write_snapshot(out);
+            if (!out) {
+                std::wcerr << "Could not write heap snapshot to " << opts.heap_snapshot << "\n";
+            }
+        }
+    }
+};
+
+int interpret_file(const std::shared_ptr<mjs::source_file>& source, const options& opts) {
+    mjs::gc_heap heap{mjs::gc_heap_config{}};
     auto bs = mjs::parse(source);
     mjs::interpreter i{heap, *bs};
+    exit_report report{heap, i, opts};
     mjs::value res{};
     for (const auto& s: bs->l()) {
         res = i.eval(*s).result;
@@ -39,12 +92,31 @@ int interpret_file(const std::shared_ptr<mjs::source_file>& source) {
 
 int main(int argc, char* argv[]) {
     try {
+        options opts;
+        for (; argc > 1 && std::strncmp(argv[1], "--", 2) == 0; --argc, ++argv) {
+            if (std::strcmp(argv[1], "--gc-stats") == 0) {
+                opts.gc_stats = true;
+            } else if (std::strcmp(argv[1], "--heap-snapshot") == 0 && argc > 2) {
+                opts.heap_snapshot = argv[2];
+                --argc;
+                ++argv;
+            } else if (std::strcmp(argv[1], "--alloc-profile") == 0 && argc > 2) {
+                opts.alloc_profile = argv[2];
+                --argc;
+                ++argv;
+            } else {
+                std::wcerr << "Usage: mjs [--gc-stats] [--heap-snapshot file] [--alloc-profile file] [source-file]\n";
+                return 2;
+            }
+        }
+
         if (argc > 1) {
-            return interpret_file(read_ascii_file(argv[1]));
+            return interpret_file(read_ascii_file(argv[1]), opts);
         }
 
-        mjs::gc_heap heap{1<<22}; // TODO: Do something sane
+        mjs::gc_heap heap{mjs::gc_heap_config{}};
         mjs::interpreter i{heap, *mjs::parse(make_source(L""))};
+        exit_report report{heap, i, opts};
         for (;;) {
             std::wcout << "> " << std::flush;
             std::wstring line;
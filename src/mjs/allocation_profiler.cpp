@@ -0,0 +1,67 @@
+#include "allocation_profiler.h"
+#include "gc_heap.h"
+#include "interpreter.h"
+#include "parser.h"
+#include <ostream>
+
+namespace mjs {
+
+allocation_profiler::allocation_profiler(gc_heap& heap, const interpreter& interp, uint64_t interval) : heap_(heap), interpreter_(interp) {
+    heap_.sample_allocations(interval, [this](const gc_type_info& type, const void* p, uint64_t bytes) {
+        record(type, p, bytes);
+    });
+}
+
+allocation_profiler::~allocation_profiler() {
+    heap_.sample_allocations(0, nullptr);
+}
+
+void allocation_profiler::record(const gc_type_info& type, const void* p, uint64_t bytes) {
+    stack_key key;
+    for (const auto& e: interpreter_.stack_trace()) {
+        key.frames.push_back(frame{e.file.get(), e.start});
+        if (files_.find(e.file.get()) == files_.end()) {
+            files_[e.file.get()] = e.file;
+        }
+    }
+    if (auto label = type.snapshot_label(p); !label.empty()) {
+        key.type = std::move(label);
+    } else {
+        key.type = type.name();
+    }
+    bytes_[std::move(key)] += bytes;
+    ++num_samples_;
+    total_bytes_ += bytes;
+}
+
+void allocation_profiler::write_collapsed(std::ostream& os) const {
+    // Frames are reported by line, so different statements on the same line end up in the same stack
+    auto frame_name = [](const source_file& f, uint32_t start) {
+        std::string name;
+        for (const auto c: f.filename) {
+            // Semicolons separate the frames
+            name.push_back(c == ';' || c > 0x7f ? '_' : static_cast<char>(c));
+        }
+        return name + ":" + std::to_string(extend_to_positions(f.text, start, start).first.line);
+    };
+
+    std::map<std::string, uint64_t> stacks;
+    for (const auto& [key, bytes]: bytes_) {
+        std::string stack;
+        for (auto it = key.frames.rbegin(); it != key.frames.rend(); ++it) {
+            stack += frame_name(*it->file, it->start);
+            stack += ';';
+        }
+        if (key.frames.empty()) {
+            // Allocated outside of any script (e.g. while setting up the global object)
+            stack += "[native];";
+        }
+        stack += key.type;
+        stacks[stack] += bytes;
+    }
+    for (const auto& [stack, bytes]: stacks) {
+        os << stack << ' ' << bytes << '\n';
+    }
+}
+
+} // namespace mjs
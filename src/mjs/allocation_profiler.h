@@ -0,0 +1,70 @@
+#ifndef MJS_ALLOCATION_PROFILER_H
+#define MJS_ALLOCATION_PROFILER_H
+
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace mjs {
+
+class gc_heap;
+class gc_type_info;
+class interpreter;
+struct source_file;
+
+// Sampling allocation profiler: attributes the bytes allocated from a heap to the script stacks (see interpreter::stack_trace())
+// that allocated them. Only about one allocation every 'interval' bytes is looked at, so it's cheap enough to leave enabled.
+// Sampling stops when the profiler is destroyed.
+class allocation_profiler {
+public:
+    static constexpr uint64_t default_interval = 512 << 10;
+
+    explicit allocation_profiler(gc_heap& heap, const interpreter& interp, uint64_t interval = default_interval);
+    ~allocation_profiler();
+
+    allocation_profiler(const allocation_profiler&) = delete;
+    allocation_profiler& operator=(const allocation_profiler&) = delete;
+
+    uint64_t num_samples() const { return num_samples_; }
+
+    // Estimated number of bytes allocated
+    uint64_t total_bytes() const { return total_bytes_; }
+
+    // Write the profile in the collapsed stack format understood by flamegraph.pl (and compatible tools): one line per distinct stack
+    // with the frames ("file:line") separated by semicolons, outermost first and ending with the allocated type (or [[Class]] for
+    // objects), followed by the estimated number of bytes allocated there.
+    void write_collapsed(std::ostream& os) const;
+
+private:
+    struct frame {
+        const source_file* file;
+        uint32_t start;
+
+        bool operator==(const frame& rhs) const { return file == rhs.file && start == rhs.start; }
+        bool operator!=(const frame& rhs) const { return !(*this == rhs); }
+        bool operator<(const frame& rhs) const { return file != rhs.file ? file < rhs.file : start < rhs.start; }
+    };
+
+    struct stack_key {
+        std::vector<frame> frames; // Innermost first
+        std::string        type;
+
+        bool operator<(const stack_key& rhs) const { return frames != rhs.frames ? frames < rhs.frames : type < rhs.type; }
+    };
+
+    gc_heap& heap_;
+    const interpreter& interpreter_;
+    uint64_t num_samples_ = 0;
+    uint64_t total_bytes_ = 0;
+    std::map<stack_key, uint64_t> bytes_;
+    std::map<const source_file*, std::shared_ptr<source_file>> files_; // Keeps the sources of the frames alive
+
+    void record(const gc_type_info& type, const void* p, uint64_t bytes);
+};
+
+} // namespace mjs
+
+#endif
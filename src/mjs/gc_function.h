@@ -16,6 +16,16 @@ public:
         return p;
     }
 
+    // For builtins: they may keep raw pointers into the heap (e.g. string views) or use their captures (which live in the
+    // heap) across calls back into scripts, so safepoints don't collect while 'f' runs.
+    template<typename F>
+    static gc_heap_ptr<gc_function> make_native(gc_heap& h, const F& f) {
+        return make(h, [&h, f](const value& this_, const std::vector<value>& args) {
+            gc_no_safepoint_scope no_safepoints{h};
+            return f(this_, args);
+        });
+    }
+
     value call(const value& this_, const std::vector<value>& args) const {
         return get_model()->call(this_, args);
     }
@@ -2,7 +2,19 @@
 #include <algorithm>
 #include <iomanip>
 #include <sstream>
+#include <stdexcept>
 #include <cstdlib>
+#include <chrono>
+#include <cmath>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace {
 
@@ -43,6 +55,69 @@ private:
     int b_;
 };
 
+// The heap's storage is one big reservation. On POSIX systems it's mapped without committing anything, so the
+// operating system only provides pages as they're touched and unused parts can be handed back with madvise().
+// Elsewhere the storage is simply allocated (and releasing memory does nothing).
+struct memory_reservation {
+    void*  base = nullptr; // Start of the mapping
+    size_t size = 0;
+    void*  aligned = nullptr;
+};
+
+#ifndef _WIN32
+constexpr size_t huge_page_size = 2 << 20;
+
+size_t page_size() {
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+#endif
+
+memory_reservation reserve_memory(size_t bytes, [[maybe_unused]] bool huge_pages) {
+    memory_reservation r;
+#ifdef _WIN32
+    r.base = r.aligned = std::malloc(bytes);
+    r.size = bytes;
+#else
+    // Over-reserve so the start can be aligned to a huge page boundary
+    const size_t alignment = huge_pages ? huge_page_size : page_size();
+    r.size = bytes + alignment;
+    void* base = mmap(nullptr, r.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return memory_reservation{};
+    }
+    r.base = base;
+    r.aligned = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(base) + alignment - 1) & ~(alignment - 1));
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) {
+        // Only a hint, transparent huge pages might not be available
+        madvise(r.aligned, bytes, MADV_HUGEPAGE);
+    }
+#endif
+#endif
+    return r;
+}
+
+void free_memory(const memory_reservation& r) {
+#ifdef _WIN32
+    std::free(r.base);
+#else
+    munmap(r.base, r.size);
+#endif
+}
+
+// Tell the operating system that the contents of the whole pages in [begin, end) are no longer needed
+void release_memory([[maybe_unused]] void* begin, [[maybe_unused]] void* end) {
+#ifndef _WIN32
+    const auto mask = ~(page_size() - 1);
+    const auto b = (reinterpret_cast<uintptr_t>(begin) + page_size() - 1) & mask;
+    const auto e = reinterpret_cast<uintptr_t>(end) & mask;
+    if (b < e) {
+        madvise(reinterpret_cast<void*>(b), e - b, MADV_DONTNEED);
+    }
+#endif
+}
+
 auto fmt(uint64_t n) { return number_formatter{n}; }
 template<typename T>
 auto hexfmt(T n) { return number_formatter{n}.base(16).width(2*sizeof(T)); }
@@ -56,51 +131,207 @@ namespace mjs {
 //
 
 uint32_t gc_type_info::num_types_;
+uint32_t gc_heap::num_weak_table_types_;
 const gc_type_info* gc_type_info::types_[gc_type_info::max_types];
 
+//
+// gc_heap_stats
+//
+
+std::wostream& operator<<(std::wostream& os, const gc_heap_stats& s) {
+    save_stream_state sss{os};
+    auto ms = [](std::chrono::nanoseconds ns) { return std::chrono::duration<double, std::milli>(ns).count(); };
+    os << std::fixed << std::setprecision(3);
+    os << "Collections: " << s.young_collections << " young, " << s.full_collections << " full\n";
+    os << "Pause: " << ms(s.total_pause) << " ms total, " << ms(s.max_pause) << " ms max\n";
+    os << "Allocated: " << s.bytes_allocated << " bytes, promoted: " << s.bytes_promoted << " bytes, freed: " << s.bytes_freed << " bytes\n";
+    os << std::setprecision(1) << "Survival rate: " << 100 * s.survival_rate() << "%\n";
+    return os;
+}
+
 //
 // gc_heap
 //
 
-gc_heap::gc_heap(uint32_t capacity) : storage_(static_cast<slot*>(std::malloc(capacity * sizeof(slot)))), capacity_(capacity) {
-    if (!storage_) {
-        throw std::runtime_error("Could not allocate heap for " + std::to_string(capacity) + " slots");
+struct gc_heap::pause_scope {
+    explicit pause_scope(gc_heap& heap) : heap(heap) {
+        if (heap.pause_depth_++ == 0) {
+            start = std::chrono::steady_clock::now();
+        }
     }
+
+    ~pause_scope() {
+        if (--heap.pause_depth_) {
+            return;
+        }
+        const auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        heap.stats_.total_pause += pause;
+        heap.stats_.max_pause = std::max(heap.stats_.max_pause, pause);
+        if (heap.full_collection_finished_) {
+            // Outside the pause so the tables can allocate (and get gc_heap_limit_exceeded rather than an abort when that fails).
+            // By index since the tables may create others.
+            heap.full_collection_finished_ = false;
+            for (size_t i = 0; i < heap.weak_tables_.size(); ++i) {
+                if (heap.weak_tables_[i]) {
+                    heap.weak_tables_[i]->full_collection_finished();
+                }
+            }
+        }
+        if (heap.collection_completed_) {
+            heap.collection_completed_ = false;
+            if (heap.collection_callback_) {
+                heap.collection_callback_(heap);
+            }
+        }
+    }
+
+    gc_heap& heap;
+    std::chrono::steady_clock::time_point start;
+};
+
+gc_heap::gc_heap(const gc_heap_config& config) : config_(config), storage_(nullptr), capacity_(config.initial_capacity), soft_limit_(config.soft_limit) {
+    if (config_.min_capacity > config_.initial_capacity || config_.initial_capacity > config_.max_capacity || !config_.max_capacity
+        || 2 * (static_cast<uint64_t>(config_.max_capacity) + config_.nursery_capacity) + config_.large_object_capacity > UINT32_MAX
+        || config_.growth_factor <= 1 || config_.shrink_factor <= 0 || config_.shrink_factor >= 1
+        || config_.shrink_occupancy < 0 || config_.shrink_occupancy >= config_.grow_occupancy || config_.grow_occupancy > 1
+        || config_.promotion_age < 1 || config_.promotion_age > UINT8_MAX
+        || config_.young_collection_trigger < 0 || config_.young_collection_trigger > 1 || config_.full_collection_trigger < 0
+        || config_.gc_threads < 1 || config_.gc_threads > max_gc_threads
+        || (config_.hard_limit && config_.soft_limit > config_.hard_limit)) {
+        throw std::runtime_error("Invalid gc_heap configuration");
+    }
+    // Reserve room for both halves at their maximum capacity (and the young generation and large object space) up front so the heap
+    // can grow without moving. The memory is only touched (and thus actually committed by most operating systems) as it's used.
+    const auto total_slots = 2 * (static_cast<size_t>(config_.max_capacity) + config_.nursery_capacity) + config_.large_object_capacity;
+    const auto r = reserve_memory(total_slots * sizeof(slot), config_.transparent_huge_pages);
+    if (!r.base) {
+        throw std::runtime_error("Could not allocate heap for " + std::to_string(total_slots) + " slots");
+    }
+    reservation_ = r.base;
+    reservation_size_ = r.size;
+    storage_ = static_cast<slot*>(r.aligned);
+    young_begin_ = young_next_ = young_base();
+    large_next_ = large_base();
+    capacity_ = std::min(capacity_, capacity_limit());
+    young_collection_limit_ = has_young_generation() && config_.young_collection_trigger > 0 ? std::max(1u, static_cast<uint32_t>(config_.young_collection_trigger * config_.nursery_capacity)) : UINT32_MAX;
+    update_full_collection_limit();
 }
 
 gc_heap::~gc_heap() {
+    if (gc_state_.kind == collection_kind::full) {
+        // Abandon the incremental collection in progress (objects that have already been moved are destroyed at their new position)
+        for (auto& pos: destructibles_) {
+            pos = current_position(pos);
+        }
+        gc_state_.rescan.clear();
+        gc_state_.weak.clear();
+        gc_state_.to_free = gc_state_.scan = 0;
+        gc_state_.kind = collection_kind::none;
+    }
     assert(gc_state_.initial_state());
-    run_destructors();
-    std::free(storage_);
+    for (const auto pos: destructibles_) {
+        storage_[pos-1].allocation.type_info().destroy(&storage_[pos]);
+    }
+    destructibles_.clear();
+    assert(pointers_.empty());
+    assert(handles_.empty() && !handle_scopes_);
+    memory_reservation r;
+    r.base = reservation_;
+    r.size = reservation_size_;
+    free_memory(r);
 }
 
-void gc_heap::run_destructors() {
-    for (uint32_t pos = 0; pos < next_free_;) {
-        const auto a = storage_[pos].allocation;
-        if (a.active()) {
-            a.type_info().destroy(&storage_[pos+1]);
+void gc_heap::sample_allocations(uint64_t interval, allocation_sampler sampler) {
+    sampler_ = std::move(sampler);
+    if (!sampler_ || !interval) {
+        sampler_ = nullptr;
+        sample_countdown_ = INT64_MAX;
+        return;
+    }
+    sample_interval_ = interval;
+    sample_random_ = reinterpret_cast<uintptr_t>(this) ^ 0x9e3779b97f4a7c15ULL;
+    sample_countdown_ = static_cast<int64_t>(next_sample_interval());
+}
+
+uint64_t gc_heap::next_sample_interval() {
+    // xorshift64*, the quality doesn't matter much here
+    sample_random_ ^= sample_random_ >> 12;
+    sample_random_ ^= sample_random_ << 25;
+    sample_random_ ^= sample_random_ >> 27;
+    const auto r = (sample_random_ * 0x2545f4914f6cdd1dULL) >> 11; // 53 bits
+    const double u = (r + 0.5) / static_cast<double>(1ULL << 53); // In (0, 1)
+    return static_cast<uint64_t>(-std::log(u) * sample_interval_) + 1;
+}
+
+bool gc_heap::start_sample() {
+    sample_countdown_ = static_cast<int64_t>(next_sample_interval());
+    return sampler_ != nullptr;
+}
+
+void gc_heap::sample_allocation(uint32_t pos) {
+    const auto& a = storage_[pos-1].allocation;
+    // With exponentially distributed intervals an allocation of 'size' bytes is sampled with probability 1 - exp(-size/interval),
+    // so weighing it with the inverse of that gives an unbiased estimate (and exactly 'size' for huge allocations)
+    const double size = static_cast<double>(a.size) * slot_size;
+    const auto bytes = static_cast<uint64_t>(size / -std::expm1(-size / sample_interval_) + 0.5);
+    sampler_(a.type_info(), &storage_[pos], bytes);
+}
+
+void gc_heap::release_pages(uint32_t begin, uint32_t end) {
+    if (config_.release_memory && begin < end) {
+        release_memory(&storage_[begin], &storage_[end]);
+    }
+}
+
+void gc_heap::destroy_dead_objects() {
+    // Only objects that need to be destroyed are visited, the rest of the garbage is simply left behind
+    size_t kept = 0;
+    for (const auto pos: destructibles_) {
+        const auto& a = storage_[pos-1].allocation;
+        if (gc_state_.kind == collection_kind::young && !is_young_position(pos)) {
+            // Old objects aren't collected by young collections
+            destructibles_[kept++] = pos;
+        } else if (a.type == gc_moved_type_index) {
+            destructibles_[kept++] = storage_[pos].new_position;
+        } else {
+            assert(a.active());
+            a.type_info().destroy(&storage_[pos]);
         }
-        pos += a.size;
     }
-    assert(pointers_.empty());
+    destructibles_.resize(kept);
 }
 
 void gc_heap::debug_print(std::wostream& os) const {
     const int size_w = 4;
     const int pos_w = 8;
     const int tt_width = 25;
-    os << "Heap:\n";
-    for (uint32_t pos = 0; pos < next_free_;) {
-        const auto a = storage_[pos].allocation;
-        os << fmt(pos+1).width(pos_w) << " size: " << fmt(a.size).width(size_w) << " type: " << fmt(a.type).width(2) << " ";
-        if (a.active()) {
-            {
-                save_stream_state sss{os};
-                os << std::left << std::setw(tt_width) << a.type_info().name();
+    auto print_space = [&](const char* name, uint32_t begin, uint32_t end) {
+        os << name << ":\n";
+        for (uint32_t pos = begin; pos < end;) {
+            const auto a = storage_[pos].allocation;
+            os << fmt(pos+1).width(pos_w) << " size: " << fmt(a.size).width(size_w) << " type: " << fmt(a.type).width(2) << " ";
+            if (a.active()) {
+                {
+                    save_stream_state sss{os};
+                    os << std::left << std::setw(tt_width) << a.type_info().name();
+                }
+            }
+            if (a.flags & remembered_flag) {
+                os << " (remembered)";
             }
+            os << "\n";
+            pos += a.size;
         }
-        os << "\n";
-        pos += a.size;
+    };
+    print_space("Heap", space_begin_, next_free_);
+    if (gc_state_.kind == collection_kind::full) {
+        print_space("To-space", other_space_begin(), gc_state_.to_free);
+    }
+    if (has_young_generation()) {
+        print_space("Young generation", young_begin_, young_next_);
+    }
+    if (large_next_ != large_base()) {
+        print_space("Large objects", large_base(), large_next_);
     }
     os << "Pointers:\n";
     for (auto p: pointers_) {
@@ -121,68 +352,521 @@ void gc_heap::debug_print(std::wostream& os) const {
         }
         os << "\n";
     }
+    os << "Handles: " << handles_.size() << " in " << handle_scopes_ << " scope(s)\n";
+}
+
+template<typename F>
+void gc_heap::for_each_active_allocation(F f) const {
+    auto visit_space = [&](uint32_t begin, uint32_t end) {
+        for (uint32_t pos = begin; pos < end;) {
+            const auto a = storage_[pos].allocation;
+            if (a.active()) {
+                f(a);
+            }
+            pos += a.size;
+        }
+    };
+    visit_space(space_begin_, next_free_);
+    visit_space(young_begin_, young_next_);
+    visit_space(large_base(), large_next_);
+    if (gc_state_.kind == collection_kind::full) {
+        visit_space(other_space_begin(), gc_state_.to_free);
+    }
 }
 
 uint32_t gc_heap::calc_used() const {
     uint32_t used = 0;
-    for (uint32_t pos = 0; pos < next_free_;) {
-        const auto a = storage_[pos].allocation;
-        if (a.active()) {
-            used += a.size;
+    for_each_active_allocation([&](const slot_allocation_header& a) { used += a.size; });
+    return used;
+}
+
+std::vector<gc_type_stats> gc_heap::type_statistics() const {
+    std::vector<gc_type_stats> result;
+    for (uint32_t i = 0; i < gc_type_info::num_types(); ++i) {
+        result.push_back(gc_type_stats{i, gc_type_info::from_index(i).name(), 0, 0});
+    }
+    for_each_active_allocation([&](const slot_allocation_header& a) {
+        auto& ts = result[a.type];
+        ++ts.count;
+        ts.bytes += static_cast<uint64_t>(a.size) * slot_size;
+    });
+    return result;
+}
+
+void gc_heap::write_snapshot(std::ostream& os) {
+    if (gc_state_.kind == collection_kind::full) {
+        pause_scope pause{*this};
+        finish_full_collection();
+    }
+    assert(gc_state_.initial_state());
+
+    auto put = [&os](uint32_t n) {
+        os.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    };
+    auto put_string = [&](auto s) {
+        put(static_cast<uint32_t>(s.size()));
+        for (const auto ch: s) {
+            os.put(static_cast<uint32_t>(ch) < 0x80 ? static_cast<char>(ch) : '?');
         }
-        pos += a.size;
+    };
+
+    os.write("MJSHEAP", 8);
+    put(1);
+    put(slot_size);
+
+    put(gc_type_info::num_types());
+    for (uint32_t i = 0; i < gc_type_info::num_types(); ++i) {
+        put_string(std::string_view{gc_type_info::from_index(i).name()});
     }
-    return used;
+
+    // Tracked pointers inside objects are edges of the objects containing them, ordered by address to match the heap walk below
+    std::vector<std::pair<uint32_t, uint32_t>> internal_pointers;
+    std::vector<uint32_t> roots;
+    for (const auto p: pointers_) {
+        if (is_internal(p)) {
+            internal_pointers.emplace_back(position_of(p), p->pos_);
+        } else {
+            roots.push_back(p->pos_);
+        }
+    }
+    roots.insert(roots.end(), handles_.begin(), handles_.end());
+    std::sort(internal_pointers.begin(), internal_pointers.end());
+    put(static_cast<uint32_t>(roots.size()));
+    for (const auto pos: roots) {
+        put(pos);
+    }
+
+    // The spaces are visited in order of their positions
+    std::vector<uint32_t> edges;
+    auto internal_it = internal_pointers.cbegin();
+    auto write_space = [&](uint32_t begin, uint32_t end) {
+        for (uint32_t pos = begin; pos < end;) {
+            const auto a = storage_[pos].allocation;
+            if (a.active()) {
+                const auto& type_info = a.type_info();
+                edges.clear();
+                if (type_info.has_fixup()) {
+                    // Let the object report its untracked pointers (see register_fixup)
+                    snapshot_edges_ = &edges;
+                    type_info.fixup(&storage_[pos+1]);
+                    snapshot_edges_ = nullptr;
+                }
+                for (; internal_it != internal_pointers.cend() && internal_it->first < pos + a.size; ++internal_it) {
+                    assert(internal_it->first > pos);
+                    edges.push_back(internal_it->second);
+                }
+                put(pos + 1);
+                put(a.size);
+                put(a.type);
+                put_string(type_info.snapshot_label(&storage_[pos+1]));
+                put(static_cast<uint32_t>(edges.size()));
+                for (const auto e: edges) {
+                    put(e);
+                }
+            }
+            pos += a.size;
+        }
+    };
+    write_space(space_begin_, next_free_);
+    write_space(young_begin_, young_next_);
+    write_space(large_base(), large_next_);
+    assert(internal_it == internal_pointers.cend());
+    put(0);
+}
+
+void gc_heap::collection_completed(bool full, uint64_t before, uint64_t after) {
+    ++(full ? stats_.full_collections : stats_.young_collections);
+    stats_.bytes_survived += after * slot_size;
+    stats_.bytes_freed += (before > after ? before - after : 0) * slot_size;
+    collection_completed_ = true;
 }
 
 void gc_heap::garbage_collect() {
+    pause_scope pause{*this};
+    if (gc_state_.kind == collection_kind::full) {
+        finish_full_collection();
+    }
+    if (config_.gc_threads > 1) {
+        parallel_full_collection();
+        return;
+    }
+    start_full_collection();
+    finish_full_collection();
+}
+
+bool gc_heap::garbage_collect_incremental(std::chrono::microseconds budget) {
+    pause_scope pause{*this};
+    const auto deadline = std::chrono::steady_clock::now() + budget;
+    if (gc_state_.kind == collection_kind::none) {
+        start_full_collection();
+    }
+    assert(gc_state_.kind == collection_kind::full);
+
+    // Scan gray objects until there are none left or the time is up. Checking the clock isn't free, so only do it every so often.
+    for (uint32_t count = 1; scan_next_object(); ++count) {
+        if (count % 64 == 0 && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+    }
+
+    finish_full_collection();
+    return true;
+}
+
+bool gc_heap::notify_idle(std::chrono::microseconds idle_time) {
+    pause_scope pause{*this};
+    if (gc_state_.kind == collection_kind::none) {
+        const auto deadline = std::chrono::steady_clock::now() + idle_time;
+        garbage_collect_young();
+        // Only start a full collection if the old generation has grown noticeably since the last one
+        if (old_generation_used() <= used_after_full_collection_ + config_.min_capacity / 4) {
+            return true;
+        }
+        idle_time = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+    }
+    return garbage_collect_incremental(idle_time);
+}
+
+void gc_heap::start_full_collection() {
     assert(gc_state_.initial_state());
 
-    // Determine roots and add their positions as pending fixups
+    // Copy everything reachable (from both generations) to the other old half (to-space). The to-space
+    // may have to grow beyond the current capacity since the young generation is evacuated as well.
+    gc_state_.kind = collection_kind::full;
+    gc_state_.to_free = gc_state_.scan = other_space_begin();
+
+    // Move the objects directly referenced by the roots right away. The tracked pointers can go away
+    // (or change) if the collection is interleaved with other work, so they can't be kept around.
     // TODO: Used to move the roots lower in the pointers_ array (since we know they won't be destroyed this time around). That still might be an optimization.
     for (auto p: pointers_) {
         if (!is_internal(p)) {
-            register_fixup(p->pos_);
+            gc_state_.pending.push_back(&p->pos_);
         }
     }
+    for (auto& pos: handles_) {
+        gc_state_.pending.push_back(&pos);
+    }
+    process_pending();
+}
 
-    if (!gc_state_.pending_fixups.empty()) {
-        gc_heap new_heap{capacity_}; // TODO: Allow resize
+void gc_heap::finish_full_collection() {
+    assert(gc_state_.kind == collection_kind::full);
 
-        gc_state_.new_heap = &new_heap;
-        gc_state_.level = 0;
+    // If the collection was done incrementally new roots might have been created (and internal pointers
+    // of already scanned objects changed) in the mean time
+    for (auto p: pointers_) {
+        if ((!is_internal(p) || is_to_space_position(position_of(p))) && !is_to_space_position(p->pos_)) {
+            gc_state_.pending.push_back(&p->pos_);
+        }
+    }
+    for (auto& pos: handles_) {
+        if (!is_to_space_position(pos)) {
+            gc_state_.pending.push_back(&pos);
+        }
+    }
+    process_pending();
+    while (scan_next_object()) {
+    }
+    resolve_weak_pointers();
+
+    // Destroy what was left behind and switch roles. The old half is kept around for the next collection.
+    // Nothing is left in the young generation and no (new) object needs to be remembered.
+    const uint64_t used_before = static_cast<uint64_t>(next_free_ - space_begin_) + (young_next_ - young_begin_) + large_used_;
+    destroy_dead_objects();
+    sweep_large_objects();
+    collection_completed(true, used_before, static_cast<uint64_t>(gc_state_.to_free - other_space_begin()) + large_used_);
+    space_begin_ = other_space_begin();
+    next_free_ = gc_state_.to_free;
+    young_next_ = young_begin_;
+    remembered_.clear();
+    gc_state_.to_free = gc_state_.scan = 0;
+    gc_state_.kind = collection_kind::none;
+
+    used_after_full_collection_ = old_generation_used();
+    resize_after_collection();
+    update_full_collection_limit();
+
+    assert(gc_state_.initial_state());
 
-        // Keep going while there are still fixups to be processed (note: the array changes between loop iterations)
-        while (!gc_state_.pending_fixups.empty()) {
-            auto ppos = gc_state_.pending_fixups.back();
-            gc_state_.pending_fixups.pop_back();
-            *ppos = gc_move(*ppos);
+    // The weak tables are notified once the pause ends
+    full_collection_finished_ = true;
+}
+
+void gc_heap::garbage_collect_young() {
+    pause_scope pause{*this};
+    if (gc_state_.kind == collection_kind::full) {
+        // Finishing the full collection also empties the young generation
+        finish_full_collection();
+        return;
+    }
+
+    assert(gc_state_.initial_state());
+
+    if (!has_young_generation()) {
+        return;
+    }
+
+    // Survivors are copied to the other young half or promoted to the end of the active old half,
+    // both areas are scanned in order.
+    gc_state_.kind = collection_kind::young;
+    gc_state_.to_free = gc_state_.scan = other_young_begin();
+    gc_state_.promoted_scan = next_free_;
+    const auto old_end = next_free_;
+
+    // Roots are all tracked pointers that aren't themselves part of a young object. This includes
+    // internal pointers of old objects.
+    for (auto p: pointers_) {
+        if (!is_young_address(p) && is_young_position(p->pos_)) {
+            gc_state_.pending.push_back(&p->pos_);
         }
+    }
+    for (auto& pos: handles_) {
+        if (is_young_position(pos)) {
+            gc_state_.pending.push_back(&pos);
+        }
+    }
+    process_pending();
 
-        std::swap(storage_, new_heap.storage_);
-        std::swap(next_free_, new_heap.next_free_);
-        gc_state_.new_heap = nullptr;
-        // new_heap's destructor checks that it doesn't contain pointers
-    } else {
-        run_destructors();
-        next_free_ = 0;
+    // And the contents of the remembered old objects. The remembered set is rebuilt while scanning.
+    std::vector<uint32_t> remembered;
+    remembered.swap(remembered_);
+    for (const auto pos: remembered) {
+        auto& a = storage_[pos-1].allocation;
+        assert(a.flags & remembered_flag);
+        a.flags &= ~remembered_flag;
+        if (a.active()) {
+            scan_object(pos);
+        }
+    }
+
+    while (scan_next_object()) {
     }
+    resolve_weak_pointers();
+
+    // Destroy what was left behind and switch roles
+    const uint32_t promoted = next_free_ - old_end;
+    stats_.bytes_promoted += static_cast<uint64_t>(promoted) * slot_size;
+    collection_completed(false, young_next_ - young_begin_, (gc_state_.to_free - other_young_begin()) + promoted);
+    destroy_dead_objects();
+    young_begin_ = other_young_begin();
+    young_next_ = gc_state_.to_free;
+    gc_state_.to_free = gc_state_.scan = gc_state_.promoted_scan = 0;
+    gc_state_.kind = collection_kind::none;
 
     assert(gc_state_.initial_state());
 }
 
-uint32_t gc_heap::gc_move(const uint32_t pos) {
-    struct auto_level {
-        auto_level(uint32_t& l) : l(l) { ++l; assert(l < 4 && "Arbitrary recursion level reached"); }
-        ~auto_level() { --l; }
-        uint32_t& l;
-    } al{gc_state_.level};
+bool gc_heap::scan_next_object() {
+    uint32_t pos;
+    if (!gc_state_.rescan.empty()) {
+        pos = gc_state_.rescan.back();
+        gc_state_.rescan.pop_back();
+        auto& a = storage_[pos-1].allocation;
+        assert(a.flags & gray_flag);
+        a.flags &= ~gray_flag;
+    } else if (gc_state_.scan < gc_state_.to_free) {
+        pos = gc_state_.scan + 1;
+        gc_state_.scan += storage_[gc_state_.scan].allocation.size;
+    } else if (gc_state_.kind == collection_kind::young && gc_state_.promoted_scan < next_free_) {
+        pos = gc_state_.promoted_scan + 1;
+        gc_state_.promoted_scan += storage_[gc_state_.promoted_scan].allocation.size;
+    } else {
+        return false;
+    }
+    scan_object(pos);
+    return true;
+}
 
-    assert(pos > 0 && pos < next_free_);
+void gc_heap::scan_object(uint32_t pos) {
+    const auto& type_info = storage_[pos-1].allocation.type_info();
+    if (type_info.has_fixup()) {
+        // Let the object fix up its untracked pointers (see register_fixup)
+        gc_state_.owner = pos;
+        type_info.fixup(&storage_[pos]);
+        gc_state_.owner = 0;
+        process_pending();
+    }
+}
+
+void gc_heap::process_pending() {
+    // Note: the array may grow while moving objects
+    while (!gc_state_.pending.empty()) {
+        auto ppos = gc_state_.pending.back();
+        gc_state_.pending.pop_back();
+        register_fixup(*ppos);
+    }
+}
+
+void gc_heap::make_gray(uint32_t pos) {
+    // Objects the scan hasn't reached yet don't need to be remembered (large objects are scanned once they're marked)
+    auto& a = storage_[pos-1].allocation;
+    const bool reached = is_large_position(pos) ? (a.flags & marked_flag) != 0 : pos - 1 < gc_state_.scan;
+    if (reached && !(a.flags & gray_flag)) {
+        a.flags |= gray_flag;
+        gc_state_.rescan.push_back(pos);
+    }
+}
+
+void gc_heap::mark_large(uint32_t pos) {
+    // Large objects stay where they are, but must still be scanned (once)
+    auto& a = storage_[pos-1].allocation;
+    assert(a.active());
+    if (!(a.flags & marked_flag)) {
+        a.flags |= marked_flag | gray_flag;
+        gc_state_.rescan.push_back(pos);
+    }
+}
+
+void gc_heap::sweep_large_objects() {
+    // Adjacent free blocks are merged, a free block at the end is given back to the unused part of the space
+    large_free_.clear();
+    large_used_ = 0;
+    uint32_t free_begin = 0;
+    auto end_free_block = [&](uint32_t end) {
+        if (free_begin) {
+            auto& f = storage_[free_begin].allocation;
+            f.size = end - free_begin;
+            f.type = uninitialized_type_index;
+            f.age = 0;
+            f.flags = 0;
+            large_free_.push_back(free_begin);
+            free_begin = 0;
+        }
+    };
+    const auto old_end = large_next_;
+    for (uint32_t pos = large_base(); pos < large_next_;) {
+        auto& a = storage_[pos].allocation;
+        const auto size = a.size;
+        if (a.active() && (a.flags & marked_flag)) {
+            if (free_begin) {
+                // Keep the header of the free block
+                release_pages(free_begin + 1, pos);
+            }
+            end_free_block(pos);
+            // The remembered set has been cleared
+            a.flags = 0;
+            large_used_ += size;
+        } else {
+            // Large objects never need to be destroyed
+            assert(!a.active() || !a.type_info().needs_destroy());
+            if (!free_begin) {
+                free_begin = pos;
+            }
+        }
+        pos += size;
+    }
+    if (free_begin) {
+        large_next_ = free_begin;
+    }
+    release_pages(large_next_, old_end);
+}
+
+void gc_heap::resize_after_collection() {
+    // Everything in the active half is live right after a collection
+    const double used = next_free_ - space_begin_;
+    double new_capacity = capacity_;
+    if (used > config_.grow_occupancy * capacity_) {
+        new_capacity = std::max(capacity_ * config_.growth_factor, used / config_.grow_occupancy);
+    } else if (used < config_.shrink_occupancy * capacity_) {
+        // Don't shrink so much that the next collection would immediately grow the heap again
+        new_capacity = std::max(capacity_ * config_.shrink_factor, used / config_.grow_occupancy);
+    }
+    const auto old_capacity = capacity_;
+    capacity_ = static_cast<uint32_t>(std::clamp(new_capacity, static_cast<double>(config_.min_capacity), static_cast<double>(config_.max_capacity)));
+    capacity_ = std::min(capacity_, capacity_limit());
+    assert(next_free_ - space_begin_ <= capacity_);
+
+    // Neither half can use the memory past the new capacity, so give it back. Only doing this when shrinking (rather than
+    // releasing everything that's not live after each collection) keeps the pause short and avoids faulting the same pages
+    // back in when the heap is in a steady state.
+    if (capacity_ < old_capacity) {
+        release_pages(space_begin_ + capacity_, space_begin_ + old_capacity);
+        release_pages(other_space_begin() + capacity_, other_space_begin() + old_capacity);
+    }
+}
+
+void gc_heap::update_full_collection_limit() {
+    if (config_.full_collection_trigger == 0) {
+        full_collection_limit_ = UINT32_MAX;
+        return;
+    }
+    // Allow the old generation to grow relative to what's live, but don't collect tiny heaps all the time and
+    // make sure to collect while the heap can still grow
+    const double used = used_after_full_collection_;
+    double limit = std::min(std::max(used * (1 + config_.full_collection_trigger), config_.min_capacity * config_.grow_occupancy), config_.max_capacity * config_.grow_occupancy);
+    if (soft_limit_) {
+        // Get under the soft limit by collecting before asking the embedder
+        limit = std::min(limit, static_cast<double>(soft_limit_ / slot_size));
+    }
+    if (config_.hard_limit) {
+        // And don't give up on the hard limit before having collected
+        limit = std::min(limit, static_cast<double>(config_.hard_limit / slot_size));
+    }
+    full_collection_limit_ = std::max(used_after_full_collection_ + 1, static_cast<uint32_t>(limit));
+}
+
+void gc_heap::automatic_collection() {
+    {
+        pause_scope pause{*this};
+        if (young_next_ - young_begin_ >= young_collection_limit_ || collection_in_progress()) {
+            // Also finishes an incremental collection in progress
+            garbage_collect_young();
+        }
+        // Promoted objects might have pushed the old generation over the limit
+        if (old_generation_used() >= full_collection_limit_) {
+            garbage_collect();
+        }
+    }
+    // Outside the pause since the callback may collect garbage itself
+    check_limits();
+}
+
+void gc_heap::check_limits() {
+    // Objects promoted by collections don't count against the hard limit when they're copied, so check here as well
+    if (config_.hard_limit && static_cast<uint64_t>(old_generation_used()) * slot_size > config_.hard_limit) {
+        throw gc_heap_limit_exceeded{static_cast<uint64_t>(old_generation_used()) * slot_size, config_.hard_limit};
+    }
+    if (!soft_limit_callback_ || !soft_limit_ || static_cast<uint64_t>(old_generation_used()) * slot_size <= soft_limit_) {
+        return;
+    }
+    const auto new_limit = soft_limit_callback_(*this, static_cast<uint64_t>(old_generation_used()) * slot_size);
+    const auto used = static_cast<uint64_t>(old_generation_used()) * slot_size;
+    if (!new_limit || used > new_limit) {
+        throw gc_heap_limit_exceeded{used, new_limit ? new_limit : soft_limit_};
+    }
+    soft_limit_ = new_limit;
+    if (config_.hard_limit) {
+        soft_limit_ = std::min(soft_limit_, config_.hard_limit);
+    }
+    update_full_collection_limit();
+}
+
+uint32_t gc_heap::capacity_limit() const {
+    uint64_t limit = config_.max_capacity;
+    if (config_.hard_limit) {
+        const uint64_t hard_slots = config_.hard_limit / slot_size;
+        limit = std::min(limit, hard_slots > large_used_ ? hard_slots - large_used_ : 0);
+    }
+    // Never below what's already in use
+    return static_cast<uint32_t>(std::max(limit, static_cast<uint64_t>(next_free_ - space_begin_)));
+}
+
+void gc_heap::limit_exceeded(uint64_t num_slots, uint64_t limit_slots) {
+    if (pause_depth_) {
+        // Copying live objects (or promoting them) can't be undone, there's no way to recover
+        assert(!"Ran out of heap");
+        std::abort();
+    }
+    throw gc_heap_limit_exceeded{(static_cast<uint64_t>(old_generation_used()) + num_slots) * slot_size, limit_slots * slot_size};
+}
+
+uint32_t gc_heap::gc_move(const uint32_t pos) {
+    assert(is_active_position(pos));
+    assert(gc_state_.kind == collection_kind::full || is_young_position(pos));
 
     auto& a = storage_[pos-1].allocation;
     assert(a.type != uninitialized_type_index);
-    assert(a.size > 1 && a.size <= next_free_ - (pos - 1));
+    assert(a.size > 1 && a.size <= (is_young_position(pos) ? young_next_ : next_free_) - (pos - 1));
 
     if (a.type == gc_moved_type_index) {
         return storage_[pos].new_position;
@@ -190,31 +874,63 @@ uint32_t gc_heap::gc_move(const uint32_t pos) {
 
     assert(a.type < gc_type_info::num_types());
 
-    // Allocate memory block in new_heap of the same size
-    auto& new_heap = *gc_state_.new_heap;
-    const auto new_pos = new_heap.allocate((a.size-1)*slot_size) + 1;
-    auto& new_a = new_heap.storage_[new_pos - 1].allocation;
-    auto* const new_p = &new_heap.storage_[new_pos];
-    assert(new_a.type == uninitialized_type_index && new_a.size == a.size);
+    // Allocate memory block of the same size in the to-space. Young objects stay in the young generation
+    // until they've survived enough collections (the young to-space always has room for them).
+    uint32_t new_pos;
+    uint8_t new_age = 0;
+    if (gc_state_.kind == collection_kind::young && a.age + 1u < config_.promotion_age) {
+        assert(gc_state_.to_free + a.size <= other_young_begin() + config_.nursery_capacity);
+        new_pos = gc_state_.to_free + 1;
+        gc_state_.to_free += a.size;
+        new_age = static_cast<uint8_t>(a.age + 1);
+    } else if (gc_state_.kind == collection_kind::young) {
+        new_pos = allocate_old(a.size) + 1;
+    } else {
+        assert(gc_state_.kind == collection_kind::full);
+        // The old generation can be (almost) full when the young survivors are promoted into it, so this can't just be
+        // assumed. Like in the parallel collector running out here is fatal, as moved objects can't be put back.
+        if (a.size > other_space_begin() + config_.max_capacity - gc_state_.to_free) {
+            assert(!"To-space exhausted");
+            std::abort();
+        }
+        new_pos = gc_state_.to_free + 1;
+        gc_state_.to_free += a.size;
+    }
+    auto& new_a = storage_[new_pos - 1].allocation;
+    auto* const new_p = &storage_[new_pos];
+    new_a.size = a.size;
+    new_a.type = uninitialized_type_index;
+    new_a.age = new_age;
+    new_a.flags = 0;
+
+    const auto& type_info = a.type_info();
+    void* const p = &storage_[pos];
+    if (type_info.is_trivially_relocatable()) {
+        // No tracked pointers are involved, so just copy the bytes
+        std::memcpy(new_p, p, (a.size - 1) * sizeof(slot));
+        new_a.type = a.type;
+        a.type = gc_moved_type_index;
+        storage_[pos].new_position = new_pos;
+        return new_pos;
+    }
 
     // Record number of pointers that exist before constructing the new object
     const auto num_pointers_initially = pointers_.size();
 
     // Move the object to its new position
-    const auto& type_info = a.type_info();
-    void* const p = &storage_[pos];
     type_info.move(new_p, p);
     new_a.type = a.type;
 
-    // Register fixups for the position of all internal pointers that were created by the move (construction)
+    // The positions of all internal pointers that were created by the move (construction) are fixed up
+    // once this object has been moved (to avoid recursion).
     // The new pointers will be at the end of the pointer set since they were just added
     // Note this obviously makes assumption about the pointer_set implementation!
     // TODO: Used to move the pointers lower in the pointers_ array (since we know they won't be destroyed this time around). That still might be an optimization.
     if (const auto num_internal_pointers  = pointers_.size() - num_pointers_initially) {
         auto ps = pointers_.data();
         for (uint32_t i = 0; i < num_internal_pointers; ++i) {
-            assert(reinterpret_cast<uintptr_t>(ps[num_pointers_initially+i]) >= reinterpret_cast<uintptr_t>(new_p) && reinterpret_cast<uintptr_t>(ps[num_pointers_initially+i]) < reinterpret_cast<uintptr_t>(&new_heap.storage_[new_pos] + a.size - 1));
-            register_fixup(ps[num_pointers_initially+i]->pos_);
+            assert(reinterpret_cast<uintptr_t>(ps[num_pointers_initially+i]) >= reinterpret_cast<uintptr_t>(new_p) && reinterpret_cast<uintptr_t>(ps[num_pointers_initially+i]) < reinterpret_cast<uintptr_t>(&storage_[new_pos] + a.size - 1));
+            gc_state_.pending.push_back(&ps[num_pointers_initially+i]->pos_);
         }
     }
 
@@ -228,38 +944,517 @@ uint32_t gc_heap::gc_move(const uint32_t pos) {
     a.type = gc_moved_type_index;
     storage_[pos].new_position = new_pos;
 
-    // After changing the allocation header infinite recursion can now be avoided when copying the internal pointers.
-
-    // Let the object register its fixup
-    type_info.fixup(new_p);
+    // The object's untracked pointers are fixed up when the scan reaches it
 
     return new_pos;
 }
 
 void gc_heap::register_fixup(uint32_t& pos) {
-    gc_state_.pending_fixups.push_back(&pos);
+    if (snapshot_edges_) {
+        snapshot_edges_->push_back(pos);
+        return;
+    }
+    if (current_worker_) {
+        pos = parallel_move(*current_worker_, pos);
+        return;
+    }
+    if (gc_state_.kind == collection_kind::young ? !is_young_position(pos) : is_to_space_position(pos)) {
+        // Old objects don't move in young collections and objects in the to-space have already been moved
+        return;
+    }
+    if (is_large_position(pos)) {
+        mark_large(pos);
+        return;
+    }
+    pos = gc_move(pos);
+    // An old object (remembered or just promoted) that still points into the young generation must be remembered
+    if (gc_state_.kind == collection_kind::young && gc_state_.owner && pos >= young_base() && is_old_or_large_position(gc_state_.owner)) {
+        remember(gc_state_.owner);
+    }
+}
+
+//
+// Parallel collection
+//
+
+namespace {
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && std::atomic<uint64_t>::is_always_lock_free);
+
+// Allocation headers are only accessed atomically while a parallel collection is running
+std::atomic<uint64_t>& as_atomic(uint64_t& repr) {
+    return reinterpret_cast<std::atomic<uint64_t>&>(repr);
+}
+
+} // unnamed namespace
+
+thread_local gc_heap::parallel_worker* gc_heap::current_worker_ = nullptr;
+
+struct gc_heap::parallel_collection {
+    static constexpr uint32_t lab_size = 512; // Size (in slots) of the chunks the workers allocate in the to-space
+
+    explicit parallel_collection(uint32_t num_workers, uint32_t to_free) : num_workers(num_workers), to_free(to_free), active(num_workers) {}
+
+    const uint32_t                                num_workers;
+    std::vector<std::unique_ptr<parallel_worker>> workers;
+    std::vector<uint32_t*>                        roots;
+    std::atomic<uint32_t>                         to_free;
+    std::atomic<uint32_t>                         active;         // Number of workers that might still have (or produce) work
+    std::mutex                                    pointers_mutex; // Held while moving objects that might construct/destroy tracked pointers
+};
+
+// Each worker pushes and pops the objects it has copied (and must scan) at the back of its local stack. Some of the
+// work is moved to the shared part whenever it's empty, other workers steal from there when they run out of work.
+struct gc_heap::parallel_worker {
+    static constexpr size_t share_threshold = 64;
+
+    explicit parallel_worker(parallel_collection& collection) : collection(collection) {}
+
+    parallel_collection&   collection;
+    std::vector<uint32_t>  local;         // Positions of copied objects that haven't been scanned yet
+    std::vector<uint32_t*> pending;       // Positions of tracked pointers inside copied objects
+    std::vector<uint32_t*> weak;          // Weak pointers found while scanning
+    std::mutex             shared_mutex;
+    std::vector<uint32_t>  shared;
+    std::atomic<size_t>    shared_size{0};
+    uint32_t               lab_next = 0;  // Local allocation buffer in the to-space
+    uint32_t               lab_end = 0;
+
+    void push(uint32_t pos) {
+        local.push_back(pos);
+        if (local.size() >= share_threshold && shared_size.load(std::memory_order_relaxed) == 0) {
+            std::lock_guard<std::mutex> lock{shared_mutex};
+            const auto n = local.size() / 2;
+            shared.insert(shared.end(), local.end() - n, local.end());
+            local.resize(local.size() - n);
+            shared_size.store(shared.size(), std::memory_order_relaxed);
+        }
+    }
+
+    // Move (up to) half of the shared work to the local stack of 'to'
+    bool steal_into(parallel_worker& to) {
+        if (shared_size.load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock{shared_mutex};
+        if (shared.empty()) {
+            return false;
+        }
+        const auto n = (shared.size() + 1) / 2;
+        to.local.insert(to.local.end(), shared.end() - n, shared.end());
+        shared.resize(shared.size() - n);
+        shared_size.store(shared.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    bool find_work(uint32_t index) {
+        const auto& workers = collection.workers;
+        for (uint32_t i = 0; i < workers.size(); ++i) {
+            if (workers[(index + i) % workers.size()]->steal_into(*this)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+void gc_heap::parallel_full_collection() {
+    assert(gc_state_.initial_state());
+    gc_state_.kind = collection_kind::full;
+
+    // Since the mutator isn't running the roots can be gathered up front (the incremental collector can't do this)
+    parallel_collection pc{config_.gc_threads, other_space_begin()};
+    for (auto p: pointers_) {
+        if (!is_internal(p)) {
+            pc.roots.push_back(&p->pos_);
+        }
+    }
+    for (auto& pos: handles_) {
+        pc.roots.push_back(&pos);
+    }
+    for (uint32_t i = 0; i < pc.num_workers; ++i) {
+        pc.workers.push_back(std::make_unique<parallel_worker>(pc));
+    }
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < pc.num_workers; ++i) {
+        threads.emplace_back([this, &pc, i] { run_parallel_worker(pc, *pc.workers[i]); });
+    }
+    run_parallel_worker(pc, *pc.workers[0]);
+    for (auto& t: threads) {
+        t.join();
+    }
+    for (const auto& w: pc.workers) {
+        gc_state_.weak.insert(gc_state_.weak.end(), w->weak.begin(), w->weak.end());
+    }
+
+    // Everything reachable has been copied and scanned, finishing only has to clean up
+    gc_state_.to_free = gc_state_.scan = pc.to_free.load();
+    finish_full_collection();
+}
+
+void gc_heap::run_parallel_worker(parallel_collection& pc, parallel_worker& w) {
+    current_worker_ = &w;
+    const auto index = static_cast<uint32_t>(std::find_if(pc.workers.begin(), pc.workers.end(), [&w](const auto& p) { return p.get() == &w; }) - pc.workers.begin());
+
+    for (size_t i = index; i < pc.roots.size(); i += pc.num_workers) {
+        *pc.roots[i] = parallel_move(w, *pc.roots[i]);
+    }
+
+    for (;;) {
+        if (!w.pending.empty()) {
+            auto ppos = w.pending.back();
+            w.pending.pop_back();
+            *ppos = parallel_move(w, *ppos);
+        } else if (!w.local.empty() || w.find_work(index)) {
+            const auto pos = w.local.back();
+            w.local.pop_back();
+            const auto& type_info = storage_[pos-1].allocation.type_info();
+            if (type_info.has_fixup()) {
+                // register_fixup() calls parallel_move() for each untracked pointer
+                type_info.fixup(&storage_[pos]);
+            }
+        } else {
+            // Out of work. Wait until some can be stolen or everyone is done (workers only share work while active,
+            // so there's nothing left anywhere once all of them are idle).
+            bool done = false;
+            pc.active.fetch_sub(1);
+            while (!done) {
+                if (pc.active.load() == 0) {
+                    done = true;
+                } else if (std::any_of(pc.workers.begin(), pc.workers.end(), [](const auto& o) { return o->shared_size.load(std::memory_order_relaxed) != 0; })) {
+                    pc.active.fetch_add(1);
+                    if (w.find_work(index)) {
+                        break;
+                    }
+                    pc.active.fetch_sub(1);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+            if (done) {
+                break;
+            }
+        }
+    }
+
+    // Leave the unused part of the allocation buffer as an inactive allocation to keep the to-space walkable
+    if (w.lab_next < w.lab_end) {
+        auto& a = storage_[w.lab_next].allocation;
+        a.size = w.lab_end - w.lab_next;
+        a.type = uninitialized_type_index;
+        a.age = 0;
+        a.flags = 0;
+    }
+    current_worker_ = nullptr;
 }
 
-uint32_t gc_heap::allocate(size_t num_bytes) {
-    if (!num_bytes || num_bytes >= UINT32_MAX) {
+uint32_t gc_heap::parallel_move(parallel_worker& w, const uint32_t pos) {
+    const auto to_space_end = other_space_begin() + config_.max_capacity;
+    if (pos > other_space_begin() && pos < to_space_end) {
+        // Already copied
+        return pos;
+    }
+
+    auto& header = as_atomic(storage_[pos-1].representation);
+    slot old_header;
+    old_header.representation = header.load(std::memory_order_acquire);
+
+    if (is_large_position(pos)) {
+        // Large objects aren't copied, the worker that marks one scans it
+        for (;;) {
+            if (old_header.allocation.flags & marked_flag) {
+                return pos;
+            }
+            slot marked = old_header;
+            marked.allocation.flags |= marked_flag;
+            if (header.compare_exchange_weak(old_header.representation, marked.representation, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                break;
+            }
+        }
+        w.push(pos);
+        return pos;
+    }
+    assert(is_old_position(pos) || is_young_position(pos));
+
+    // Claim the object by marking it busy
+    for (;;) {
+        if (old_header.allocation.type == gc_moved_type_index) {
+            return storage_[pos].new_position;
+        } else if (old_header.allocation.type == gc_busy_type_index) {
+            // Another worker is copying the object
+            std::this_thread::yield();
+            old_header.representation = header.load(std::memory_order_acquire);
+            continue;
+        }
+        assert(old_header.allocation.type < gc_type_info::num_types());
+        slot busy = old_header;
+        busy.allocation.type = gc_busy_type_index;
+        if (header.compare_exchange_weak(old_header.representation, busy.representation, std::memory_order_acquire, std::memory_order_acquire)) {
+            break;
+        }
+    }
+    const auto a = old_header.allocation;
+
+    // Allocate from the local allocation buffer, getting another chunk of the to-space if needed
+    if (a.size > w.lab_end - w.lab_next) {
+        if (w.lab_next < w.lab_end) {
+            auto& filler = storage_[w.lab_next].allocation;
+            filler.size = w.lab_end - w.lab_next;
+            filler.type = uninitialized_type_index;
+            filler.age = 0;
+            filler.flags = 0;
+        }
+        auto& to_free = w.collection.to_free;
+        uint32_t chunk_begin = to_free.load(std::memory_order_relaxed), chunk_size;
+        do {
+            if (a.size > to_space_end - chunk_begin) {
+                assert(!"To-space exhausted");
+                std::abort();
+            }
+            chunk_size = std::min(std::max(a.size, parallel_collection::lab_size), to_space_end - chunk_begin);
+        } while (!to_free.compare_exchange_weak(chunk_begin, chunk_begin + chunk_size, std::memory_order_relaxed));
+        w.lab_next = chunk_begin;
+        w.lab_end = chunk_begin + chunk_size;
+    }
+    const auto new_pos = w.lab_next + 1;
+    w.lab_next += a.size;
+
+    const auto& type_info = a.type_info();
+    void* const p = &storage_[pos];
+    void* const new_p = &storage_[new_pos];
+    if (type_info.is_trivially_relocatable()) {
+        std::memcpy(new_p, p, (a.size - 1) * sizeof(slot));
+    } else if (type_info.needs_destroy()) {
+        // Only objects with non-trivial destructors can contain tracked pointers, which are (de)registered in
+        // pointers_ when they're moved. Since that's shared it has to be done by one worker at a time.
+        std::lock_guard<std::mutex> lock{w.collection.pointers_mutex};
+        const auto num_pointers_initially = pointers_.size();
+        type_info.move(new_p, p);
+        for (uint32_t i = num_pointers_initially; i < pointers_.size(); ++i) {
+            w.pending.push_back(&pointers_.data()[i]->pos_);
+        }
+        type_info.destroy(p);
+        assert(pointers_.size() == num_pointers_initially);
+    } else {
+        type_info.move(new_p, p);
+    }
+    auto& new_a = storage_[new_pos-1].allocation;
+    new_a = a;
+    new_a.age = 0;
+    new_a.flags = 0;
+
+    // Publish the new position
+    storage_[pos].new_position = new_pos;
+    slot moved = old_header;
+    moved.allocation.type = gc_moved_type_index;
+    header.store(moved.representation, std::memory_order_release);
+
+    w.push(new_pos);
+    return new_pos;
+}
+
+void gc_heap::register_weak_fixup(uint32_t& pos) {
+    if (snapshot_edges_) {
+        // Weak pointers don't retain anything
+        return;
+    }
+    if (current_worker_) {
+        current_worker_->weak.push_back(&pos);
+        return;
+    }
+    if (gc_state_.kind == collection_kind::young ? !is_young_position(pos) : is_to_space_position(pos)) {
+        return;
+    }
+    gc_state_.weak.push_back(&pos);
+    // Remember old owners like register_fixup() does in case the target survives (harmless if it doesn't)
+    if (gc_state_.kind == collection_kind::young && gc_state_.owner && is_old_or_large_position(gc_state_.owner)) {
+        remember(gc_state_.owner);
+    }
+}
+
+void gc_heap::resolve_weak_pointers() {
+    for (auto ppos: gc_state_.weak) {
+        *ppos = resolve_weak_position(*ppos);
+    }
+    gc_state_.weak.clear();
+    // The tables free their external memory now
+    external_used_ = 0;
+    for (const auto& t: weak_tables_) {
+        if (t) {
+            t->update_positions([this](uint32_t pos) { return resolve_weak_position(pos); });
+        }
+    }
+}
+
+uint32_t gc_heap::resolve_weak_position(uint32_t pos) const {
+    // The pointer might have been changed by the mutator (during an incremental collection) or already been resolved
+    if (!pos || (gc_state_.kind == collection_kind::young ? !is_young_position(pos) : is_to_space_position(pos))) {
+        return pos;
+    }
+    const auto& a = storage_[pos-1].allocation;
+    if (is_large_position(pos)) {
+        // Large objects survive in place if they've been marked
+        return a.flags & marked_flag ? pos : 0;
+    }
+    return a.type == gc_moved_type_index ? storage_[pos].new_position : 0;
+}
+
+uint32_t gc_heap::allocate(size_t num_bytes, bool allow_large) {
+    if (!num_bytes) {
         assert(!"Invalid allocation size");
         std::abort();
     }
+    if (num_bytes >= static_cast<uint64_t>(config_.max_capacity) * slot_size) {
+        // Can't possibly fit (e.g. a script creating a huge string)
+        limit_exceeded(num_bytes / slot_size + 1, config_.max_capacity);
+    }
 
     const auto num_slots = 1 + bytes_to_slots(num_bytes);
-    if (num_slots > capacity_ || next_free_ > capacity_ - num_slots) {
-        assert(!"Not implemented: Ran out of heap");
-        std::abort();
+    stats_.bytes_allocated += static_cast<uint64_t>(num_slots) * slot_size;
+    sample_countdown_ -= static_cast<int64_t>(num_slots) * slot_size;
+    if (allow_large && config_.large_object_threshold && num_slots >= config_.large_object_threshold) {
+        if (const auto pos = allocate_large(num_slots)) {
+            if (has_young_generation() && gc_state_.kind == collection_kind::none) {
+                // Like objects allocated directly in the old generation, see below
+                remember(pos + 1);
+            }
+            return pos;
+        }
+    }
+    if (num_slots <= young_begin_ + config_.nursery_capacity - young_next_) {
+        const auto pos = young_next_;
+        young_next_ += num_slots;
+        auto& a = storage_[pos].allocation;
+        a.size = num_slots;
+        a.type = uninitialized_type_index;
+        a.age = 0;
+        a.flags = 0;
+        return pos;
+    }
+
+    // Doesn't fit in the young generation (or there isn't one)
+    const auto pos = allocate_old(num_slots);
+    if (has_young_generation() && gc_state_.kind == collection_kind::none) {
+        // The object will most likely be initialized with pointers to young objects
+        remember(pos + 1);
+    }
+    return pos;
+}
+
+uint32_t gc_heap::allocate_old(uint32_t num_slots) {
+    if (num_slots > space_begin_ + capacity_ - next_free_) {
+        grow(num_slots);
     }
     const auto pos = next_free_;
     next_free_ += num_slots;
-    storage_[pos].allocation.size = num_slots;
-    storage_[pos].allocation.type = uninitialized_type_index;
+    auto& a = storage_[pos].allocation;
+    a.size = num_slots;
+    a.type = uninitialized_type_index;
+    a.age = 0;
+    a.flags = 0;
+    return pos;
+}
+
+uint32_t gc_heap::allocate_large(uint32_t num_slots) {
+    assert(gc_state_.kind != collection_kind::young);
+    if (config_.hard_limit && static_cast<uint64_t>(old_generation_used()) + num_slots > config_.hard_limit / slot_size) {
+        limit_exceeded(num_slots, config_.hard_limit / slot_size);
+    }
+    // First fit, the space is mostly expected to hold a few big objects
+    uint32_t pos = 0;
+    for (size_t i = 0; i < large_free_.size(); ++i) {
+        auto& f = storage_[large_free_[i]].allocation;
+        if (f.size < num_slots) {
+            continue;
+        }
+        pos = large_free_[i];
+        if (f.size - num_slots >= 2) {
+            // Split the block, the remainder stays free
+            auto& rest = storage_[pos + num_slots].allocation;
+            rest.size = f.size - num_slots;
+            rest.type = uninitialized_type_index;
+            rest.age = 0;
+            rest.flags = 0;
+            large_free_[i] = pos + num_slots;
+        } else {
+            num_slots = f.size;
+            large_free_[i] = large_free_.back();
+            large_free_.pop_back();
+        }
+        break;
+    }
+    if (!pos) {
+        if (num_slots > large_base() + config_.large_object_capacity - large_next_) {
+            return 0;
+        }
+        pos = large_next_;
+        large_next_ += num_slots;
+    }
+    large_used_ += num_slots;
+
+    auto& a = storage_[pos].allocation;
+    a.size = num_slots;
+    a.type = uninitialized_type_index;
+    a.age = 0;
+    a.flags = 0;
+    if (gc_state_.kind == collection_kind::full) {
+        // Allocated during an incremental collection: it's live, but must be scanned since it will (most likely) be
+        // initialized with positions of objects that haven't been moved yet. That happens before the next scan.
+        a.flags = marked_flag | gray_flag;
+        gc_state_.rescan.push_back(pos + 1);
+    }
     return pos;
 }
 
+void gc_heap::remember_write(const void* p) {
+    const auto pos = position_of(p);
+    if (gc_state_.kind == collection_kind::full) {
+        // An incremental collection is in progress. Objects that have already been moved might have been
+        // scanned and must be scanned (again) as they may now point to objects that haven't been moved.
+        // The young generation doesn't survive the collection so there's no need to remember anything.
+        if (is_to_space_position(pos) || is_large_position(pos)) {
+            make_gray(pos);
+        }
+        return;
+    }
+    if (!has_young_generation()) {
+        return;
+    }
+    assert(is_old_or_large_position(pos));
+    remember(pos);
+}
+
+void gc_heap::remember(uint32_t pos) {
+    auto& a = storage_[pos-1].allocation;
+    if (!(a.flags & remembered_flag)) {
+        a.flags |= remembered_flag;
+        remembered_.push_back(pos);
+    }
+}
+
+void gc_heap::grow(uint32_t num_slots) {
+    // Note: Collecting garbage here isn't safe since callers (e.g. object constructors and object::put) hold
+    // raw references into the heap across allocations. Instead the heap grows in place and the next collection
+    // shrinks it again if the memory turns out not to be needed.
+    const uint64_t needed = static_cast<uint64_t>(next_free_ - space_begin_) + num_slots;
+    if (needed > config_.max_capacity) {
+        limit_exceeded(num_slots, config_.max_capacity);
+    }
+    if (config_.hard_limit && needed + large_used_ > config_.hard_limit / slot_size && !pause_depth_) {
+        // Collections are allowed to go over the hard limit (as long as the heap has room), the next allocation will fail instead
+        limit_exceeded(num_slots, config_.hard_limit / slot_size);
+    }
+    const double new_capacity = std::max(static_cast<double>(needed), capacity_ * config_.growth_factor);
+    capacity_ = static_cast<uint32_t>(std::min(new_capacity, static_cast<double>(config_.max_capacity)));
+    if (!pause_depth_) {
+        capacity_ = std::max(static_cast<uint32_t>(needed), std::min(capacity_, capacity_limit()));
+    }
+    assert(num_slots <= space_begin_ + capacity_ - next_free_);
+}
+
 void gc_heap::attach(gc_heap_ptr_untyped& p) {
-    assert(p.heap_ == this && p.pos_ > 0 && p.pos_ < next_free_);
+    assert(p.heap_ == this && is_active_position(p.pos_));
     pointers_.insert(p);
 }
 
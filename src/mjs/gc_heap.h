@@ -5,11 +5,16 @@
 #include <vector>
 #include <algorithm>
 #include <ostream>
+#include <string_view>
+#include <stdexcept>
 #include <typeinfo>
 #include <cstdlib>
 #include <cassert>
 #include <cstddef>
 #include <cstring>
+#include <chrono>
+#include <functional>
+#include <memory>
 
 namespace mjs {
 
@@ -17,12 +22,26 @@ class gc_heap;
 class gc_heap_ptr_untyped;
 template<typename T>
 class gc_heap_ptr;
-template<typename T>
+template<typename T, bool Weak = false>
 class gc_heap_ptr_untracked;
+template<typename T>
+class gc_handle;
+class gc_handle_scope;
+class gc_no_safepoint_scope;
 
 // Only here to be friended
 class object;
+class gc_string;
 class value_representation;
+class gc_weak_table;
+
+// Types that can be moved by copying their bytes (and forgetting the original) are relocated by the collector
+// with a memcpy instead of through their move constructor and destructor. Specialize for types that qualify
+// without being trivially copyable. They must not contain tracked pointers (which are registered by address).
+// Polymorphic types (e.g. object and its subclasses) don't qualify: copying the bytes of an object with a vptr isn't
+// something the language guarantees to work.
+template<typename T>
+struct gc_trivially_relocatable : std::is_trivially_copyable<T> {};
 
 class gc_type_info {
 public:
@@ -50,11 +69,36 @@ public:
         return name_;
     }
 
+    // Short (Latin-1) description of the object at 'p' for heap snapshots (e.g. the [[Class]] of objects), empty if the type doesn't provide one
+    std::string snapshot_label(const void* p) const {
+        return label_ ? label_(p) : std::string{};
+    }
+
     // Is the type convertible to object?
     bool is_convertible_to_object() const {
         return convertible_to_object_;
     }
 
+    // Is the type convertible to gc_string (i.e. one of the string representations)?
+    bool is_convertible_to_string() const {
+        return convertible_to_string_;
+    }
+
+    // Does the type have untracked pointers that need to be fixed up?
+    bool has_fixup() const {
+        return fixup_ != nullptr;
+    }
+
+    // Does the type need to be destroyed? Trivially destructible types can't contain tracked pointers.
+    bool needs_destroy() const {
+        return destroy_ != nullptr;
+    }
+
+    // Can the type be moved with memcpy (see gc_trivially_relocatable)?
+    bool is_trivially_relocatable() const {
+        return trivially_relocatable_;
+    }
+
     // Return unique type index
     uint32_t get_index() const {
         return index_;
@@ -73,12 +117,16 @@ protected:
     using destroy_function = void (*)(void*);
     using move_function = void (*)(void*, void*);
     using fixup_function = void (*)(void*);
+    using label_function = std::string (*)(const void*);
 
-    explicit gc_type_info(destroy_function destroy, move_function move, fixup_function fixup, bool convertible_to_object, const char* name)
+    explicit gc_type_info(destroy_function destroy, move_function move, fixup_function fixup, label_function label, bool convertible_to_object, bool convertible_to_string, bool trivially_relocatable, const char* name)
         : destroy_(destroy)
         , move_(move)
         , fixup_(fixup)
+        , label_(label)
         , convertible_to_object_(convertible_to_object)
+        , convertible_to_string_(convertible_to_string)
+        , trivially_relocatable_(trivially_relocatable)
         , name_(name)
         , index_(num_types_++) {
         assert(index_ < max_types);
@@ -91,7 +139,10 @@ private:
     destroy_function destroy_;
     move_function move_;
     fixup_function fixup_;
+    label_function label_;
     bool convertible_to_object_;
+    bool convertible_to_string_;
+    bool trivially_relocatable_;
     const char* name_;
     const uint32_t index_;
 
@@ -113,9 +164,17 @@ class gc_type_info_registration : public gc_type_info {
     template<typename U>
     struct has_fixup_t<U, std::void_t<decltype(std::declval<U>().fixup())>> : std::true_type{};
 
+    template<typename U, typename=void>
+    struct has_snapshot_label_t : std::false_type{};
+
+    template<typename U>
+    struct has_snapshot_label_t<U, std::void_t<decltype(std::declval<const U>().snapshot_label())>> : std::true_type{};
+
 public:
     static constexpr bool needs_destroy = !std::is_trivially_destructible_v<T>;
     static constexpr bool needs_fixup   = has_fixup_t<T>::value;
+    static constexpr bool trivially_relocatable = gc_trivially_relocatable<T>::value;
+    static constexpr bool has_snapshot_label = has_snapshot_label_t<T>::value;
 
     static_assert(!std::is_convertible_v<T*, object*> || needs_fixup, "Classes deriving from object MUST handle fixup");
 
@@ -128,7 +187,7 @@ public:
     }
 
     bool is_convertible(const gc_type_info& t) const {
-        return &t == this || (std::is_same_v<object, T> && t.is_convertible_to_object());
+        return &t == this || (std::is_same_v<object, T> && t.is_convertible_to_object()) || (std::is_same_v<gc_string, T> && t.is_convertible_to_string());
     }
 
     // Helper so gc_*** classes don't have to friend both gc_heap and gc_type_info_registration
@@ -138,7 +197,7 @@ public:
     }
 
 private:
-    explicit gc_type_info_registration() : gc_type_info(needs_destroy?&destroy:nullptr, &move, needs_fixup?&fixup:nullptr, std::is_convertible_v<T*, object*>, typeid(T).name()) {
+    explicit gc_type_info_registration() : gc_type_info(needs_destroy?&destroy:nullptr, &move, needs_fixup?&fixup:nullptr, has_snapshot_label?&label:nullptr, std::is_convertible_v<T*, object*>, std::is_convertible_v<T*, gc_string*>, trivially_relocatable, typeid(T).name()) {
         static_assert(sizeof(gc_type_info_registration<T>) == sizeof(gc_type_info));
     }
 
@@ -157,8 +216,14 @@ private:
 #endif
     }
 
-    static void move(void* to, void* from) {
-        new (to) T (std::move(*static_cast<T*>(from)));
+    static void move([[maybe_unused]] void* to, [[maybe_unused]] void* from) {
+        if constexpr (trivially_relocatable) {
+            // The collector copies their bytes instead, so they don't need to be move constructible
+            assert(!"Trivially relocatable objects aren't moved through their type info");
+            std::abort();
+        } else {
+            new (to) T (std::move(*static_cast<T*>(from)));
+        }
     }
 
     static void fixup([[maybe_unused]] void* p) {
@@ -166,28 +231,264 @@ private:
             static_cast<T*>(p)->fixup();
         }
     }
+
+    static std::string label([[maybe_unused]] const void* p) {
+        if constexpr (has_snapshot_label) {
+            return static_cast<const T*>(p)->snapshot_label();
+        } else {
+            return {};
+        }
+    }
 };
 
 template<typename T>
 const gc_type_info_registration<T> gc_type_info_registration<T>::reg;
 
+// Base class of tables kept outside the heap that refer to objects in it without keeping them alive (e.g. the atom table,
+// see string.h). A heap owns at most one table of each type (see gc_heap::weak_table()) and calls update_positions() at the
+// end of every collection (and full_collection_finished() after full ones).
+class gc_weak_table {
+public:
+    virtual ~gc_weak_table() {}
+
+    // Replace each position held by the table with resolve(pos): the object's new position, or 0 if it died
+    using position_resolver = std::function<uint32_t (uint32_t pos)>;
+    virtual void update_positions(const position_resolver& resolve) = 0;
+
+    // Called once a full collection has finished (at the end of the collector's pause), objects may be allocated again.
+    // Allocations that fail throw gc_heap_limit_exceeded as usual, which the table must handle.
+    virtual void full_collection_finished() {}
+
+protected:
+    explicit gc_weak_table() {}
+
+    static uint32_t position(const gc_heap_ptr_untyped& p);
+    template<typename T>
+    static gc_heap_ptr<T> from_position(gc_heap& h, uint32_t pos);
+    template<typename T>
+    static gc_heap_ptr_untracked<T> untracked_from_position(uint32_t pos);
+
+private:
+    gc_weak_table(const gc_weak_table&) = delete;
+    gc_weak_table& operator=(const gc_weak_table&) = delete;
+};
+
+// Sizing policy for a gc_heap. All capacities are in slots and apply to each of the two semi-spaces.
+// The heap reserves room for max_capacity up front, but only uses (and touches) the current capacity.
+// If nursery_capacity is non-zero new objects are allocated in a separate young generation (itself
+// two semi-spaces of nursery_capacity slots each), see garbage_collect_young().
+// Large objects without tracked pointers (e.g. big strings and property tables) are allocated in a separate
+// non-moving space of large_object_capacity slots that full collections mark and sweep instead of copying.
+struct gc_heap_config {
+    uint32_t initial_capacity = 1<<20;
+    uint32_t min_capacity     = 1<<16; // Never shrink below this
+    uint32_t max_capacity     = 1<<26; // Never grow beyond this (see hard_limit)
+    double   growth_factor    = 2.0;   // Capacity is multiplied by this when growing
+    double   shrink_factor    = 0.5;   // Capacity is multiplied by this when shrinking
+    double   grow_occupancy   = 0.75;  // Grow after a collection if more than this fraction of the capacity is still in use
+    double   shrink_occupancy = 0.25;  // Shrink after a collection if less than this fraction of the capacity is in use
+    uint32_t nursery_capacity = 1<<18; // Size of the young generation (0 disables it)
+    uint32_t promotion_age    = 2;     // Number of young collections an object must survive before being promoted to the old generation
+
+    // Thresholds for automatic collection at safepoints (see gc_heap::collect_if_needed()), 0 disables the respective kind of collection
+    double   young_collection_trigger = 0.75; // Collect the young generation once this fraction of it is in use
+    double   full_collection_trigger  = 1.0;  // Collect everything once the old generation has grown by this factor of what survived the last full collection
+
+    uint32_t gc_threads = 1; // Number of threads used for (non-incremental) full collections
+
+    uint32_t large_object_threshold = 1<<12; // Objects of at least this many slots go in the large object space (0 disables it)
+    uint32_t large_object_capacity  = 1<<24; // Size of the large object space, objects that don't fit are allocated normally
+
+    bool release_memory         = true;  // Give memory the heap can't use after shrinking (and free large object space) back to the operating system
+    bool transparent_huge_pages = false; // Ask the operating system to back the heap with huge pages (Linux only, reduces TLB misses)
+
+    // Limits (in bytes) on the size of the old generation including the large object space, 0 means no limit (other than max_capacity).
+    // Going over the soft limit forces a full collection at the next safepoint and then consults the embedder, see gc_heap::on_soft_limit().
+    // Allocations that would exceed the hard limit (or max_capacity) throw gc_heap_limit_exceeded.
+    uint64_t soft_limit = 0;
+    uint64_t hard_limit = 0;
+
+    // A heap that never changes size and doesn't have a young generation (the old behavior)
+    static gc_heap_config fixed(uint32_t capacity) {
+        gc_heap_config c{};
+        c.initial_capacity = c.min_capacity = c.max_capacity = capacity;
+        c.nursery_capacity = 0;
+        c.large_object_capacity = 0;
+        return c;
+    }
+};
+
+// Counters kept by every gc_heap (see gc_heap::stats()). Sizes are in bytes and include the allocation headers.
+struct gc_heap_stats {
+    uint64_t young_collections = 0;
+    uint64_t full_collections  = 0;
+    std::chrono::nanoseconds total_pause{0}; // Time spent in calls that collected garbage (including incremental slices)
+    std::chrono::nanoseconds max_pause{0};   // Longest such call
+    uint64_t bytes_allocated = 0;            // By the program (objects copied by collections aren't counted)
+    uint64_t bytes_promoted  = 0;            // Moved from the young to the old generation
+    uint64_t bytes_survived  = 0;            // Sum over all collections of what was still live
+    uint64_t bytes_freed     = 0;            // Sum over all collections of what was reclaimed
+
+    // Fraction of the collected objects that survived
+    double survival_rate() const {
+        const auto total = bytes_survived + bytes_freed;
+        return total ? static_cast<double>(bytes_survived) / total : 0;
+    }
+};
+std::wostream& operator<<(std::wostream& os, const gc_heap_stats& s);
+
+// Thrown when an allocation would make the heap exceed its hard limit (or its maximum capacity), or when the embedder
+// refuses to raise the soft limit (see gc_heap::on_soft_limit()). The heap is still usable: unwinding the script that
+// caused it releases its roots, and the next collection reclaims the memory.
+class gc_heap_limit_exceeded : public std::runtime_error {
+public:
+    explicit gc_heap_limit_exceeded(uint64_t requested, uint64_t limit)
+        : std::runtime_error("Heap limit exceeded (" + std::to_string(requested) + " bytes needed, limit is " + std::to_string(limit) + ")")
+        , requested_(requested), limit_(limit) {}
+
+    uint64_t requested() const { return requested_; }
+    uint64_t limit() const { return limit_; }
+
+private:
+    uint64_t requested_;
+    uint64_t limit_;
+};
+
+// Live objects of one type, see gc_heap::type_statistics()
+struct gc_type_stats {
+    uint32_t    type_index; // gc_type_info::get_index()
+    const char* name;       // gc_type_info::name()
+    uint64_t    count;
+    uint64_t    bytes;
+};
+
 class gc_heap {
 public:
     friend gc_heap_ptr_untyped;
     friend value_representation;
-    template<typename> friend class gc_heap_ptr_untracked;
+    template<typename, bool> friend class gc_heap_ptr_untracked;
+    template<typename> friend class gc_handle;
+    friend gc_handle_scope;
+    friend gc_no_safepoint_scope;
+    friend gc_weak_table;
 
     static constexpr uint32_t slot_size = sizeof(uint64_t);
+    static constexpr uint32_t max_gc_threads = 64;
     static constexpr uint32_t bytes_to_slots(size_t bytes) { return static_cast<uint32_t>((bytes + slot_size - 1) / slot_size); }
 
-    explicit gc_heap(uint32_t capacity);
+    explicit gc_heap(uint32_t capacity) : gc_heap{gc_heap_config::fixed(capacity)} {}
+    explicit gc_heap(const gc_heap_config& config);
     ~gc_heap();
 
     void debug_print(std::wostream& os) const;
     uint32_t calc_used() const;
 
+    const gc_heap_config& config() const { return config_; }
+    uint32_t capacity() const { return capacity_; }
+
+    const gc_heap_stats& stats() const { return stats_; }
+
+    // Write a snapshot of all allocations (live or not) to the binary stream 'os' for offline analysis (see mjs_heapdump).
+    // The snapshot is streamed while walking the heap, so little extra memory is needed. A collection in progress is finished first.
+    // Format (integers are 32-bit in native byte order, strings are a length followed by that many (ASCII) characters):
+    //   "MJSHEAP" '\0', version (1), slot size
+    //   number of types, type names (indexed by gc_type_info::get_index())
+    //   number of roots, root positions (tracked pointers outside the heap and handles)
+    //   for each allocation: position, size in slots (including the header), type index, gc_type_info::snapshot_label(),
+    //                        number of outgoing (strong) edges, target positions
+    //   0 (instead of a position) terminates the list of allocations
+    void write_snapshot(std::ostream& os);
+
+    // Number and size of the live objects of each registered type (indexed by type). This walks the whole heap (like calc_used()),
+    // so unlike stats() it isn't meant to be called all the time. Objects that died since the last collection are included.
+    std::vector<gc_type_stats> type_statistics() const;
+
+    // 'callback' is invoked at the end of every call that completed (at least) one collection, after its pause has been accounted for
+    // in stats(). It may inspect the heap, but not allocate or collect garbage.
+    using collection_callback = std::function<void (const gc_heap&)>;
+    void on_collection(collection_callback callback) { collection_callback_ = std::move(callback); }
+
+    // Sample allocations for profiling: 'sampler' is called right after an object has been constructed roughly once every 'interval'
+    // bytes allocated. The intervals are drawn from an exponential distribution so allocations of all sizes are sampled fairly, and
+    // 'bytes' is an (unbiased) estimate of how much was allocated on behalf of the sample. The sampler must not allocate from the heap.
+    // An empty sampler stops sampling.
+    using allocation_sampler = std::function<void (const gc_type_info& type, const void* p, uint64_t bytes)>;
+    void sample_allocations(uint64_t interval, allocation_sampler sampler);
+
+    // 'callback' is invoked at a safepoint (see collect_if_needed()) when the old generation still uses 'used' bytes, more than
+    // the soft limit, right after a full collection. It returns the new soft limit: the same one after freeing memory (e.g. releasing
+    // embedder roots and calling garbage_collect()), a higher one to let the heap grow or 0 to deny. If the heap is still over the
+    // returned limit gc_heap_limit_exceeded is thrown (terminating the running script). Without a callback the soft limit only
+    // schedules collections.
+    using soft_limit_callback = std::function<uint64_t (gc_heap& heap, uint64_t used)>;
+    void on_soft_limit(soft_limit_callback callback) { soft_limit_callback_ = std::move(callback); }
+    uint64_t soft_limit() const { return soft_limit_; }
+
+    // Memory kept outside the heap on its behalf until the next collection (e.g. by a gc_weak_table, which frees it in
+    // update_positions()) counts against the limits and collection triggers as if the old generation used it
+    void add_external_usage(size_t num_bytes) {
+        external_used_ += bytes_to_slots(num_bytes);
+    }
+
+    // The heap's table of type T (derived from gc_weak_table and constructible from a gc_heap&), created on first use
+    template<typename T>
+    T& weak_table() {
+        static const uint32_t index = num_weak_table_types_++;
+        if (index >= weak_tables_.size()) {
+            weak_tables_.resize(index + 1);
+        }
+        auto& t = weak_tables_[index];
+        if (!t) {
+            t = std::make_unique<T>(*this);
+        }
+        return static_cast<T&>(*t);
+    }
+
+    // Full collection: everything reachable (from both generations) is copied to the old generation.
+    // An incremental collection in progress is finished first (it may have kept objects that died while it ran alive).
     void garbage_collect();
 
+    // Incremental full collection: works on the current collection (starting a new one if necessary) for roughly
+    // 'budget' and returns true if it finished. The heap can be used normally between calls (but like the other
+    // collection functions this may only be called when no raw pointers/references into the heap are held).
+    // Finishing includes rescanning the roots, which isn't bounded by the budget.
+    bool garbage_collect_incremental(std::chrono::microseconds budget);
+
+    bool collection_in_progress() const { return gc_state_.kind != collection_kind::none; }
+
+    // To be called by the embedder when it has 'idle_time' to spare (e.g. between requests). Collects the young
+    // generation and spends the rest of the time on an incremental full collection if one is in progress or the
+    // old generation has grown since the last one. Returns true if there's no more work to do.
+    bool notify_idle(std::chrono::microseconds idle_time);
+
+    // Young collection: only the young generation is collected. The roots are the tracked pointers outside it
+    // and the remembered set of old objects that have been written to (see write_barrier()). Survivors are
+    // copied to the other young half or promoted once they're old enough.
+    // Dead old objects are (conservatively) treated as live until the next full collection.
+    // If an incremental collection is in progress it's finished instead.
+    void garbage_collect_young();
+
+    // Safepoint: must be called regularly from places where collecting is safe (e.g. between statements). Collects garbage
+    // if enough has been allocated since the last collection. Steady state memory use is then bounded by the live data.
+    // Does nothing while a gc_no_safepoint_scope is open.
+    void collect_if_needed() {
+        if (!no_safepoint_scopes_ && (young_next_ - young_begin_ >= young_collection_limit_ || old_generation_used() >= full_collection_limit_)) {
+            automatic_collection();
+        }
+    }
+
+    bool has_young_generation() const { return config_.nursery_capacity != 0; }
+    uint32_t young_generation_used() const { return young_next_ - young_begin_; }
+    uint32_t large_object_space_used() const { return large_used_; }
+
+    // Must be called after storing a position (gc_heap_ptr_untracked or value_representation) in the object at 'p'.
+    // Old (and large) objects that might point into the young generation are remembered until the next young collection.
+    void write_barrier(const void* p) {
+        if (!is_young_address(p)) {
+            remember_write(p);
+        }
+    }
+
     template<typename T, typename... Args>
     gc_heap_ptr<T> allocate_and_construct(size_t num_bytes, Args&&... args);
 
@@ -197,15 +498,22 @@ public:
     }
 
 private:
-    static constexpr uint32_t uninitialized_type_index = UINT32_MAX;
-    static constexpr uint32_t gc_moved_type_index      = uninitialized_type_index-1;
+    static constexpr uint16_t uninitialized_type_index = UINT16_MAX;
+    static constexpr uint16_t gc_moved_type_index      = uninitialized_type_index-1;
+    static constexpr uint16_t gc_busy_type_index       = uninitialized_type_index-2; // Being moved by another thread (parallel collections only)
+
+    static constexpr uint8_t remembered_flag = 1; // Old object that's in the remembered set
+    static constexpr uint8_t gray_flag       = 2; // Object that's waiting to be scanned
+    static constexpr uint8_t marked_flag     = 4; // Large object that the full collection in progress has reached
 
     struct slot_allocation_header {
-        uint32_t size; // size in slots including the allocation header
-        uint32_t type; // index into gc_type_info::types_ OR one of the special xxxx_type_index values
+        uint32_t size;  // size in slots including the allocation header
+        uint16_t type;  // index into gc_type_info::types_ OR one of the special xxxx_type_index values
+        uint8_t  age;   // number of young collections survived
+        uint8_t  flags; // xxxx_flag values
 
         constexpr bool active() const {
-            return type != uninitialized_type_index && type != gc_moved_type_index;
+            return type != uninitialized_type_index && type != gc_moved_type_index && type != gc_busy_type_index;
         }
 
         const gc_type_info& type_info() const {
@@ -222,6 +530,8 @@ private:
     static_assert(sizeof(slot) == slot_size);
 
     struct gc_state;
+
+    // Set of tracked pointers with constant time insertion and removal. Each pointer knows its own index in the set.
     class pointer_set {
         std::vector<gc_heap_ptr_untyped*> set_;
     public:
@@ -234,66 +544,254 @@ private:
 
         gc_heap_ptr_untyped** data() { return set_.data(); }
 
-        void insert(gc_heap_ptr_untyped& p) {
-            // Note: garbage_collect() assumes nodes are added to the back
-            // assert(std::find(begin(), end(), &p) == end()); // Other asserts should catch this
-            set_.push_back(&p);
-        }
-
-        void erase(const gc_heap_ptr_untyped& p) {
-            // Search from the back since objects tend to be short lived
-            for (size_t i = set_.size(); i--;) {
-                if (set_[i] == &p) {
-                    set_.erase(set_.begin() + i);
-                    return;
-                }
-            }
-            assert(!"Pointer not found in set!");
-        }
+        void insert(gc_heap_ptr_untyped& p);
+        void erase(const gc_heap_ptr_untyped& p);
     };
 
-    pointer_set pointers_;
-    slot*       storage_;
-    uint32_t    capacity_;
-    uint32_t    next_free_ = 0;
+    // storage_ is one reservation split into two halves (semi-spaces) of config_.max_capacity slots each for the
+    // old generation followed by two halves of config_.nursery_capacity slots each for the young generation and
+    // finally config_.large_object_capacity slots for the large object space (so positions can address all of them).
+    // Objects are allocated in the active young half (or directly in the old generation if they don't fit).
+    // garbage_collect() copies the live objects to the other old half after which the two halves switch roles,
+    // garbage_collect_young() does the same for the young halves. Positions are always relative to storage_ (so
+    // position 0 is never a valid object position as it's the first allocation header of the first half).
+    gc_heap_config        config_;
+    pointer_set           pointers_;
+    void*                 reservation_;      // The mapping storage_ is part of (it might be aligned)
+    size_t                reservation_size_;
+    slot*                 storage_;
+    uint32_t              space_begin_ = 0; // Start of the active old half
+    uint32_t              capacity_;        // Current (soft) capacity of the active old half, next_free_ never exceeds space_begin_ + capacity_
+    uint32_t              next_free_ = 0;
+    uint32_t              young_begin_;     // Start of the active young half
+    uint32_t              young_next_;      // Next free position in the active young half
+    uint32_t              large_next_;      // End of the large object space in use, the blocks below it are either allocated or in large_free_
+    uint32_t              large_used_ = 0;  // Slots allocated in the large object space
+    uint64_t              external_used_ = 0; // Slots' worth of memory reported by add_external_usage() since the last collection
+    std::vector<uint32_t> large_free_;      // Free blocks (inactive allocation headers) in the large object space
+    std::vector<uint32_t> destructibles_;   // Positions of the objects whose type needs_destroy() (only valid outside collections)
+    std::vector<uint32_t> remembered_;      // Positions of old (or large) objects that might point into the young generation
+    std::vector<uint32_t> handles_;         // Positions referenced by gc_handles (roots), the open gc_handle_scopes own consecutive ranges
+    uint32_t              handle_scopes_ = 0;
+    uint32_t              no_safepoint_scopes_ = 0;
+    uint32_t              used_after_full_collection_ = 0;
+    gc_heap_stats         stats_;
+    collection_callback   collection_callback_;
+    uint64_t              soft_limit_;                   // In bytes (0: none), starts as config_.soft_limit
+    soft_limit_callback   soft_limit_callback_;
+    int64_t               sample_countdown_ = INT64_MAX; // Bytes to allocate before the next sample (never reached when not sampling)
+    uint64_t              sample_interval_ = 0;
+    uint64_t              sample_random_ = 0;            // State of the random number generator used for the intervals
+    allocation_sampler    sampler_;
+    uint32_t              pause_depth_ = 0;              // Number of nested pause_scopes
+    bool                  collection_completed_ = false; // A collection completed during the current pause
+    bool                  full_collection_finished_ = false; // A full collection finished during the current pause
+    std::vector<uint32_t>* snapshot_edges_ = nullptr;     // Set while write_snapshot() gathers the edges of an object through its fixup function
+    uint32_t              young_collection_limit_;    // collect_if_needed() thresholds (in used slots)
+    uint32_t              full_collection_limit_;
+    std::vector<std::unique_ptr<gc_weak_table>> weak_tables_; // Indexed by the type specific index assigned by weak_table()
+    static uint32_t       num_weak_table_types_;
+
+    // A full collection can be in progress while the heap is used (see garbage_collect_incremental())
+    enum class collection_kind { none, full, young };
 
     // Only valid during GC
     struct gc_state {
 #ifndef NDEBUG
-        bool initial_state() const { return level == 0 && new_heap == nullptr && pending_fixups.empty(); }
+        bool initial_state() const { return kind == collection_kind::none && to_free == 0 && scan == 0 && promoted_scan == 0 && owner == 0 && pending.empty() && rescan.empty() && weak.empty(); }
 #endif
 
-        uint32_t level = 0;                     // recursion depth
-        gc_heap* new_heap = nullptr;            // the "new_heap" is only kept for allocation purposes, no references to it should be kept
-        std::vector<uint32_t*> pending_fixups;  // pending fixup addresses
+        collection_kind kind = collection_kind::none;
+        uint32_t to_free = 0;           // next free position in the to-space (the inactive old or young half)
+        uint32_t scan = 0;              // next object to scan in the to-space, objects between scan and to_free haven't had their untracked pointers fixed up yet
+        uint32_t promoted_scan = 0;     // like scan, but for objects promoted to the end of the old half (young collections only)
+        uint32_t owner = 0;             // object currently being scanned
+        std::vector<uint32_t*> pending; // positions of tracked pointers (roots and internal pointers of moved objects) to fix up, processed before scanning continues
+        std::vector<uint32_t> rescan;   // already scanned objects that have been written to during an incremental collection
+        std::vector<uint32_t*> weak;    // positions of weak pointers in scanned objects, resolved once everything reachable has been moved
     } gc_state_;
 
-    void run_destructors();
+    uint32_t other_space_begin() const {
+        return space_begin_ ? 0 : config_.max_capacity;
+    }
+
+    uint32_t young_base() const {
+        return 2 * config_.max_capacity;
+    }
+
+    uint32_t large_base() const {
+        return young_base() + 2 * config_.nursery_capacity;
+    }
+
+    uint32_t other_young_begin() const {
+        return young_begin_ == young_base() ? young_base() + config_.nursery_capacity : young_base();
+    }
+
+    bool is_old_position(uint32_t pos) const {
+        return pos > space_begin_ && pos < next_free_;
+    }
+
+    bool is_young_position(uint32_t pos) const {
+        return pos > young_begin_ && pos < young_next_;
+    }
+
+    bool is_large_position(uint32_t pos) const {
+        return pos > large_base() && pos < large_next_;
+    }
+
+    // Objects that aren't moved by young collections
+    bool is_old_or_large_position(uint32_t pos) const {
+        return is_old_position(pos) || is_large_position(pos);
+    }
+
+    bool is_to_space_position(uint32_t pos) const {
+        return gc_state_.kind == collection_kind::full && pos > other_space_begin() && pos < gc_state_.to_free;
+    }
+
+    bool is_active_position(uint32_t pos) const {
+        return is_old_position(pos) || is_young_position(pos) || is_to_space_position(pos) || is_large_position(pos);
+    }
+
+    // Read barrier: returns the current position of the object at 'pos', which might have been moved by the incremental collection in progress
+    uint32_t current_position(uint32_t pos) const {
+        if (gc_state_.kind == collection_kind::full && storage_[pos-1].allocation.type == gc_moved_type_index) {
+            return storage_[pos].new_position;
+        }
+        return pos;
+    }
+
+    uint32_t old_generation_used() const {
+        return static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(next_free_ - space_begin_) + large_used_ + external_used_, UINT32_MAX));
+    }
+
+    uint32_t position_of(const void* p) const {
+        return static_cast<uint32_t>(static_cast<const slot*>(p) - storage_);
+    }
+
+    // Call 'f' with the allocation header of every active allocation
+    template<typename F>
+    void for_each_active_allocation(F f) const;
+
+    // Destroy the objects in destructibles_ that the collection left behind and update the positions of the survivors
+    void destroy_dead_objects();
 
     void attach(gc_heap_ptr_untyped& p);
     void detach(gc_heap_ptr_untyped& p);
 
     bool is_internal(const void* p) const {
-        return reinterpret_cast<uintptr_t>(p) >= reinterpret_cast<uintptr_t>(storage_) && reinterpret_cast<uintptr_t>(p) < reinterpret_cast<uintptr_t>(storage_ + capacity_);
+        return reinterpret_cast<uintptr_t>(p) >= reinterpret_cast<uintptr_t>(storage_) && reinterpret_cast<uintptr_t>(p) < reinterpret_cast<uintptr_t>(storage_ + large_base() + config_.large_object_capacity);
+    }
+
+    bool is_young_address(const void* p) const {
+        return reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(storage_ + young_base()) < 2 * static_cast<size_t>(config_.nursery_capacity) * slot_size;
     }
 
     // Allocate at least 'num_bytes' of storage, returns the offset (in slots) of the allocation (header) inside 'storage_'
     // The object must be constructed one slot beyond the allocation header and the type field of the allocation header updated
-    uint32_t allocate(size_t num_bytes);
+    // Only objects that can't contain tracked pointers (i.e. don't need to be destroyed) may be placed in the large object space
+    uint32_t allocate(size_t num_bytes, bool allow_large);
+
+    // Allocate 'num_slots' (including the header) in the large object space, returns 0 if there's no room
+    uint32_t allocate_large(uint32_t num_slots);
+
+    // Called after automatic collections: throws if the old generation is over the hard limit and consults soft_limit_callback_ if
+    // it's over the soft limit
+    void check_limits();
+
+    // Largest capacity the active old half can have without the old generation exceeding the hard limit (or max_capacity)
+    uint32_t capacity_limit() const;
+
+    // Allocating 'num_slots' more in the old generation would exceed the hard limit: throws gc_heap_limit_exceeded (or aborts inside
+    // a collection, which can't be unwound)
+    [[noreturn]] void limit_exceeded(uint64_t num_slots, uint64_t limit_slots);
+
+    // Start the next sampling interval, returns true if the allocation that used up the previous one should be reported
+    bool start_sample();
+    // Report the object at 'pos' to sampler_
+    void sample_allocation(uint32_t pos);
+    uint64_t next_sample_interval();
+
+    // Free the large objects that weren't marked by the full collection and clear the marks of the rest
+    void sweep_large_objects();
+
+    // Give the memory of the whole pages in [begin, end) (in slots) back to the operating system (if configured)
+    void release_pages(uint32_t begin, uint32_t end);
+
+    // Allocate 'num_slots' (including the header) in the old generation
+    uint32_t allocate_old(uint32_t num_slots);
+
+    // Slow path of write_barrier()
+    void remember_write(const void* p);
+
+    // Add the old object at 'pos' to the remembered set (if it isn't already)
+    void remember(uint32_t pos);
+
+    void start_full_collection();
+    void finish_full_collection();
+    // Scan the next gray object, returns false if there are none left
+    bool scan_next_object();
+    void scan_object(uint32_t pos);
+    void process_pending();
+    void make_gray(uint32_t pos);
+    void mark_large(uint32_t pos);
+
+    // Make room for at least 'num_slots' more slots (without moving anything) or abort if the heap can't grow any further
+    void grow(uint32_t num_slots);
+
+    // Adjust the capacity according to the growth policy (only called right after a collection)
+    void resize_after_collection();
+
+    // Recalculate full_collection_limit_ after a full collection
+    void update_full_collection_limit();
+
+    // Slow path of collect_if_needed()
+    void automatic_collection();
+
+    // Measures the time spent in (the outermost of) the public functions that collect garbage
+    struct pause_scope;
+
+    // Update stats_ at the end of a collection ('before' and 'after' are the number of slots used by the collected area(s))
+    void collection_completed(bool full, uint64_t before, uint64_t after);
 
+    // Move the object at 'pos' to the to-space (unless it has already been moved) and return its new position
     uint32_t gc_move(uint32_t pos);
 
+    // Called by the types' fixup functions for each of their untracked pointers while they're being scanned
     void register_fixup(uint32_t& pos);
+    void register_weak_fixup(uint32_t& pos);
+
+    // Update the weak pointers to objects that have been moved and clear the rest (their targets are dead)
+    void resolve_weak_pointers();
+    // New position of the object that was at 'pos' before the collection that's finishing, 0 if it didn't survive
+    uint32_t resolve_weak_position(uint32_t pos) const;
+
+    // Parallel full collection: the roots are split between gc_threads workers that each copy objects to their own
+    // chunk of the to-space and scan them. Objects are claimed by atomically marking their header as busy.
+    struct parallel_collection;
+    struct parallel_worker;
+    static thread_local parallel_worker* current_worker_; // Only set on threads taking part in a parallel collection
+    void parallel_full_collection();
+    void run_parallel_worker(parallel_collection& pc, parallel_worker& w);
+    uint32_t parallel_move(parallel_worker& w, uint32_t pos);
 
     template<typename T>
     gc_heap_ptr<T> unsafe_create_from_position(uint32_t pos);
+
+    // Returns the index of a new handle referencing 'pos' in the innermost gc_handle_scope
+    uint32_t new_handle(uint32_t pos) {
+        assert(handle_scopes_ && "No gc_handle_scope open");
+        handles_.push_back(pos);
+        return static_cast<uint32_t>(handles_.size() - 1);
+    }
 };
 
 class gc_heap_ptr_untyped {
 public:
     friend gc_heap;
+    friend gc_weak_table;
     friend value_representation;
-    template<typename> friend class gc_heap_ptr_untracked;
+    template<typename, bool> friend class gc_heap_ptr_untracked;
+    template<typename> friend class gc_handle;
 
     gc_heap_ptr_untyped() : heap_(nullptr), pos_(0) {
     }
@@ -329,7 +827,7 @@ public:
 
     void* get() const {
         assert(heap_);
-        return const_cast<void*>(static_cast<const void*>(&heap_->storage_[pos_]));
+        return const_cast<void*>(static_cast<const void*>(&heap_->storage_[heap_->current_position(pos_)]));
     }
 
 protected:
@@ -340,8 +838,24 @@ protected:
 private:
     gc_heap* heap_;
     uint32_t pos_;
+    uint32_t set_index_; // Index in gc_heap::pointers_ (only valid while attached)
 };
 
+inline void gc_heap::pointer_set::insert(gc_heap_ptr_untyped& p) {
+    // Note: garbage_collect() assumes nodes are added to the back
+    p.set_index_ = size();
+    set_.push_back(&p);
+}
+
+inline void gc_heap::pointer_set::erase(const gc_heap_ptr_untyped& p) {
+    // Move the last pointer into the hole
+    assert(p.set_index_ < size() && set_[p.set_index_] == &p && "Pointer not found in set!");
+    auto last = set_.back();
+    last->set_index_ = p.set_index_;
+    set_[p.set_index_] = last;
+    set_.pop_back();
+}
+
 template<typename T>
 class gc_heap_ptr : public gc_heap_ptr_untyped {
 public:
@@ -361,23 +875,34 @@ private:
     explicit gc_heap_ptr(const gc_heap_ptr_untyped& p) : gc_heap_ptr_untyped(p) {}
 };
 
-template<typename T>
+// Position of an object stored inside another object (which must fix it up when it's scanned). A weak pointer doesn't
+// keep its target alive: it's cleared (to nullptr) by the collection that finds the target unreachable otherwise.
+template<typename T, bool Weak>
 class gc_heap_ptr_untracked {
     // TODO: Add debug mode where e.g. the MSB of pos_ is set when the pointer is copied
     //       Then check that 1) it is set in fixup 2) NOT set in the destructor
     //       Should also do something similar for value_representation
     //       NOTE: this will probably make gc_table have a non-trivial destructor, so will need global flag/define
 public:
+    friend gc_weak_table;
+
     gc_heap_ptr_untracked() : pos_(0) {}
     gc_heap_ptr_untracked(const gc_heap_ptr<T>& p) : pos_(p.pos_) {}
+    gc_heap_ptr_untracked(const gc_handle<T>& h);
     gc_heap_ptr_untracked(const gc_heap_ptr_untracked&) = default;
     gc_heap_ptr_untracked& operator=(const gc_heap_ptr_untracked&) = default;
 
     explicit operator bool() const { return pos_; }
 
+    // Do both point to the same object? (Either might still refer to the old position of an object moved by an incremental collection)
+    bool same_object(const gc_heap& h, const gc_heap_ptr_untracked& other) const {
+        return pos_ == other.pos_ || (pos_ && other.pos_ && h.current_position(pos_) == h.current_position(other.pos_));
+    }
+
     T& dereference(gc_heap& h) const {
-        assert(pos_ > 0 && pos_ < h.next_free_ && gc_type_info_registration<T>::get().is_convertible(h.storage_[pos_-1].allocation.type_info()));
-        return *reinterpret_cast<T*>(&h.storage_[pos_]);
+        const auto pos = h.current_position(pos_);
+        assert(h.is_active_position(pos) && gc_type_info_registration<T>::get().is_convertible(h.storage_[pos-1].allocation.type_info()));
+        return *reinterpret_cast<T*>(&h.storage_[pos]);
     }
 
     gc_heap_ptr<T> track(gc_heap& h) const {
@@ -385,9 +910,15 @@ public:
         return h.unsafe_create_from_position<T>(pos_);
     }
 
+    gc_handle<T> handle(gc_heap& h) const;
+
     void fixup(gc_heap& old_heap) {
         if (pos_) {
-            old_heap.register_fixup(pos_);
+            if constexpr (Weak) {
+                old_heap.register_weak_fixup(pos_);
+            } else {
+                old_heap.register_fixup(pos_);
+            }
         }
     }
 
@@ -397,19 +928,143 @@ private:
     explicit gc_heap_ptr_untracked(uint32_t pos) : pos_(pos) {}
 };
 
+template<typename T>
+using gc_heap_ptr_weak = gc_heap_ptr_untracked<T, true>;
+
+// Opens a range of handles on the heap's handle stack. All handles created while the scope is the innermost one
+// are released together when it's destroyed. Scopes must be destroyed in the reverse order of their creation.
+class gc_handle_scope {
+public:
+    explicit gc_handle_scope(gc_heap& h) : heap_(h), begin_(static_cast<uint32_t>(h.handles_.size())) {
+        ++heap_.handle_scopes_;
+    }
+    ~gc_handle_scope() {
+        assert(heap_.handle_scopes_ && heap_.handles_.size() >= begin_);
+        --heap_.handle_scopes_;
+        heap_.handles_.resize(begin_);
+    }
+
+private:
+    gc_heap& heap_;
+    uint32_t begin_;
+
+    gc_handle_scope(const gc_handle_scope&) = delete;
+    gc_handle_scope& operator=(const gc_handle_scope&) = delete;
+};
+
+// While open, safepoints (see gc_heap::collect_if_needed()) don't collect. For code that holds raw pointers into the heap
+// (or is itself stored in the heap) while calling something that passes safepoints, e.g. native functions calling back
+// into scripts. Explicit collections are still performed.
+class gc_no_safepoint_scope {
+public:
+    explicit gc_no_safepoint_scope(gc_heap& h) : heap_(h) {
+        ++heap_.no_safepoint_scopes_;
+    }
+    ~gc_no_safepoint_scope() {
+        assert(heap_.no_safepoint_scopes_);
+        --heap_.no_safepoint_scopes_;
+    }
+
+private:
+    gc_heap& heap_;
+
+    gc_no_safepoint_scope(const gc_no_safepoint_scope&) = delete;
+    gc_no_safepoint_scope& operator=(const gc_no_safepoint_scope&) = delete;
+};
+
+// A cheap alternative to gc_heap_ptr for local roots: creating and copying a handle doesn't register anything with
+// the heap, but the handle is only valid while the gc_handle_scope it was created in is open. Use gc_heap_ptr
+// for anything that has to outlive the scope (e.g. stored in a container or in a lambda capture).
+template<typename T>
+class gc_handle {
+public:
+    template<typename> friend class gc_handle;
+    template<typename, bool> friend class gc_heap_ptr_untracked;
+
+    gc_handle() : heap_(nullptr), index_(0) {}
+    gc_handle(std::nullptr_t) : gc_handle() {}
+    explicit gc_handle(const gc_heap_ptr<T>& p) : heap_(p ? &p.heap() : nullptr), index_(p ? heap_->new_handle(static_cast<const gc_heap_ptr_untyped&>(p).pos_) : 0) {}
+    template<typename U, typename = typename std::enable_if<std::is_convertible_v<U*, T*>>::type>
+    gc_handle(const gc_handle<U>& h) : heap_(h.heap_), index_(h.index_) {}
+
+    explicit operator bool() const { return heap_; }
+
+    gc_heap& heap() const {
+        assert(heap_);
+        return *heap_;
+    }
+
+    T* get() const {
+        return reinterpret_cast<T*>(&heap_->storage_[position()]);
+    }
+    T* operator->() const { return get(); }
+    T& operator*() const { return *get(); }
+
+    // Create a tracked pointer to the object (e.g. to return it from the scope)
+    gc_heap_ptr<T> track() const {
+        return heap_ ? heap_->unsafe_create_from_position<T>(position()) : nullptr;
+    }
+
+private:
+    gc_heap* heap_;
+    uint32_t index_;
+
+    explicit gc_handle(gc_heap& h, uint32_t index) : heap_(&h), index_(index) {}
+
+    uint32_t position() const {
+        assert(heap_ && index_ < heap_->handles_.size());
+        return heap_->current_position(heap_->handles_[index_]);
+    }
+};
+
+template<typename T, bool Weak>
+gc_heap_ptr_untracked<T, Weak>::gc_heap_ptr_untracked(const gc_handle<T>& h) : pos_(h ? h.position() : 0) {
+}
+
+template<typename T, bool Weak>
+gc_handle<T> gc_heap_ptr_untracked<T, Weak>::handle(gc_heap& h) const {
+    assert(pos_);
+    const auto pos = h.current_position(pos_);
+    assert(h.is_active_position(pos) && gc_type_info_registration<T>::get().is_convertible(h.storage_[pos-1].allocation.type_info()));
+    return gc_handle<T>{h, h.new_handle(pos)};
+}
+
 template<typename T, typename... Args>
 gc_heap_ptr<T> gc_heap::allocate_and_construct(size_t num_bytes, Args&&... args) {
-    const auto pos = allocate(num_bytes);
+    const auto pos = allocate(num_bytes, !gc_type_info_registration<T>::needs_destroy);
+    // Decide before constructing (which might allocate as well)
+    const bool sampled = sample_countdown_ <= 0 && start_sample();
     auto& a = storage_[pos].allocation;
     assert(a.type == uninitialized_type_index);
     gc_type_info_registration<T>::construct(&storage_[pos+1], std::forward<Args>(args)...);
-    a.type = gc_type_info_registration<T>::index();
+    a.type = static_cast<uint16_t>(gc_type_info_registration<T>::index());
+    if constexpr (gc_type_info_registration<T>::needs_destroy) {
+        destructibles_.push_back(pos+1);
+    }
+    if (sampled) {
+        sample_allocation(pos+1);
+    }
     return gc_heap_ptr<T>{*this, pos+1};
 }
 
+inline uint32_t gc_weak_table::position(const gc_heap_ptr_untyped& p) {
+    return p.pos_;
+}
+
+template<typename T>
+gc_heap_ptr<T> gc_weak_table::from_position(gc_heap& h, uint32_t pos) {
+    return h.unsafe_create_from_position<T>(pos);
+}
+
+template<typename T>
+gc_heap_ptr_untracked<T> gc_weak_table::untracked_from_position(uint32_t pos) {
+    return gc_heap_ptr_untracked<T>{pos};
+}
+
 template<typename T>
 gc_heap_ptr<T> gc_heap::unsafe_create_from_position(uint32_t pos) {
-    assert(pos > 0 && pos < next_free_ && gc_type_info_registration<T>::get().is_convertible(storage_[pos-1].allocation.type_info()));
+    pos = current_position(pos);
+    assert(is_active_position(pos) && gc_type_info_registration<T>::get().is_convertible(storage_[pos-1].allocation.type_info()));
     return gc_heap_ptr<T>{*this, pos};
 }
 
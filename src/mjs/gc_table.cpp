@@ -4,6 +4,7 @@ namespace mjs {
 
 static_assert(!gc_type_info_registration<gc_table>::needs_destroy);
 static_assert(gc_type_info_registration<gc_table>::needs_fixup);
+static_assert(gc_type_info_registration<gc_table>::trivially_relocatable);
 
 gc_table::gc_table(gc_table&& other) : heap_(other.heap_), capacity_(other.capacity_), length_(other.length_) {
     static_assert(sizeof(gc_table::entry_representation) == 2*gc_heap::slot_size);
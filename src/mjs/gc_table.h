@@ -8,6 +8,9 @@
 
 namespace mjs {
 
+class gc_table;
+template<> struct gc_trivially_relocatable<gc_table> : std::true_type {};
+
 class alignas(uint64_t) gc_table {
 private:
     struct entry_representation {
@@ -50,8 +53,10 @@ public:
             return e().key.track(tab_->heap_);
         }
 
-        std::wstring_view key_view() const {
-            return e().key.dereference(tab_->heap_).view();
+        // Calls 'f' with the characters of the key (see gc_string::visit())
+        template<typename F>
+        decltype(auto) visit_key(F&& f) const {
+            return e().key.dereference(tab_->heap_).visit(std::forward<F>(f));
         }
 
         property_attribute property_attributes() const {
@@ -61,6 +66,7 @@ public:
         void value(const value& val) {
             assert(tab_);
             e().value = value_representation{val};
+            tab_->heap_.write_barrier(tab_);
         }
 
         mjs::value value() const {
@@ -94,19 +100,25 @@ public:
     void insert(const string& key, const value& v, property_attribute attr) {
         auto& raw_key = key.unsafe_raw_get();
         assert(&raw_key.heap() == &heap_);
+        assert(key.is_atom());
         assert(length() < capacity());
-        assert(find(key.view()) == end());
+        assert(find(key) == end());
         entries()[length_++] = entry_representation{
             raw_key,
             attr,
             value_representation{v}
         };
+        heap_.write_barrier(this);
     }
 
-    entry find(const std::wstring_view& key) {
-        auto it = begin(); 
+    // Keys are atoms (see atom_table), so they're found by comparing positions
+    entry find(const gc_heap_ptr_untracked<gc_string>& key) {
+        if (!key) {
+            return end();
+        }
+        auto it = begin();
         while (it != end()) {
-            if (it.key_view() == key) {
+            if (it.e().key.same_object(heap_, key)) {
                 break;
             }
             ++it;
@@ -114,8 +126,12 @@ public:
         return it;
     }
 
+    entry find(const std::wstring_view& key) {
+        return find(heap_.weak_table<atom_table>().find(key));
+    }
+
     entry find(const string& key) {
-        return find(key.view());
+        return key.is_atom() ? find(gc_heap_ptr_untracked<gc_string>{key.unsafe_raw_get()}) : find(heap_.weak_table<atom_table>().find(key));
     }
 
     entry begin() {
@@ -1,5 +1,5 @@
 #include "global_object.h"
-#include "lexer.h" // get_hex_value2/4
+#include "lexer.h" // get_hex_value, parse_decimal, trim_str_whitespace
 #include <sstream>
 #include <chrono>
 #include <algorithm>
@@ -11,7 +11,6 @@
 #include <memory>
 
 // TODO: Use the well-known strings from global_object_impl in array_object
-// TODO: Use string pool for index_string()'s? (or at least the commonly used ones...)
 
 // TODO: Get rid of this stuff alltogether
 #ifndef _WIN32
@@ -20,24 +19,56 @@
 
 namespace mjs {
 
-std::wstring index_string(uint32_t index) {
-    wchar_t buffer[10], *p = &buffer[10];
-    *--p = '\0';
-    do {
-        *--p = '0' + index % 10;
-        index /= 10;
-    } while (index);
-    return std::wstring{p};
+// Characters of one-byte strings (see gc_string::visit()) are Latin-1
+inline wchar_t to_wchar(char c) { return static_cast<unsigned char>(c); }
+inline wchar_t to_wchar(wchar_t c) { return c; }
+
+// Position of 'needle' in 'haystack' (the first one at or after 'pos', or with 'reverse' the last one at or before it)
+template<typename CharT1, typename CharT2>
+size_t find_chars(const std::basic_string_view<CharT1>& haystack, const std::basic_string_view<CharT2>& needle, size_t pos, bool reverse = false) {
+    if constexpr (std::is_same_v<CharT1, CharT2>) {
+        return reverse ? haystack.rfind(needle, pos) : haystack.find(needle, pos);
+    } else {
+        // Different widths, compare the character values
+        if (needle.length() > haystack.length()) {
+            return std::wstring_view::npos;
+        }
+        auto matches = [&](size_t i) {
+            for (size_t j = 0; j < needle.length(); ++j) {
+                if (to_wchar(haystack[i + j]) != to_wchar(needle[j])) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        const size_t last = haystack.length() - needle.length();
+        if (reverse) {
+            for (size_t i = std::min(pos, last) + 1; i-- > 0;) {
+                if (matches(i)) {
+                    return i;
+                }
+            }
+        } else {
+            for (size_t i = pos; i <= last; ++i) {
+                if (matches(i)) {
+                    return i;
+                }
+            }
+        }
+        return std::wstring_view::npos;
+    }
 }
 
-std::wstring_view ltrim(std::wstring_view s) {
+template<typename CharT>
+std::basic_string_view<CharT> ltrim(std::basic_string_view<CharT> s) {
     size_t start_pos = 0;
-    while (start_pos < s.length() && isblank(s[start_pos]))
+    while (start_pos < s.length() && isblank(to_wchar(s[start_pos])))
         ++start_pos;
     return s.substr(start_pos);
 }
 
-double parse_int(std::wstring_view s, int radix) {
+template<typename CharT>
+double parse_int(std::basic_string_view<CharT> s, int radix) {
     s = ltrim(s);
     int sign = 1;
     if (!s.empty() && (s[0] == '+' || s[0] == '-')) {
@@ -49,7 +80,7 @@ double parse_int(std::wstring_view s, int radix) {
         if (radix < 2 || radix > 36) {
             return NAN;
         }
-        if (radix == 16 && s.length() >= 2 && s[0] == '0' && tolower(s[1]) == 'x') {
+        if (radix == 16 && s.length() >= 2 && s[0] == '0' && tolower(to_wchar(s[1])) == 'x') {
             s = s.substr(2);
         }
     }
@@ -57,7 +88,7 @@ double parse_int(std::wstring_view s, int radix) {
         if (s.empty() || s[0] != '0') {
             radix = 10;
         } else {
-            if (s.size() >= 2 && tolower(s[1]) == 'x') {
+            if (s.size() >= 2 && tolower(to_wchar(s[1])) == 'x') {
                 radix = 16;
                 s = s.substr(2);
             } else {
@@ -69,10 +100,11 @@ double parse_int(std::wstring_view s, int radix) {
     double value = NAN;
 
     for (size_t i = 0; i < s.length(); ++i) {
-        if (!isdigit(s[i]) && !isalpha(s[i])) {
+        const wchar_t ch = to_wchar(s[i]);
+        if (!isdigit(ch) && !isalpha(ch)) {
             break;
         }
-        const int val = s[i]>'9' ? 10+tolower(s[i])-'a' : s[i]-'0';
+        const int val = ch>'9' ? 10+tolower(ch)-'a' : ch-'0';
         if (val >= radix) {
             break;
         }
@@ -83,15 +115,16 @@ double parse_int(std::wstring_view s, int radix) {
     return sign * value;
 }
 
-double parse_float(std::wstring_view s) {
-    std::wistringstream wiss{std::wstring{ltrim(s)}};
-    double val;
-    return wiss >> val ? val : NAN;
+template<typename CharT>
+double parse_float(const std::basic_string_view<CharT>& s) {
+    return parse_decimal(trim_str_whitespace(s, false)).first;
 }
 
-std::wstring escape(std::wstring_view s) {
+template<typename CharT>
+std::wstring escape(std::basic_string_view<CharT> s) {
     std::wstring res;
-    for (uint16_t ch: s) {
+    for (const auto c: s) {
+        const uint16_t ch = static_cast<uint16_t>(to_wchar(c));
         if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '@' || ch == '*' || ch == '_' || ch == '+' || ch == '-' || ch == '.' || ch == '/') {
             res.push_back(ch);
         } else {
@@ -113,11 +146,21 @@ std::wstring escape(std::wstring_view s) {
     return res;
 }
 
-std::wstring unescape(std::wstring_view s) {
+template<typename CharT>
+unsigned get_hex_value(const CharT* s, int num_digits) {
+    unsigned val = 0;
+    for (int i = 0; i < num_digits; ++i) {
+        val = val<<4 | get_hex_value(to_wchar(s[i]));
+    }
+    return val;
+}
+
+template<typename CharT>
+std::wstring unescape(std::basic_string_view<CharT> s) {
     std::wstring res;
     for (size_t i = 0; i < s.length(); ++i) {
         if (s[i] != '%') {
-            res.push_back(s[i]);
+            res.push_back(to_wchar(s[i]));
             continue;
         }
         ++i;
@@ -125,10 +168,10 @@ std::wstring unescape(std::wstring_view s) {
             throw std::runtime_error("Invalid string in unescape");
         }
         if (s[i] == 'u') {
-            res.push_back(static_cast<wchar_t>(get_hex_value4(&s[i+1])));
+            res.push_back(static_cast<wchar_t>(get_hex_value(&s[i+1], 4)));
             i += 4;
         } else {
-            res.push_back(static_cast<wchar_t>(get_hex_value2(&s[i])));
+            res.push_back(static_cast<wchar_t>(get_hex_value(&s[i], 2)));
             i += 1;
         }
     }
@@ -146,16 +189,16 @@ public:
     }
 
     void put(const string& name, const value& val, property_attribute attr) override {
-        if (!can_put(name.view())) {
+        if (!can_put(name)) {
             return;
         }
 
-        if (name.view() == length_str) {
+        if (name == length_str) {
             const uint32_t old_length = length();
             const uint32_t new_length = to_uint32(val);
             if (new_length < old_length) {
                 for (uint32_t i = new_length; i < old_length; ++i) {
-                    [[maybe_unused]] const bool res = object::delete_property(index_string(i));
+                    [[maybe_unused]] const bool res = object::delete_property(index_string(heap(), i));
                     assert(res);
                 }
             }
@@ -163,16 +206,16 @@ public:
         } else {
             object::put(name, val, attr);
             uint32_t index = to_uint32(value{name});
-            if (name.view() == to_string(heap(), index).view() && index != UINT32_MAX && index >= length()) {
+            if (name == to_string(heap(), index) && index != UINT32_MAX && index >= length()) {
                 object::put(string{heap(), length_str}, value{static_cast<double>(index+1)});
             }
         }
     }
 
     void unchecked_put(uint32_t index, const value& val) {
-        const auto name = index_string(index);
+        const auto name = index_string(heap(), index);
         assert(index < to_uint32(get(length_str)) && can_put(name));
-        object::put(string{heap(), name}, val);
+        object::put(name, val);
     }
 
 private:
@@ -185,15 +228,25 @@ private:
     }
 };
 
-string join(const object_ptr& o, const std::wstring_view& sep) {
+string join(const object_ptr& o, const string& sep) {
     auto& h = o.heap();
     const uint32_t l = to_uint32(o->get(array_object::length_str));
     std::wstring s;
     for (uint32_t i = 0; i < l; ++i) {
-        if (i) s += sep;
-        const auto& oi = o->get(index_string(i));
+        if (i) {
+            sep.visit([&s](const auto& v) {
+                for (const auto c: v) {
+                    s.push_back(to_wchar(c));
+                }
+            });
+        }
+        const auto& oi = o->get(index_string(h, i));
         if (oi.type() != value_type::undefined && oi.type() != value_type::null) {
-            s += to_string(h, oi).view();
+            to_string(h, oi).visit([&s](const auto& v) {
+                for (const auto c: v) {
+                    s.push_back(to_wchar(c));
+                }
+            });
         }
     }
     return string{h, s};
@@ -424,7 +477,7 @@ private:
     gc_heap_ptr<global_object_impl> self_;
 
     // Well know, commonly used strings
-#define DEFINE_STRING(x) string x ## _str_{heap(), #x}
+#define DEFINE_STRING(x) string x ## _str_{atomize(heap(), std::string_view{#x})}
     DEFINE_STRING(Object);
     DEFINE_STRING(Function);
     DEFINE_STRING(Array);
@@ -466,7 +519,7 @@ private:
         o->put(prototype_str_, value{function_prototype_}, prototype_attributes);
 
         // 15.3.4
-        function_prototype_->call_function(gc_function::make(heap(), [](const value&, const std::vector<value>&) {
+        function_prototype_->call_function(gc_function::make_native(heap(), [](const value&, const std::vector<value>&) {
             return value::undefined;
         }));
         function_prototype_->put(constructor_str_, value{o}, default_attributes);
@@ -520,7 +573,7 @@ private:
         auto c = make_function([global = self_](const value&, const std::vector<value>& args) {
             return value{global->new_boolean(!args.empty() && to_boolean(args.front()))};
         },  native_function_body(Boolean_str_), 1);
-        c->call_function(gc_function::make(heap(), [](const value&, const std::vector<value>& args) {
+        c->call_function(gc_function::make_native(heap(), [](const value&, const std::vector<value>& args) {
             return value{!args.empty() && to_boolean(args.front())};
         }));
         c->put(prototype_str_, value{boolean_prototype_}, prototype_attributes);
@@ -561,7 +614,7 @@ private:
         auto c = make_function([global = self_](const value&, const std::vector<value>& args) {
             return value{global->new_number(args.empty() ? 0.0 : to_number(args.front()))};
         }, native_function_body(Number_str_), 1);
-        c->call_function(gc_function::make(heap(), [](const value&, const std::vector<value>& args) {
+        c->call_function(gc_function::make_native(heap(), [](const value&, const std::vector<value>& args) {
             return value{args.empty() ? 0.0 : to_number(args.front())};
         }));
         c->put(prototype_str_, value{number_prototype_}, prototype_attributes);
@@ -587,7 +640,7 @@ private:
             if (radix != 10) {
                 NOT_IMPLEMENTED(radix);
             }
-            auto o = this_.object_value();
+            const gc_handle<object> o{this_.object_value()};
             return value{to_string(o.heap(), o->internal_value())};
         }, 1);
         put_native_function(number_prototype_, valueOf_str_,[check_type](const value& this_, const std::vector<value>&){
@@ -606,7 +659,7 @@ private:
     object_ptr new_string(const string& val) {
         auto o = object::make(heap(), String_str_, string_prototype_);
         o->internal_value(value{val});
-        o->put(length_str_, value{static_cast<double>(val.view().length())}, prototype_attributes);
+        o->put(length_str_, value{static_cast<double>(val.length())}, prototype_attributes);
         return o;
     }
 
@@ -618,7 +671,7 @@ private:
             auto& h = global->heap();
             return value{global->new_string(args.empty() ? string{h, ""} : to_string(h, args.front()))};
         }, native_function_body(String_str_), 1);
-        c->call_function(gc_function::make(heap(), [&h = heap()](const value&, const std::vector<value>& args) {
+        c->call_function(gc_function::make_native(heap(), [&h = heap()](const value&, const std::vector<value>& args) {
             return value{args.empty() ? string{h, ""} : to_string(h, args.front())};
         }));
         c->put(prototype_str_, value{string_prototype_}, prototype_attributes);
@@ -645,14 +698,15 @@ private:
         }, 0);
 
 
+        // The functions are called with the characters of the string (a std::string_view or std::wstring_view, see gc_string::visit())
         auto make_string_function = [&](const char* name, int num_args, auto f) {
             auto& h = heap();
             put_native_function(string_prototype_, string{heap(), name}, [&h, f](const value& this_, const std::vector<value>& args){
-                return value{f(to_string(h, this_).view(), args)};
+                return value{to_string(h, this_).visit([&args, &f](const auto& s) { return f(s, args); })};
             }, num_args);
         };
 
-        make_string_function("charAt", 1, [&h = heap()](const std::wstring_view& s, const std::vector<value>& args){
+        make_string_function("charAt", 1, [&h = heap()](const auto& s, const std::vector<value>& args){
             const int position = to_int32(get_arg(args, 0));
             if (position < 0 || position >= static_cast<int>(s.length())) {
                 return string{h, ""};
@@ -660,83 +714,84 @@ private:
             return string{h, s.substr(position, 1)};
         });
 
-        make_string_function("charCodeAt", 1, [](const std::wstring_view& s, const std::vector<value>& args){
+        make_string_function("charCodeAt", 1, [](const auto& s, const std::vector<value>& args){
             const int position = to_int32(get_arg(args, 0));
             if (position < 0 || position >= static_cast<int>(s.length())) {
                 return static_cast<double>(NAN);
             }
-            return static_cast<double>(s[position]);
+            return static_cast<double>(to_wchar(s[position]));
         });
 
-        make_string_function("indexOf", 2, [&h=heap()](const std::wstring_view& s, const std::vector<value>& args){
+        make_string_function("indexOf", 2, [&h=heap()](const auto& s, const std::vector<value>& args){
             const auto& search_string = to_string(h, get_arg(args, 0));
             const int position = to_int32(get_arg(args, 1));
-            auto index = s.find(search_string.view(), position);
+            auto index = search_string.visit([&](const auto& search) { return find_chars(s, search, position); });
             return index == std::wstring_view::npos ? -1. : static_cast<double>(index);
         });
 
-        make_string_function("lastIndexOf", 2, [&h=heap()](const std::wstring_view& s, const std::vector<value>& args){
+        make_string_function("lastIndexOf", 2, [&h=heap()](const auto& s, const std::vector<value>& args){
             const auto& search_string = to_string(h, get_arg(args, 0));
             double position = to_number(get_arg(args, 1));
             const int ipos = std::isnan(position) ? INT_MAX : to_int32(position);
-            auto index = s.rfind(search_string.view(), ipos);
+            auto index = search_string.visit([&](const auto& search) { return find_chars(s, search, ipos, true); });
             return index == std::wstring_view::npos ? -1. : static_cast<double>(index);
         });
 
-        make_string_function("split", 1, [global = self_](const std::wstring_view& s, const std::vector<value>& args){
+        // split and substring return (slices of) the string itself rather than copies, so they work with the string object
+        put_native_function(string_prototype_, string{heap(), "split"}, [global = self_](const value& this_, const std::vector<value>& args){
             auto& h = global->heap();
-            auto a = global->array_constructor(value::null, {}).object_value();
+            const auto s = to_string(h, this_);
+            const gc_handle<object> a{global->array_constructor(value::null, {}).object_value()};
             if (args.empty()) {
-                a->put(string{h, index_string(0)}, value{string{h, s}});
+                a->put(index_string(h, 0), value{s});
             } else {
                 const auto sep = to_string(h, args.front());
-                if (sep.view().empty()) {
+                if (!sep.length()) {
                     for (uint32_t i = 0; i < s.length(); ++i) {
-                        a->put(string{h, index_string(i)}, value{string{ h, s.substr(i,1) }});
+                        a->put(index_string(h, i), value{substring(s, i, 1)});
                     }
                 } else {
-                    size_t pos = 0;
+                    uint32_t pos = 0;
                     uint32_t i = 0;
                     for (; pos < s.length(); ++i) {
-                        const auto next_pos = s.find(sep.view(), pos);
+                        const auto next_pos = s.visit([&](const auto& sv) { return sep.visit([&](const auto& sepv) { return find_chars(sv, sepv, pos); }); });
                         if (next_pos == std::wstring_view::npos) {
                             break;
                         }
-                        a->put(string{h, index_string(i)}, value{string{ h, s.substr(pos, next_pos-pos) }});
-                        pos = next_pos + 1;
+                        a->put(index_string(h, i), value{substring(s, pos, static_cast<uint32_t>(next_pos) - pos)});
+                        pos = static_cast<uint32_t>(next_pos) + 1;
                     }
                     if (pos < s.length()) {
-                        a->put(string{h, index_string(i)}, value{string{ h, s.substr(pos) }});
+                        a->put(index_string(h, i), value{substring(s, pos, s.length() - pos)});
                     }
                 }
             }
-            return a;
-        });
+            return value{a.track()};
+        }, 1);
 
-        make_string_function("substring", 1, [&h = heap()](const std::wstring_view& s, const std::vector<value>& args){
-            int start = std::min(std::max(to_int32(get_arg(args, 0)), 0), static_cast<int>(s.length()));
-            if (args.size() < 2) {
-                return string{h, s.substr(start)};
-            }
-            int end = std::min(std::max(to_int32(get_arg(args, 1)), 0), static_cast<int>(s.length()));
+        put_native_function(string_prototype_, string{heap(), "substring"}, [&h = heap()](const value& this_, const std::vector<value>& args){
+            const auto s = to_string(h, this_);
+            const int length = static_cast<int>(s.length());
+            int start = std::min(std::max(to_int32(get_arg(args, 0)), 0), length);
+            int end = args.size() < 2 ? length : std::min(std::max(to_int32(get_arg(args, 1)), 0), length);
             if (start > end) {
                 std::swap(start, end);
             }
-            return string{h, s.substr(start, end-start)};
-        });
+            return value{substring(s, start, end-start)};
+        }, 1);
 
-        make_string_function("toLowerCase", 0, [&h = heap()](const std::wstring_view& s, const std::vector<value>&){
+        make_string_function("toLowerCase", 0, [&h = heap()](const auto& s, const std::vector<value>&){
             std::wstring res;
             for (auto c: s) {
-                res.push_back(towlower(c));
+                res.push_back(towlower(to_wchar(c)));
             }
             return string{h, res};
         });
 
-        make_string_function("toUpperCase", 0, [&h = heap()](const std::wstring_view& s, const std::vector<value>&){
+        make_string_function("toUpperCase", 0, [&h = heap()](const auto& s, const std::vector<value>&){
             std::wstring res;
             for (auto c: s) {
-                res.push_back(towupper(c));
+                res.push_back(towupper(to_wchar(c)));
             }
             return string{h, res};
         });
@@ -768,9 +823,9 @@ private:
         o->put(prototype_str_, value{array_prototype_}, prototype_attributes);
 
         array_prototype_->put(constructor_str_, value{o}, default_attributes);
-        put_native_function(array_prototype_, toString_str_, [](const value& this_, const std::vector<value>&) {
+        put_native_function(array_prototype_, toString_str_, [&h=heap()](const value& this_, const std::vector<value>&) {
             assert(this_.type() == value_type::object);
-            return value{join(this_.object_value(), L",")};
+            return value{join(this_.object_value(), string{h, ","})};
         }, 0);
         put_native_function(array_prototype_, "join", [&h=heap()](const value& this_, const std::vector<value>& args) {
             assert(this_.type() == value_type::object);
@@ -778,19 +833,19 @@ private:
             if (!args.empty()) {
                 sep = to_string(h, args.front());
             }
-            return value{join(this_.object_value(), sep.view())};
+            return value{join(this_.object_value(), sep)};
         }, 1);
         put_native_function(array_prototype_, "reverse", [&h = heap()](const value& this_, const std::vector<value>&) {
             assert(this_.type() == value_type::object);
             const auto& o = this_.object_value();
             const uint32_t length = to_uint32(o->get(array_object::length_str));
             for (uint32_t k = 0; k != length / 2; ++k) {
-                const auto i1 = index_string(k);
-                const auto i2 = index_string(length - k - 1);
+                const auto i1 = index_string(h, k);
+                const auto i2 = index_string(h, length - k - 1);
                 auto v1 = o->get(i1);
                 auto v2 = o->get(i2);
-                o->put(string{h, i1}, v2);
-                o->put(string{h, i2}, v1);
+                o->put(i1, v2);
+                o->put(i2, v1);
             }
             return this_;
         }, 0);
@@ -825,21 +880,20 @@ private:
                 } else {
                     const auto xs = to_string(h, x);
                     const auto ys = to_string(h, y);
-                    if (xs.view() < ys.view()) return -1;
-                    if (xs.view() > ys.view()) return 1;
-                    return 0;
+                    const int c = xs.visit([&ys](const auto& xv) { return ys.visit([&xv](const auto& yv) { return compare_chars(xv, yv); }); });
+                    return c < 0 ? -1 : c > 0 ? 1 : 0;
                 }
             };
 
             std::vector<value> values(length);
             for (uint32_t i = 0; i < length; ++i) {
-                values[i] = o->get(index_string(i));
+                values[i] = o->get(index_string(h, i));
             }
             std::stable_sort(values.begin(), values.end(), [&](const value& x, const value& y) {
                 return sort_compare(x, y) < 0;
             });
             for (uint32_t i = 0; i < length; ++i) {
-                o->put(string{h, index_string(i)}, values[i]);
+                o->put(index_string(h, i), values[i]);
             }
             return this_;
         }, 1);
@@ -988,7 +1042,7 @@ private:
             }
             return value{date_helper::time_clip(date_helper::utc(date_helper::time_from_args(args)))};
         }, native_function_body(Date_str_), 7);
-        c->call_function(gc_function::make(heap(), [global = self_](const value&, const std::vector<value>&) {
+        c->call_function(gc_function::make_native(heap(), [global = self_](const value&, const std::vector<value>&) {
             // Equivalent to (new Date()).toString()
             return value{to_string(global->heap(), value{global->new_date(date_helper::current_time_utc())})};
         }));
@@ -1098,7 +1152,7 @@ private:
 
         put_native_function(date_prototype_, "toString", [check_type](const value& this_, const std::vector<value>&) {
             check_type(this_);
-            auto o = this_.object_value();
+            const gc_handle<object> o{this_.object_value()};
             return value{date_helper::to_string(o.heap(), o->internal_value().number_value())};
         }, 0);
         // TODO: toLocaleString()
@@ -1131,19 +1185,19 @@ private:
         put_native_function(*this, "parseInt", [&h=heap()](const value&, const std::vector<value>& args) {
             const auto input = to_string(h, get_arg(args, 0));
             int radix = to_int32(get_arg(args, 1));
-            return value{parse_int(input.view(), radix)};
+            return value{input.visit([radix](const auto& s) { return parse_int(s, radix); })};
         }, 2);
         put_native_function(*this, "parseFloat", [&h=heap()](const value&, const std::vector<value>& args) {
             const auto input = to_string(h, get_arg(args, 0));
-            return value{parse_float(input.view())};
+            return value{input.visit([](const auto& s) { return parse_float(s); })};
         }, 1);
         put_native_function(*this, "escape", [&h=heap()](const value&, const std::vector<value>& args) {
             const auto input = to_string(h, get_arg(args, 0));
-            return value{string{h, escape(input.view())}};
+            return value{string{h, input.visit([](const auto& s) { return escape(s); })}};
         }, 1);
         put_native_function(*this, "unescape", [&h=heap()](const value&, const std::vector<value>& args) {
             const auto input = to_string(h, get_arg(args, 0));
-            return value{string{h, unescape(input.view())}};
+            return value{string{h, input.visit([](const auto& s) { return unescape(s); })}};
         }, 1);
         put_native_function(*this, "isNaN", [](const value&, const std::vector<value>& args) {
             return value(std::isnan(to_number(args.empty() ? value::undefined : args.front())));
@@ -1174,6 +1228,7 @@ private:
 };
 
 gc_heap_ptr<global_object> global_object::make(gc_heap& h) {
+    gc_handle_scope scope{h};
     auto global = h.make<global_object_impl>(h);
     global->self_ = global;
     global->popuplate_global(); // Populate here so the safe_ptr() won't fail the assert
@@ -1195,7 +1250,7 @@ void global_object_impl::put_function(const object_ptr& o, const native_function
     o->construct_function(f);
     assert(o->internal_value().type() == value_type::undefined);
     o->internal_value(value{body_text});
-    auto p = o->get(prototype_str_.view());
+    auto p = o->get(prototype_str_);
     assert(p.type() == value_type::object);
     p.object_value()->put(constructor_str_, value{o}, global_object_impl::default_attributes);
 }
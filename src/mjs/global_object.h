@@ -45,7 +45,7 @@ protected:
 
     template<typename F>
     object_ptr make_function(const F& f, const string& body_text, int named_args) {
-        return do_make_function(gc_function::make(heap(), f), body_text, named_args);
+        return do_make_function(gc_function::make_native(heap(), f), body_text, named_args);
     }
 
     object_ptr make_function(const native_function_type& f, const string& body_text, int named_args) {
@@ -53,8 +53,6 @@ protected:
     }
 };
 
-extern std::wstring index_string(uint32_t index);
-
 } // namespace mjs
 
 #endif
@@ -111,6 +111,7 @@ class interpreter::impl {
 public:
     explicit impl(gc_heap& h, const block_statement& program, const on_statement_executed_type& on_statement_executed) : heap_(h), global_(global_object::make(h)), on_statement_executed_(on_statement_executed) {
         assert(!global_->has_property(L"eval"));
+        gc_handle_scope scope{h};
 
         global_->put_native_function(global_, "eval", [this](const value&, const std::vector<value>& args) {
             if (args.empty()) {
@@ -130,7 +131,7 @@ public:
             return ret.result;
         }, 1);
 
-        global_->put_function(global_->get(L"Function").object_value(), gc_function::make(h, [this](const value&, const std::vector<value>& args) {
+        global_->put_function(global_->get(L"Function").object_value(), gc_function::make_native(h, [this](const value&, const std::vector<value>& args) {
             std::wstring body{}, p{};
             if (args.empty()) {
             } else if (args.size() == 1) {
@@ -163,12 +164,21 @@ public:
         assert(active_scope_ && !active_scope_->get_prev());
     }
 
+    // Handles created while evaluating are released when the evaluation is done, results are always returned as (tracked) values
+
     value eval(const expression& e) {
+        gc_handle_scope scope{heap_};
         return accept(e, *this);
     }
 
     completion eval(const statement& s) {
-        auto res = accept(s, *this);
+        auto res = [&] {
+            gc_handle_scope scope{heap_};
+            current_statement_scope current{*this, &s};
+            return accept(s, *this);
+        }();
+        // Statement boundaries are safepoints. Loop bodies are statements as well, so every iteration passes one.
+        heap_.collect_if_needed();
         if (on_statement_executed_) {
             on_statement_executed_(s, res);
         }
@@ -201,7 +211,7 @@ public:
             woss << e.member() << " is not a function";
             throw eval_exception(stack_trace(e.extend()), woss.str());
         }
-        auto c = mval.object_value()->call_function();
+        auto c = mval.object_value()->call_function_handle();
         if (!c) {
             std::wostringstream woss;
             woss << e.member() << " is not callable";
@@ -209,7 +219,7 @@ public:
         }
         auto this_ = value::null;
         if (member.type() == value_type::reference) {
-            if (auto o = member.reference_value().base(); o->class_name().view() != L"Activation") {
+            if (auto o = member.reference_value().base(); o->class_name() != L"Activation") {
                 this_ = value{o};
             }
         }
@@ -235,7 +245,7 @@ public:
             if (!base) {
                 return value{true};
             }
-            return value{base->delete_property(prop.view())};
+            return value{base->delete_property(prop)};
         } else if (e.op() == token_type::void_) {
             (void)get_value(u);
             return value::undefined;
@@ -633,14 +643,15 @@ private:
 #endif
 
         reference lookup(const string& id) const {
-            if (!prev_ || activation_.dereference(heap_).has_property(id.view())) {
+            if (!prev_ || activation_.dereference(heap_).has_property(id)) {
                 return reference{activation_.track(heap_), id};
             }
             return prev_.dereference(heap_).lookup(id);
         }
 
         reference lookup(const std::wstring& id) const {
-            return lookup(string{heap_, id});
+            // Identifiers are atomized, so the scopes can be searched by position
+            return lookup(atomize(heap_, std::wstring_view{id}));
         }
 
         void put(const string& key, const value& val) {
@@ -653,7 +664,7 @@ private:
 
         source_extend call_site;
     private:
-        explicit scope(const object_ptr& act, const scope_ptr& prev) : heap_(act.heap()), activation_(act), prev_(prev) {}
+        explicit scope(gc_heap& h, const gc_heap_ptr_untracked<object>& act, const gc_heap_ptr_untracked<scope>& prev) : heap_(h), activation_(act), prev_(prev) {}
         scope(scope&&) = default;
 
         void fixup() {
@@ -667,8 +678,9 @@ private:
     };
     class auto_scope {
     public:
-        explicit auto_scope(impl& parent, const object_ptr& act, const scope_ptr& prev) : parent(parent), old_scopes(parent.active_scope_) {
-            parent.active_scope_ = act.heap().make<scope>(act, prev);
+        template<typename ObjectPtr>
+        explicit auto_scope(impl& parent, const ObjectPtr& act, const scope_ptr& prev) : parent(parent), old_scopes(parent.active_scope_) {
+            parent.active_scope_ = make_scope(act, prev);
         }
         ~auto_scope() {
             parent.active_scope_ = old_scopes;
@@ -677,13 +689,29 @@ private:
         impl& parent;
         scope_ptr old_scopes;
     };
+    // Keeps track of the innermost statement being evaluated (for stack traces not caused by a specific expression)
+    class current_statement_scope {
+    public:
+        explicit current_statement_scope(impl& parent, const statement* s) : parent(parent), old_statement(parent.current_statement_) {
+            parent.current_statement_ = s;
+        }
+        ~current_statement_scope() {
+            parent.current_statement_ = old_statement;
+        }
+
+        impl& parent;
+        const statement* old_statement;
+    };
     gc_heap&                       heap_;
     scope_ptr                      active_scope_;
     gc_heap_ptr<global_object>     global_;
     on_statement_executed_type     on_statement_executed_;
+    const statement*               current_statement_ = nullptr;
 
-    static scope_ptr make_scope(const object_ptr& act, const scope_ptr& prev) {
-        return act.heap().make<scope>(act, prev);
+    // 'act' is either an object_ptr or a gc_handle<object>
+    template<typename ObjectPtr>
+    static scope_ptr make_scope(const ObjectPtr& act, const scope_ptr& prev) {
+        return act.heap().template make<scope>(act.heap(), gc_heap_ptr_untracked<object>{act}, gc_heap_ptr_untracked<scope>{prev});
     }
 
     std::vector<source_extend> stack_trace(const source_extend& current_extend) const {
@@ -696,6 +724,20 @@ private:
         return t;
     }
 
+public:
+    std::vector<source_extend> stack_trace() const {
+        if (active_scope_->call_site.file || !current_statement_) {
+            // A native function (or the setup of a script function) is in progress, the innermost call site is more precise
+            std::vector<source_extend> t;
+            for (const scope* p = active_scope_.get(); p != nullptr; p = p->get_prev()) {
+                if (p->call_site.file) t.push_back(p->call_site);
+            }
+            return t;
+        }
+        return stack_trace(current_statement_->extend());
+    }
+
+private:
     std::vector<value> eval_argument_list(const expression_list& es) {
         std::vector<value> args;
         for (const auto& e: es) {
@@ -720,7 +762,7 @@ private:
             woss << e << " is not an object";
             throw eval_exception(stack_trace(e.extend()), woss.str());
         }
-        auto c = o.object_value()->construct_function();
+        auto c = o.object_value()->construct_function_handle();
         if (!c) {
             std::wostringstream woss;
             woss << e << " is not constructable";
@@ -738,18 +780,19 @@ private:
         auto callee = global_->make_raw_function();
         auto func = [this, block, param_names, prev_scope, callee, ids = hoisting_visitor::scan(*block)](const value& this_, const std::vector<value>& args) {
             // Arguments array
-            auto as = object::make(heap_, string{heap_, "Object"}, global_->object_prototype());
+            const gc_handle<object> as{object::make(heap_, string{heap_, "Object"}, global_->object_prototype())};
             as->put(string{heap_, "callee"}, value{callee}, property_attribute::dont_enum);
             as->put(string{heap_, "length"}, value{static_cast<double>(args.size())}, property_attribute::dont_enum);
             for (uint32_t i = 0; i < args.size(); ++i) {
-                as->put(string{heap_, index_string(i)}, args[i], property_attribute::dont_enum);
+                as->put(index_string(heap_, i), args[i], property_attribute::dont_enum);
             }
 
             // Scope
-            auto activation = object::make(heap_, string{heap_, "Activation"}, nullptr); // TODO
+            const gc_handle<object> activation{object::make(heap_, string{heap_, "Activation"}, nullptr)}; // TODO
             auto_scope auto_scope_{*this, activation, prev_scope};
+            current_statement_scope no_statement{*this, nullptr}; // Until the body is evaluated
             activation->put(string{heap_, "this"}, this_, property_attribute::dont_delete | property_attribute::dont_enum | property_attribute::read_only);
-            activation->put(string{heap_, "arguments"}, value{as}, property_attribute::dont_delete);
+            activation->put(string{heap_, "arguments"}, value{as.track()}, property_attribute::dont_delete);
             for (size_t i = 0; i < param_names.size(); ++i) {
                 activation->put(string{heap_, param_names[i]}, i < args.size() ? args[i] : value::undefined);
             }
@@ -784,6 +827,10 @@ interpreter::interpreter(gc_heap& h, const block_statement& program, const on_st
 
 interpreter::~interpreter() = default;
 
+std::vector<source_extend> interpreter::stack_trace() const {
+    return impl_->stack_trace();
+}
+
 value interpreter::eval(const expression& e) {
     return impl_->eval(e);
 
@@ -4,12 +4,14 @@
 #include "value.h"
 #include <functional>
 #include <memory>
+#include <vector>
 
 namespace mjs {
 
 class block_statement;
 class statement;
 class expression;
+struct source_extend;
 
 enum class completion_type {
     normal, break_, continue_, return_
@@ -36,6 +38,10 @@ public:
     value eval(const expression& e);
     completion eval(const statement& s);
 
+    // Extend of the statement currently being evaluated followed by the call sites of the active function calls (innermost first).
+    // Empty when nothing is being evaluated.
+    std::vector<source_extend> stack_trace() const;
+
 private:
     class impl;
     std::unique_ptr<impl> impl_;
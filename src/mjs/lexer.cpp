@@ -2,6 +2,8 @@
 #include <ostream>
 #include <sstream>
 #include <cstring>
+#include <cmath>
+#include <charconv>
 #include <tuple>
 
 #define RESERVED_WORDS(X) \
@@ -217,6 +219,19 @@ constexpr bool is_line_terminator(int ch) {
     return ch == 0x0A || ch == 0x0D;
 }
 
+bool is_str_whitespace(wchar_t ch) {
+    if (is_whitespace(ch) || is_line_terminator(ch)) {
+        return true;
+    }
+    switch (static_cast<uint32_t>(ch)) {
+    case 0x00A0: case 0x1680: case 0x202F: case 0x205F: case 0x3000: // NBSP and the other space separators
+    case 0x2028: case 0x2029:                                       // LS, PS
+    case 0xFEFF:                                                    // BOM
+        return true;
+    }
+    return ch >= 0x2000 && ch <= 0x200A;
+}
+
 constexpr bool is_identifier_letter(int ch) {
     return ch == '_' || ch == '$' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
 }
@@ -355,6 +370,110 @@ unsigned get_hex_value(int ch) {
     throw std::runtime_error("Invalid hex digit: " + std::string(1, (char)ch));
 }
 
+namespace {
+
+template<typename CharT>
+std::pair<double, size_t> do_parse_decimal(const std::basic_string_view<CharT>& s) {
+    constexpr std::pair<double, size_t> no_match{NAN, 0};
+    auto digit_at = [&s](size_t i) { return i < s.length() && s[i] >= '0' && s[i] <= '9' ? s[i] - '0' : -1; };
+
+    size_t i = 0;
+    const bool negative = !s.empty() && s[0] == '-';
+    if (!s.empty() && (s[0] == '+' || s[0] == '-')) {
+        ++i;
+    }
+    if (constexpr std::string_view inf{"Infinity"}; s.length() - i >= inf.length() && std::equal(inf.begin(), inf.end(), s.begin() + i)) {
+        return {negative ? -HUGE_VAL : HUGE_VAL, i + inf.length()};
+    }
+
+    // Gather up to 19 significant digits (all fit in a uint64_t), the value is mantissa * 10^exponent
+    const size_t start = i;
+    uint64_t mantissa = 0;
+    int num_digits = 0;
+    int exponent = 0;
+    bool inexact = false;   // Were non-zero digits dropped?
+    bool any_digits = false;
+    auto add_digit = [&](int d, bool fraction) {
+        if (!mantissa && !d) {
+            // Leading zero
+            exponent -= fraction;
+        } else if (num_digits < 19) {
+            mantissa = mantissa * 10 + d;
+            ++num_digits;
+            exponent -= fraction;
+        } else {
+            exponent += !fraction;
+            inexact |= d != 0;
+        }
+        any_digits = true;
+    };
+    for (int d; (d = digit_at(i)) >= 0; ++i) {
+        add_digit(d, false);
+    }
+    if (i < s.length() && s[i] == '.') {
+        for (int d; (d = digit_at(++i)) >= 0;) {
+            add_digit(d, true);
+        }
+    }
+    if (!any_digits) {
+        return no_match;
+    }
+    if (i < s.length() && (s[i] == 'e' || s[i] == 'E')) {
+        size_t j = i + 1;
+        const bool negative_exponent = j < s.length() && s[j] == '-';
+        if (j < s.length() && (s[j] == '+' || s[j] == '-')) {
+            ++j;
+        }
+        if (digit_at(j) >= 0) {
+            int e = 0;
+            for (int d; (d = digit_at(j)) >= 0; ++j) {
+                // Anything this big over- or underflows anyway
+                e = std::min(e * 10 + d, 100'000);
+            }
+            exponent += negative_exponent ? -e : e;
+            i = j;
+        }
+    }
+
+    double v;
+    static constexpr double powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    if (!mantissa) {
+        v = 0;
+    } else if (!inexact && mantissa <= (uint64_t{1} << 53) && exponent >= -22 && exponent <= 22) {
+        // Both the mantissa and the power of ten are exact doubles, so the result of one operation is correctly rounded
+        v = exponent < 0 ? static_cast<double>(mantissa) / powers_of_ten[-exponent] : static_cast<double>(mantissa) * powers_of_ten[exponent];
+    } else {
+        // Let std::from_chars handle the rest (the common standard libraries use the Eisel-Lemire algorithm with a fallback
+        // for the rare hard cases). It wants chars, but everything that's been matched is ASCII.
+        char buf[64];
+        std::string long_buf;
+        char* chars = buf;
+        const size_t length = i - start;
+        if (length > sizeof(buf)) {
+            long_buf.resize(length);
+            chars = long_buf.data();
+        }
+        for (size_t k = 0; k < length; ++k) {
+            chars[k] = static_cast<char>(s[start + k]);
+        }
+        if (std::from_chars(chars, chars + length, v).ec != std::errc{}) {
+            // Out of range, overflows if the first significant digit is before the decimal point
+            v = exponent + num_digits > 0 ? HUGE_VAL : 0;
+        }
+    }
+    return {negative ? -v : v, i};
+}
+
+} // unnamed namespace
+
+std::pair<double, size_t> parse_decimal(const std::wstring_view& s) {
+    return do_parse_decimal(s);
+}
+
+std::pair<double, size_t> parse_decimal(const std::string_view& s) {
+    return do_parse_decimal(s);
+}
+
 unsigned get_hex_value2(const wchar_t* s) {
     return get_hex_value(s[0])<<4 | get_hex_value(s[1]);
 }
@@ -475,11 +594,9 @@ void lexer::next_token() {
                     }
                 }
 
-                std::string s{text_.begin() + text_pos_, text_.begin() + token_end};
-                size_t len;
-                const double v = std::stod(s, &len);
-                if (len != s.length()) {
-                    throw std::runtime_error("Invalid string literal " + s);
+                const auto [v, len] = parse_decimal(text_.substr(text_pos_, token_end - text_pos_));
+                if (len != token_end - text_pos_) {
+                    throw std::runtime_error("Invalid string literal " + std::string{text_.begin() + text_pos_, text_.begin() + token_end});
                 }
                 current_token_  = token{v};
             }
@@ -4,6 +4,8 @@
 #include <iosfwd>
 #include <cassert>
 #include <string>
+#include <string_view>
+#include <utility>
 
 namespace mjs {
 
@@ -105,6 +107,29 @@ extern unsigned get_hex_value(int ch);
 unsigned get_hex_value2(const wchar_t* s);
 unsigned get_hex_value4(const wchar_t* s);
 
+// StrWhiteSpaceChar (9.3.1): TAB, VT, FF, SP, LF and CR, plus (as in later editions) NBSP, the Unicode space separators,
+// LS, PS and BOM. Used wherever strings are converted to numbers.
+bool is_str_whitespace(wchar_t ch);
+inline bool is_str_whitespace(char ch) { return is_str_whitespace(static_cast<wchar_t>(static_cast<unsigned char>(ch))); }
+
+// 's' without leading and (if 'trailing') trailing StrWhiteSpaceChar's
+template<typename CharT>
+std::basic_string_view<CharT> trim_str_whitespace(std::basic_string_view<CharT> s, bool trailing = true) {
+    while (!s.empty() && is_str_whitespace(s.front())) {
+        s.remove_prefix(1);
+    }
+    while (trailing && !s.empty() && is_str_whitespace(s.back())) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// Parse the longest prefix of 's' that's a StrDecimalLiteral (9.3.1): an optional sign followed by "Infinity" or by decimal
+// digits with an optional fraction and exponent. Returns the correctly rounded value and the length of the prefix (0 if there
+// isn't one, the value is then NaN).
+std::pair<double, size_t> parse_decimal(const std::wstring_view& s);
+std::pair<double, size_t> parse_decimal(const std::string_view& s);
+
 class token {
 public:
     explicit token(token_type type) : type_(type) {
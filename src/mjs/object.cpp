@@ -4,6 +4,7 @@ namespace mjs {
 
 static_assert(gc_type_info_registration<object>::needs_fixup);
 static_assert(!gc_type_info_registration<object>::needs_destroy);
+static_assert(!gc_type_info_registration<object>::trivially_relocatable);
 
 object::object(gc_heap& heap, const string& class_name, const object_ptr& prototype)
     : heap_(heap)
@@ -55,11 +56,8 @@ void object::debug_print(std::wostream& os, int indent_incr, int max_nest, int i
     os << "{\n";
     auto& props = properties_.dereference(heap_);
     for (auto it = props.begin(); it != props.end(); ++it) {
-        if (it.key()->view() == L"constructor") {
-            print_prop(it.key()->view(), it.value(), true);
-        } else {
-            print_prop(it.key()->view(), it.value(), false);
-        }
+        const auto key = it.key()->view(heap_);
+        print_prop(key, it.value(), key == L"constructor");
     }
     print_prop("[[Class]]", class_name(), true);
     print_prop("[[Prototype]]", prototype_ ? value{prototype_.track(heap())} : value::null, true);
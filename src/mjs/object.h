@@ -41,21 +41,38 @@ public:
     // property; it is used internally to distinguish different kinds of built-in objects
     string class_name() const { return class_.track(heap_); }
 
+    // Objects are labeled with their [[Class]] in heap snapshots (characters that aren't Latin-1 become '?')
+    std::string snapshot_label() const {
+        return class_.dereference(heap_).visit([](const auto& v) {
+            std::string label;
+            for (const auto c: v) {
+                label.push_back(static_cast<std::make_unsigned_t<decltype(c)>>(c) > 0xff ? '?' : static_cast<char>(c));
+            }
+            return label;
+        });
+    }
+
     // [[Value]] ()
     value internal_value() const { return value_.get_value(heap_); }
-    void internal_value(const value& v) { value_ = value_representation{v}; }
+    void internal_value(const value& v) { value_ = value_representation{v}; heap_.write_barrier(this); }
 
     // [[Get]] (PropertyName)
     value get(const std::wstring_view& name) const {
         auto [it, pp] = deep_find(name);
         return it != pp->end() ? it.value() : value::undefined;
     }
+    value get(const string& name) const {
+        auto [it, pp] = deep_find(name);
+        return it != pp->end() ? it.value() : value::undefined;
+    }
 
     // [[Put]] (PropertyName, Value)
     virtual void put(const string& name, const value& val, property_attribute attr = property_attribute::none) {
+        // Property names are stored as atoms
+        const auto key = atomize(name);
         // See if there is already a property with this name
         auto& props = properties_.dereference(heap_);
-        if (auto [it, pp] = deep_find(name.view()); it != pp->end()) {
+        if (auto [it, pp] = deep_find(gc_heap_ptr_untracked<gc_string>{key.unsafe_raw_get()}); it != pp->end()) {
             // CanPut?
             if (it.has_attribute(property_attribute::read_only)) {
                 return;
@@ -71,13 +88,14 @@ public:
         // Room to insert another element?
         if (props.length() != props.capacity()) {
             // Yes, insert into existing table
-            props.insert(name, val, attr);
+            props.insert(key, val, attr);
         } else {
             // No, increase the capacity
             properties_ = props.copy_with_increased_capacity();
+            heap_.write_barrier(this);
             // let props (old properties_) be collected
             // MUST dereference again here
-            properties_.dereference(heap_).insert(name, val, attr);
+            properties_.dereference(heap_).insert(key, val, attr);
         }
     }
 
@@ -86,26 +104,27 @@ public:
         auto [it, pp] = deep_find(name);
         return it != pp->end() ? !it.has_attribute(property_attribute::read_only) : true;
     }
+    bool can_put(const string& name) const {
+        auto [it, pp] = deep_find(name);
+        return it != pp->end() ? !it.has_attribute(property_attribute::read_only) : true;
+    }
 
     // [[HasProperty]] (PropertyName)
     bool has_property(const std::wstring_view& name) const {
         auto [it, pp] = deep_find(name);
         return it != pp->end();
     }
+    bool has_property(const string& name) const {
+        auto [it, pp] = deep_find(name);
+        return it != pp->end();
+    }
 
     // [[Delete]] (PropertyName)
     bool delete_property(const std::wstring_view& name) {
-        auto& props = properties_.dereference(heap_);
-        auto it = props.find(name);
-        if (it == props.end()) {
-            return true;
-
-        }
-        if (it.has_attribute(property_attribute::dont_delete)) {
-            return false;
-        }
-        it.erase();
-        return true;
+        return erase_property(properties_.dereference(heap_).find(name));
+    }
+    bool delete_property(const string& name) {
+        return erase_property(properties_.dereference(heap_).find(name));
     }
 
     virtual value_type default_value_type() const {
@@ -114,13 +133,17 @@ public:
     }
 
     // [[Construct]] (Arguments...)
-    void construct_function(const native_function_type& f) { construct_ = f; }
+    void construct_function(const native_function_type& f) { construct_ = f; heap_.write_barrier(this); }
     native_function_type construct_function() const { return construct_ ? construct_.track(heap_) : nullptr; }
 
     // [[Call]] (Arguments...)
-    void call_function(const native_function_type& f) { call_ = f; }
+    void call_function(const native_function_type& f) { call_ = f; heap_.write_barrier(this); }
     native_function_type call_function() const { return call_ ? call_.track(heap_) : nullptr; }
 
+    // As above, but as handles (cheaper than tracked pointers). Only for callers that are known to run inside a gc_handle_scope.
+    gc_handle<gc_function> construct_function_handle() const { return construct_ ? construct_.handle(heap_) : nullptr; }
+    gc_handle<gc_function> call_function_handle() const { return call_ ? call_.handle(heap_) : nullptr; }
+
     std::vector<string> property_names() const;
 
     virtual void debug_print(std::wostream& os, int indent_incr, int max_nest = INT_MAX, int indent = 0) const;
@@ -141,10 +164,31 @@ private:
 
     void add_property_names(std::vector<string>& names) const;
 
+    // [[Delete]] of the property at 'it' (which may be the end)
+    bool erase_property(gc_table::entry it) {
+        if (it == properties_.dereference(heap_).end()) {
+            return true;
+        }
+        if (it.has_attribute(property_attribute::dont_delete)) {
+            return false;
+        }
+        it.erase();
+        return true;
+    }
+
+    // Look up the atom once, and then search the prototype chain by position
     std::pair<gc_table::entry, gc_table*> deep_find(const std::wstring_view& key) const {
+        return deep_find(heap_.weak_table<atom_table>().find(key));
+    }
+
+    std::pair<gc_table::entry, gc_table*> deep_find(const string& key) const {
+        return key.is_atom() ? deep_find(gc_heap_ptr_untracked<gc_string>{key.unsafe_raw_get()}) : deep_find(heap_.weak_table<atom_table>().find(key));
+    }
+
+    std::pair<gc_table::entry, gc_table*> deep_find(const gc_heap_ptr_untracked<gc_string>& key) const {
         auto& props = properties_.dereference(heap_);
         auto it = props.find(key);
-        return it != props.end() || !prototype_ ? std::make_pair(it, &props) : prototype_.dereference(heap_).deep_find(key);
+        return it != props.end() || !prototype_ || !key ? std::make_pair(it, &props) : prototype_.dereference(heap_).deep_find(key);
     }
 };
 
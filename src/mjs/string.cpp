@@ -1,29 +1,547 @@
 #include "string.h"
+#include "lexer.h"
 #include <ostream>
-#include <sstream>
 #include <cstring>
+#include <algorithm>
 #include <cmath>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 namespace mjs {
 
+// Concatenation of two strings. Creating one is O(1), the characters are copied into a new flat string the first time
+// they're needed (after which the parts are released).
+class gc_rope_string : public gc_string {
+public:
+    // Results shorter than this are copied right away
+    static constexpr uint32_t min_length = 16;
+
+    static gc_heap_ptr<gc_string> make(gc_heap& h, const gc_heap_ptr<gc_string>& l, const gc_heap_ptr<gc_string>& r) {
+        return h.allocate_and_construct<gc_rope_string>(sizeof(gc_rope_string), h, l, r);
+    }
+
+    const gc_string& flatten();
+
+private:
+    friend gc_type_info_registration<gc_rope_string>;
+
+    gc_heap& heap_;
+    gc_heap_ptr_untracked<gc_string> left_;  // Null once flattened
+    gc_heap_ptr_untracked<gc_string> right_; // Null once flattened
+    gc_heap_ptr_untracked<gc_string> flat_;  // Set once flattened
+
+    explicit gc_rope_string(gc_heap& h, const gc_heap_ptr<gc_string>& l, const gc_heap_ptr<gc_string>& r)
+        : gc_string(rope_kind, l->length() + r->length(), l->is_one_byte() && r->is_one_byte()), heap_(h), left_(l), right_(r) {
+    }
+
+    // Relocated by copying its bytes (gc_string's move constructor only handles flat strings)
+    gc_rope_string(gc_rope_string&&) = delete;
+
+    void fixup() {
+        left_.fixup(heap_);
+        right_.fixup(heap_);
+        flat_.fixup(heap_);
+    }
+};
+template<> struct gc_trivially_relocatable<gc_rope_string> : std::true_type {};
+
+// Characters [offset, offset+length) of another string (the parent, which is never a slice itself). Creating one is O(1).
+// A slice keeps its parent alive, so the slices that survive a full collection are checked (see sliced_string_table) and
+// those referring to little of their parent get their own copy of the characters, letting the rest of the parent die.
+class gc_sliced_string : public gc_string {
+public:
+    // Results shorter than this are copied right away (the copy isn't much bigger than a slice and doesn't keep the parent alive)
+    static constexpr uint32_t min_length = 64;
+
+    static gc_heap_ptr<gc_string> make(gc_heap& h, const gc_heap_ptr<gc_string>& s, uint32_t offset, uint32_t length);
+
+    const gc_string& parent() const { return parent_.dereference(heap_); }
+
+    const gc_string& storage(uint32_t& offset) const {
+        offset = offset_;
+        const auto& p = parent();
+        return p.is_flat() ? p : p.flatten();
+    }
+
+    // Refer to a copy of the characters instead of the parent
+    void materialize();
+
+private:
+    friend gc_type_info_registration<gc_sliced_string>;
+
+    gc_heap& heap_;
+    gc_heap_ptr_untracked<gc_string> parent_; // Flat or a rope
+    uint32_t offset_;
+
+    explicit gc_sliced_string(gc_heap& h, const gc_heap_ptr_untracked<gc_string>& parent, uint32_t offset, uint32_t length, bool one_byte)
+        : gc_string(slice_kind, length, one_byte), heap_(h), parent_(parent), offset_(offset) {
+    }
+
+    // Relocated by copying its bytes (gc_string's move constructor only handles flat strings)
+    gc_sliced_string(gc_sliced_string&&) = delete;
+
+    void fixup() {
+        parent_.fixup(heap_);
+    }
+};
+template<> struct gc_trivially_relocatable<gc_sliced_string> : std::true_type {};
+
 static_assert(!gc_type_info_registration<gc_string>::needs_destroy);
 static_assert(!gc_type_info_registration<gc_string>::needs_fixup);
+static_assert(gc_type_info_registration<gc_string>::trivially_relocatable);
+static_assert(!gc_type_info_registration<gc_rope_string>::needs_destroy);
+static_assert(gc_type_info_registration<gc_rope_string>::needs_fixup);
+static_assert(gc_type_info_registration<gc_rope_string>::trivially_relocatable);
+static_assert(!gc_type_info_registration<gc_sliced_string>::needs_destroy);
+static_assert(gc_type_info_registration<gc_sliced_string>::needs_fixup);
+static_assert(gc_type_info_registration<gc_sliced_string>::trivially_relocatable);
+
+namespace {
+
+// Copy the characters of 's' (which mustn't be a rope that's yet to be flattened) to 'out' (which is one-byte only if 's' is)
+template<typename CharT>
+CharT* copy_chars(CharT* out, const gc_string& s) {
+    return s.visit([out](const auto& v) {
+        if constexpr (std::is_same_v<typename std::decay_t<decltype(v)>::value_type, CharT>) {
+            std::memcpy(out, v.data(), v.length() * sizeof(CharT));
+        } else if constexpr (std::is_same_v<CharT, wchar_t>) {
+            for (size_t i = 0; i < v.length(); ++i) {
+                out[i] = static_cast<unsigned char>(v[i]);
+            }
+        } else {
+            assert(!"Wide characters copied to one-byte string");
+        }
+        return out + v.length();
+    });
+}
+
+// Wide copies of the one-byte strings gc_string::view() has been called on since the last collection
+class widened_string_cache : public gc_weak_table {
+public:
+    explicit widened_string_cache(gc_heap& h) : heap_(h) {}
+
+    std::wstring_view get(const gc_string& s) {
+        auto& w = strings_[&s];
+        if (w.empty()) {
+            w.resize(s.length());
+            copy_chars(w.data(), const_cast<gc_string&>(s));
+            heap_.add_external_usage(w.length() * sizeof(wchar_t));
+        }
+        return w;
+    }
+
+    void update_positions(const position_resolver&) override {
+        // Objects have moved (or died), and the views handed out so far are no longer valid anyway
+        strings_.clear();
+    }
+
+private:
+    gc_heap& heap_;
+    std::unordered_map<const gc_string*, std::wstring> strings_;
+};
+
+// The slices that might be keeping most of their parent alive for nothing
+class sliced_string_table : public gc_weak_table {
+public:
+    explicit sliced_string_table(gc_heap& h) : heap_(h) {}
+
+    void add(const gc_heap_ptr<gc_string>& s) {
+        slices_.push_back(position(s));
+    }
+
+    void update_positions(const position_resolver& resolve) override {
+        size_t n = 0;
+        for (const auto pos: slices_) {
+            if (const auto new_pos = resolve(pos)) {
+                slices_[n++] = new_pos;
+            }
+        }
+        slices_.resize(n);
+    }
+
+    void full_collection_finished() override {
+        // Give the slices their own copies when those that survived refer to less than a quarter of their parent's
+        // characters. The parent might still be used elsewhere, but then at most that much is spent on copies.
+        std::unordered_map<const gc_string*, uint64_t> referenced;
+        for (const auto pos: slices_) {
+            auto& s = slice(pos);
+            referenced[&s.parent()] += s.length();
+        }
+        size_t n = 0;
+        for (const auto pos: slices_) {
+            auto& s = slice(pos);
+            const auto& p = s.parent();
+            if (referenced[&p] * 4 >= p.length()) {
+                slices_[n++] = pos;
+                continue;
+            }
+            try {
+                s.materialize();
+            } catch (const gc_heap_limit_exceeded&) {
+                // Keep sharing, the heap is full anyway
+                slices_[n++] = pos;
+            }
+        }
+        slices_.resize(n);
+    }
+
+private:
+    gc_heap& heap_;
+    std::vector<uint32_t> slices_;
+
+    gc_sliced_string& slice(uint32_t pos) const {
+        return untracked_from_position<gc_sliced_string>(pos).dereference(heap_);
+    }
+};
+
+} // unnamed namespace
+
+const gc_string& gc_rope_string::flatten() {
+    if (!flat_) {
+        // Allocating doesn't move anything (only collections do), so raw pointers to the parts stay valid while copying
+        const uint32_t length = length_;
+        auto flat = heap_.allocate_and_construct<gc_string>(sizeof(gc_string) + length * (one_byte_ ? 1 : sizeof(wchar_t)), length, static_cast<bool>(one_byte_));
+        auto copy = [&](auto* out) {
+            const auto end = out + length;
+            // Walk the tree with an explicit stack, ropes built in loops can be very deep
+            std::vector<gc_string*> pending{this};
+            while (!pending.empty()) {
+                auto s = pending.back();
+                pending.pop_back();
+                if (s->kind_ == rope_kind) {
+                    auto& r = static_cast<gc_rope_string&>(*s);
+                    if (!r.flat_) {
+                        pending.push_back(&r.right_.dereference(heap_));
+                        pending.push_back(&r.left_.dereference(heap_));
+                        continue;
+                    }
+                    s = &r.flat_.dereference(heap_);
+                }
+                out = copy_chars(out, *s);
+            }
+            assert(out == end);
+            (void)end;
+        };
+        if (one_byte_) {
+            copy(flat->bytes());
+        } else {
+            copy(flat->data());
+        }
+        flat_ = flat;
+        left_ = right_ = gc_heap_ptr_untracked<gc_string>{};
+        heap_.write_barrier(this);
+    }
+    return flat_.dereference(heap_);
+}
+
+gc_heap_ptr<gc_string> gc_sliced_string::make(gc_heap& h, const gc_heap_ptr<gc_string>& s, uint32_t offset, uint32_t length) {
+    assert(offset <= s->length() && length <= s->length() - offset);
+    auto res = s->kind_ == slice_kind
+        ? h.allocate_and_construct<gc_sliced_string>(sizeof(gc_sliced_string), h, static_cast<const gc_sliced_string&>(*s).parent_, static_cast<const gc_sliced_string&>(*s).offset_ + offset, length, static_cast<bool>(s->one_byte_))
+        : h.allocate_and_construct<gc_sliced_string>(sizeof(gc_sliced_string), h, s, offset, length, static_cast<bool>(s->one_byte_));
+    h.weak_table<sliced_string_table>().add(res);
+    return res;
+}
+
+void gc_sliced_string::materialize() {
+    auto copy = visit([this](const auto& v) { return gc_string::make(heap_, v); });
+    one_byte_ = copy->one_byte_;
+    parent_ = copy;
+    offset_ = 0;
+    heap_.write_barrier(this);
+}
+
+const gc_string& gc_string::flatten() const {
+    assert(kind_ == rope_kind);
+    return static_cast<gc_rope_string&>(const_cast<gc_string&>(*this)).flatten();
+}
+
+const gc_string& gc_string::storage(uint32_t& offset) const {
+    if (kind_ == slice_kind) {
+        return static_cast<const gc_sliced_string&>(*this).storage(offset);
+    }
+    offset = 0;
+    return kind_ == flat_kind ? *this : flatten();
+}
+
+std::wstring_view gc_string::slow_view(gc_heap& h) const {
+    if (!one_byte_) {
+        uint32_t offset;
+        const auto& s = storage(offset);
+        return std::wstring_view(const_cast<gc_string&>(s).data() + offset, length_);
+    } else if (!length_) {
+        return {};
+    }
+    return h.weak_table<widened_string_cache>().get(*this);
+}
+
+string operator+(const string& l, const string& r) {
+    const auto& lr = l.unsafe_raw_get();
+    const auto& rr = r.unsafe_raw_get();
+    const uint64_t length = static_cast<uint64_t>(lr->length()) + rr->length();
+    if (!rr->length()) {
+        return l;
+    } else if (!lr->length()) {
+        return r;
+    } else if (length > gc_string::max_length) {
+        throw std::length_error{"String too long"};
+    } else if (length >= gc_rope_string::min_length) {
+        return string{gc_rope_string::make(l.heap(), lr, rr)};
+    }
+    const bool one_byte = lr->is_one_byte() && rr->is_one_byte();
+    // The parts might be ropes that get flattened while copying, that's fine since allocating doesn't move anything
+    auto res = l.heap().allocate_and_construct<gc_string>(sizeof(gc_string) + length * (one_byte ? 1 : sizeof(wchar_t)), static_cast<uint32_t>(length), one_byte);
+    if (one_byte) {
+        copy_chars(copy_chars(res->bytes(), *lr), *rr);
+    } else {
+        copy_chars(copy_chars(res->data(), *lr), *rr);
+    }
+    return string{res};
+}
+
+string substring(const string& s, uint32_t start, uint32_t length) {
+    const auto& raw = s.unsafe_raw_get();
+    assert(start <= raw->length() && length <= raw->length() - start);
+    if (length == raw->length()) {
+        return s;
+    } else if (length < gc_sliced_string::min_length) {
+        return raw->visit([&](const auto& v) { return string{s.heap(), v.substr(start, length)}; });
+    }
+    return string{gc_sliced_string::make(s.heap(), raw, start, length)};
+}
 
 std::ostream& operator<<(std::ostream& os, const string& s) {
-    auto v = s.view();
-    return os << std::string(v.begin(), v.end());
+    return s.visit([&os](const auto& v) -> std::ostream& {
+        return os << std::string(v.begin(), v.end());
+    });
 }
 
 std::wostream& operator<<(std::wostream& os, const string& s) {
-    return os << s.view();
+    return s.visit([&os](const auto& v) -> std::wostream& {
+        if constexpr (std::is_same_v<std::decay_t<decltype(v)>, std::wstring_view>) {
+            return os << v;
+        } else {
+            for (const auto c: v) {
+                os.put(static_cast<unsigned char>(c));
+            }
+            return os;
+        }
+    });
+}
+
+template<typename CharT>
+uint32_t atom_table::hash(const std::basic_string_view<CharT>& s) {
+    // FNV-1a over the character values, so it doesn't depend on how they're stored
+    uint32_t h = 2166136261u;
+    for (const auto c: s) {
+        h = (h ^ static_cast<uint32_t>(static_cast<std::make_unsigned_t<CharT>>(c))) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+template<typename CharT>
+uint32_t atom_table::find_index(const std::basic_string_view<CharT>& s, uint32_t h) const {
+    assert(!entries_.empty());
+    const auto mask = static_cast<uint32_t>(entries_.size() - 1);
+    for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+        const auto& e = entries_[i];
+        if (!e.hash) {
+            return i;
+        }
+        if (e.hash == h && e.pos && untracked_from_position<gc_string>(e.pos).dereference(heap_).visit([&s](const auto& v) { return equal_chars(v, s); })) {
+            return i;
+        }
+    }
+}
+
+template<typename CharT>
+gc_heap_ptr_untracked<gc_string> atom_table::find_chars(const std::basic_string_view<CharT>& s) const {
+    if (entries_.empty()) {
+        return {};
+    }
+    const auto& e = entries_[find_index(s, hash(s))];
+    return untracked_from_position<gc_string>(e.hash ? e.pos : 0);
+}
+
+string atom_table::get(const string& s) {
+    if (s.is_atom()) {
+        return s;
+    }
+    const auto& raw = s.unsafe_raw_get();
+    if (!raw->is_flat()) {
+        // Atoms are flat (so looking them up never allocates)
+        return raw->visit([this](const auto& v) { return get(v); });
+    }
+    const auto [i, h] = raw->visit([this](const auto& v) {
+        const auto h = hash(v);
+        return std::make_pair(entries_.empty() ? 0 : find_index(v, h), h);
+    });
+    if (!entries_.empty() && entries_[i].hash) {
+        return string{from_position<gc_string>(heap_, entries_[i].pos)};
+    }
+    return insert(s, h);
+}
+
+gc_heap_ptr_untracked<gc_string> atom_table::find(const std::wstring_view& s) const {
+    return find_chars(s);
+}
+
+gc_heap_ptr_untracked<gc_string> atom_table::find(const std::string_view& s) const {
+    return find_chars(s);
+}
+
+gc_heap_ptr_untracked<gc_string> atom_table::find(const string& s) const {
+    if (s.is_atom()) {
+        return s.unsafe_raw_get();
+    }
+    return s.visit([this](const auto& v) { return find(v); });
+}
+
+template<typename CharT>
+string atom_table::get_chars(const std::basic_string_view<CharT>& s) {
+    const auto h = hash(s);
+    if (!entries_.empty()) {
+        if (const auto i = find_index(s, h); entries_[i].hash) {
+            return string{from_position<gc_string>(heap_, entries_[i].pos)};
+        }
+    }
+    return insert(string{heap_, s}, h);
+}
+
+string atom_table::get(const std::wstring_view& s) {
+    return get_chars(s);
+}
+
+string atom_table::get(const std::string_view& s) {
+    return get_chars(s);
+}
+
+string atom_table::insert(const string& s, uint32_t h) {
+    assert(&s.heap() == &heap_ && !s.is_atom());
+    // Keep the load (including entries of dead atoms) below 3/4
+    if ((num_used_ + 1) * 4 > entries_.size() * 3) {
+        rehash(std::max<size_t>(64, (num_atoms_ + 1) * 4 > entries_.size() ? entries_.size() * 2 : entries_.size()));
+    }
+    const auto mask = static_cast<uint32_t>(entries_.size() - 1);
+    uint32_t i = h & mask;
+    while (entries_[i].hash) {
+        i = (i + 1) & mask;
+    }
+    entries_[i] = entry{position(s.unsafe_raw_get()), h};
+    s.unsafe_raw_get()->atom_ = true;
+    ++num_atoms_;
+    ++num_used_;
+    return s;
+}
+
+void atom_table::rehash(size_t capacity) {
+    assert(capacity && !(capacity & (capacity - 1)) && capacity > num_atoms_);
+    std::vector<entry> old(capacity);
+    old.swap(entries_);
+    const auto mask = static_cast<uint32_t>(capacity - 1);
+    for (const auto& e: old) {
+        if (!e.pos) {
+            continue;
+        }
+        uint32_t i = e.hash & mask;
+        while (entries_[i].hash) {
+            i = (i + 1) & mask;
+        }
+        entries_[i] = e;
+    }
+    num_used_ = num_atoms_;
+}
+
+void atom_table::update_positions(const position_resolver& resolve) {
+    for (auto& e: entries_) {
+        if (e.pos && !(e.pos = resolve(e.pos))) {
+            // Keep the hash so probe sequences aren't broken
+            --num_atoms_;
+        }
+    }
+    if (num_atoms_ * 4 < num_used_) {
+        // Mostly dead entries, get rid of them (and shrink the table if it's mostly empty)
+        size_t capacity = entries_.size();
+        while (capacity > 64 && num_atoms_ * 8 < capacity) {
+            capacity /= 2;
+        }
+        rehash(capacity);
+    }
+}
+
+string atomize(const string& s) {
+    return s.heap().weak_table<atom_table>().get(s);
+}
+
+string atomize(gc_heap& h, const std::wstring_view& s) {
+    return h.weak_table<atom_table>().get(s);
+}
+
+string atomize(gc_heap& h, const std::string_view& s) {
+    return h.weak_table<atom_table>().get(s);
+}
+
+void index_string_table::limit(uint32_t l) {
+    limit_ = l;
+    if (positions_.size() > l) {
+        positions_.resize(l);
+    }
+}
+
+string index_string_table::get(uint32_t index) {
+    if (index < positions_.size() && positions_[index]) {
+        return string{from_position<gc_string>(heap_, positions_[index])};
+    }
+    char buffer[10], *p = &buffer[10];
+    for (uint32_t n = index;; n /= 10) {
+        *--p = static_cast<char>('0' + n % 10);
+        if (n < 10) break;
+    }
+    const std::string_view chars{p, static_cast<size_t>(&buffer[10] - p)};
+    if (index >= limit_) {
+        return string{heap_, chars};
+    }
+    auto s = atomize(heap_, chars);
+    if (index >= positions_.size()) {
+        positions_.resize(std::min(std::max<size_t>(index + 1, positions_.size() * 2), static_cast<size_t>(limit_)));
+    }
+    positions_[index] = position(s.unsafe_raw_get());
+    return s;
+}
+
+void index_string_table::update_positions(const position_resolver& resolve) {
+    for (auto& pos: positions_) {
+        if (pos) {
+            pos = resolve(pos);
+        }
+    }
+}
+
+string index_string(gc_heap& h, uint32_t index) {
+    return h.weak_table<index_string_table>().get(index);
 }
 
 double to_number(const string& s) {
-    // TODO: Implement real algorithm from 9.3.1 ToNumber Applied to the String Type
-    if (s.view().empty()) return 0;
-    std::wistringstream wis{std::wstring{s.view()}};
-    double d;
-    return (wis >> d) && !wis.rdbuf()->in_avail() ? d : NAN;
+    // 9.3.1 ToNumber Applied to the String Type
+    return s.visit([](auto v) {
+        v = trim_str_whitespace(v);
+        if (v.empty()) {
+            return 0.0;
+        }
+        if (v.length() > 2 && v[0] == '0' && (v[1] == 'x' || v[1] == 'X')) {
+            double res = 0;
+            for (const auto c: v.substr(2)) {
+                if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))) {
+                    return static_cast<double>(NAN);
+                }
+                res = res * 16 + get_hex_value(c);
+            }
+            return res;
+        }
+        const auto [d, len] = parse_decimal(v);
+        return len == v.length() ? d : NAN;
+    });
 }
 
 } // namespace mjs
@@ -3,42 +3,137 @@
 #include <iosfwd>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <algorithm>
+#include <vector>
 #include "gc_heap.h"
 
 namespace mjs {
 
+class gc_string;
+template<> struct gc_trivially_relocatable<gc_string> : std::true_type {};
+class atom_table;
+class gc_rope_string;
+class gc_sliced_string;
+class string;
+
+// A string in the heap. Usually flat (the characters follow the object), but concatenations create ropes (see gc_rope_string)
+// that are flattened the first time their characters are needed, and substrings create slices that refer to the characters
+// of another string (see gc_sliced_string). Flat strings whose characters all fit in one byte (Latin-1) store them as such
+// (see is_one_byte()).
 class gc_string {
 public:
+    // Strings longer than this can't be represented
+    static constexpr uint32_t max_length = (1U << 28) - 1;
+
     template<typename CharT>
     static gc_heap_ptr<gc_string> make(gc_heap& h, const std::basic_string_view<CharT>& s) {
-        return h.allocate_and_construct<gc_string>(sizeof(gc_string) + s.length() * sizeof(wchar_t), s);
+        const bool one_byte = fits_in_one_byte(s);
+        return h.allocate_and_construct<gc_string>(sizeof(gc_string) + s.length() * (one_byte ? 1 : sizeof(wchar_t)), s, one_byte);
     }
 
-    std::wstring_view view() const {
+    // Note: Flattens the string if necessary, which allocates. One-byte strings are widened into a buffer 'h' keeps
+    // until the next collection (and counts against its limits), prefer visit() for them.
+    std::wstring_view view(gc_heap& h) const {
+        if (kind_ != flat_kind || one_byte_) {
+            return slow_view(h);
+        }
         return std::wstring_view(const_cast<gc_string&>(*this).data(), length_);
     }
 
+    // Calls 'f' with the characters as either a std::string_view (one-byte strings, each char holding a Latin-1 character)
+    // or a std::wstring_view. Flattens the string if necessary, but never widens it.
+    template<typename F>
+    decltype(auto) visit(F&& f) const {
+        uint32_t offset = 0;
+        auto& s = const_cast<gc_string&>(kind_ == flat_kind ? *this : storage(offset));
+        if (one_byte_) {
+            return f(std::string_view(s.bytes() + offset, length_));
+        }
+        return f(std::wstring_view(s.data() + offset, length_));
+    }
+
+    uint32_t length() const { return length_; }
+
+    // Are the characters stored in the object itself?
+    bool is_flat() const { return kind_ == flat_kind; }
+
+    // Does it refer to (some of) the characters of another string?
+    bool is_slice() const { return kind_ == slice_kind; }
+
+    // Are the characters stored one byte each? Always the case for flat strings whose characters all fit.
+    bool is_one_byte() const { return one_byte_; }
+
+    // Is this the heap's unique string with these contents (see atom_table)?
+    bool is_atom() const { return atom_; }
+
+    // Narrow strings are Latin-1
+    static bool fits_in_one_byte(const std::string_view&) {
+        return true;
+    }
+
+    static bool fits_in_one_byte(const std::wstring_view& s) {
+        for (const auto c: s) {
+            if (static_cast<std::make_unsigned_t<wchar_t>>(c) > 0xff) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+protected:
+    static constexpr uint32_t flat_kind = 0;
+    static constexpr uint32_t rope_kind = 1;
+    static constexpr uint32_t slice_kind = 2;
+
+    uint32_t length_ : 28; // TODO: Get from allocation header
+    uint32_t atom_ : 1;
+    uint32_t one_byte_ : 1;
+    uint32_t kind_ : 2;
+
+    explicit gc_string(uint32_t kind, uint32_t length, bool one_byte) : length_(length), atom_(false), one_byte_(one_byte), kind_(kind) {}
+
 private:
     friend gc_type_info_registration<gc_string>;
-
-    uint32_t length_; // TODO: Get from allocation header
+    friend atom_table;
+    friend gc_rope_string;
+    friend gc_sliced_string;
+    friend string operator+(const string& l, const string& r);
 
     wchar_t* data() {
         return reinterpret_cast<wchar_t*>(reinterpret_cast<std::byte*>(this) + sizeof(*this));
     }
 
-    explicit gc_string(const std::string_view& s) : length_(static_cast<uint32_t>(s.length())) {
-        for (uint32_t i = 0; i < length_; ++i) {
-            data()[i] = s[i];
-        }
+    char* bytes() {
+        return reinterpret_cast<char*>(this) + sizeof(*this);
     }
 
-    explicit gc_string(const std::wstring_view& s) : length_(static_cast<uint32_t>(s.length())) {
-        std::memcpy(data(), s.data(), s.length() * sizeof(wchar_t));
+    std::wstring_view slow_view(gc_heap& h) const;
+    const gc_string& flatten() const;
+    // The flat string holding the characters of this (non-flat) one, which start at 'offset' in it
+    const gc_string& storage(uint32_t& offset) const;
+
+    // Uninitialized characters
+    explicit gc_string(uint32_t length, bool one_byte) : length_(length), atom_(false), one_byte_(one_byte), kind_(flat_kind) {}
+
+    explicit gc_string(const std::string_view& s, [[maybe_unused]] bool one_byte) : length_(static_cast<uint32_t>(s.length())), atom_(false), one_byte_(true), kind_(flat_kind) {
+        assert(one_byte);
+        std::memcpy(bytes(), s.data(), s.length());
+    }
+
+    explicit gc_string(const std::wstring_view& s, bool one_byte) : length_(static_cast<uint32_t>(s.length())), atom_(false), one_byte_(one_byte), kind_(flat_kind) {
+        if (one_byte) {
+            for (uint32_t i = 0; i < length_; ++i) {
+                bytes()[i] = static_cast<char>(s[i]);
+            }
+        } else {
+            std::memcpy(data(), s.data(), s.length() * sizeof(wchar_t));
+        }
     }
 
-    explicit gc_string(gc_string&& other) noexcept : length_(other.length_) {
-        std::memcpy(data(), other.data(), other.length_ * sizeof(wchar_t));
+    explicit gc_string(gc_string&& other) noexcept : length_(other.length_), atom_(other.atom_), one_byte_(other.one_byte_), kind_(flat_kind) {
+        assert(other.is_flat());
+        std::memcpy(data(), other.data(), other.length_ * (one_byte_ ? 1 : sizeof(wchar_t)));
     }
 };
 
@@ -50,19 +145,157 @@ public:
 
     using gc_heap_ptr<gc_string>::heap;
 
-    std::wstring_view view() const { return get()->view(); }
+    std::wstring_view view() const { return get()->view(heap()); }
+    template<typename F>
+    decltype(auto) visit(F&& f) const { return get()->visit(std::forward<F>(f)); }
+    uint32_t length() const { return get()->length(); }
+    bool is_atom() const { return get()->is_atom(); }
     const gc_heap_ptr<gc_string>& unsafe_raw_get() const { return *this; }
 };
 std::ostream& operator<<(std::ostream& os, const string& s);
 std::wostream& operator<<(std::wostream& os, const string& s);
-inline bool operator==(const string& l, const string& r) { return l.view() == r.view(); }
-inline string operator+(const string& l, const string& r) {
-    // TODO: Optimize this
-    return string{l.heap(), std::wstring{l.view()} + std::wstring{r.view()}};
+
+// Compare characters stored with possibly different widths (see gc_string::visit())
+template<typename CharT1, typename CharT2>
+bool equal_chars(const std::basic_string_view<CharT1>& l, const std::basic_string_view<CharT2>& r) {
+    if constexpr (std::is_same_v<CharT1, CharT2>) {
+        return l == r;
+    } else {
+        if (l.length() != r.length()) {
+            return false;
+        }
+        using UCharT1 = std::make_unsigned_t<CharT1>;
+        using UCharT2 = std::make_unsigned_t<CharT2>;
+        for (size_t i = 0; i < l.length(); ++i) {
+            if (static_cast<UCharT1>(l[i]) != static_cast<UCharT2>(r[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+// Lexicographical comparison (by character code, like std::basic_string_view::compare()) of characters stored with possibly different widths
+template<typename CharT1, typename CharT2>
+int compare_chars(const std::basic_string_view<CharT1>& l, const std::basic_string_view<CharT2>& r) {
+    if constexpr (std::is_same_v<CharT1, CharT2>) {
+        return l.compare(r);
+    } else {
+        using UCharT1 = std::make_unsigned_t<CharT1>;
+        using UCharT2 = std::make_unsigned_t<CharT2>;
+        const size_t n = std::min(l.length(), r.length());
+        for (size_t i = 0; i < n; ++i) {
+            const uint32_t lc = static_cast<UCharT1>(l[i]), rc = static_cast<UCharT2>(r[i]);
+            if (lc != rc) {
+                return lc < rc ? -1 : 1;
+            }
+        }
+        return l.length() < r.length() ? -1 : l.length() > r.length() ? 1 : 0;
+    }
 }
 
+inline bool operator==(const string& l, const string& r) {
+    const auto& lr = l.unsafe_raw_get();
+    const auto& rr = r.unsafe_raw_get();
+    if (lr->is_atom() && rr->is_atom() && &lr.heap() == &rr.heap()) {
+        return lr.get() == rr.get();
+    }
+    if (lr->length() != rr->length()) {
+        return false;
+    }
+    return l.visit([&r](const auto& lv) { return r.visit([&lv](const auto& rv) { return equal_chars(lv, rv); }); });
+}
+inline bool operator==(const string& l, const std::wstring_view& r) {
+    return l.visit([&r](const auto& lv) { return equal_chars(lv, r); });
+}
+inline bool operator!=(const string& l, const std::wstring_view& r) {
+    return !(l == r);
+}
+// Concatenation, creates a rope unless the result is short
+string operator+(const string& l, const string& r);
+
+// The 'length' characters of 's' starting at 'start', creates a slice unless the result is short
+string substring(const string& s, uint32_t start, uint32_t length);
+
 double to_number(const string& s);
 
+// Per heap table of atoms: strings that are unique for their contents. Property keys (and the interpreter's identifiers)
+// are atoms, so they're only stored once and can be compared by position. The table doesn't keep the atoms alive, entries
+// of strings that die are removed after the collection.
+class atom_table : public gc_weak_table {
+public:
+    explicit atom_table(gc_heap& h) : heap_(h) {}
+
+    // The atom with the contents of 's', 's' itself becomes one if there isn't one already
+    string get(const string& s);
+
+    // The atom with the contents 's' (created if necessary)
+    string get(const std::wstring_view& s);
+    string get(const std::string_view& s);
+
+    // The atom with the contents 's' if it exists (otherwise a null pointer)
+    gc_heap_ptr_untracked<gc_string> find(const std::wstring_view& s) const;
+    gc_heap_ptr_untracked<gc_string> find(const std::string_view& s) const;
+    gc_heap_ptr_untracked<gc_string> find(const string& s) const;
+
+    uint32_t size() const { return num_atoms_; }
+
+    void update_positions(const position_resolver& resolve) override;
+
+private:
+    // Open addressing with linear probing. Entries of atoms that died keep their hash (but not their position) until the next rehash.
+    struct entry {
+        uint32_t pos;
+        uint32_t hash; // Never 0 for used entries
+    };
+    gc_heap& heap_;
+    std::vector<entry> entries_;
+    uint32_t num_atoms_ = 0;
+    uint32_t num_used_ = 0; // Atoms and entries of dead atoms
+
+    template<typename CharT>
+    static uint32_t hash(const std::basic_string_view<CharT>& s);
+    template<typename CharT>
+    uint32_t find_index(const std::basic_string_view<CharT>& s, uint32_t h) const; // Index of the atom or of the empty entry ending the probe sequence
+    template<typename CharT>
+    gc_heap_ptr_untracked<gc_string> find_chars(const std::basic_string_view<CharT>& s) const;
+    template<typename CharT>
+    string get_chars(const std::basic_string_view<CharT>& s);
+    void rehash(size_t capacity);
+    string insert(const string& s, uint32_t h);
+};
+
+// Shorthands for getting atoms from the heap's atom table
+string atomize(const string& s);
+string atomize(gc_heap& h, const std::wstring_view& s);
+string atomize(gc_heap& h, const std::string_view& s);
+
+// Per heap cache of the strings of small integers, which are mostly array indices (see index_string()). The cached strings
+// are atoms, so they can be used as property names as is. Like the atom table it doesn't keep the strings alive.
+class index_string_table : public gc_weak_table {
+public:
+    static constexpr uint32_t default_limit = 1 << 16;
+
+    explicit index_string_table(gc_heap& h) : heap_(h) {}
+
+    // The strings of integers below the limit are cached
+    uint32_t limit() const { return limit_; }
+    void limit(uint32_t l);
+
+    // The string of 'index' (in decimal), not an atom if it's above the limit
+    string get(uint32_t index);
+
+    void update_positions(const position_resolver& resolve) override;
+
+private:
+    gc_heap& heap_;
+    uint32_t limit_ = default_limit;
+    std::vector<uint32_t> positions_; // Indexed by the integer, 0 if its string isn't cached
+};
+
+// Shorthand for getting the string of 'index' from the heap's index string table
+string index_string(gc_heap& h, uint32_t index);
+
 } // namespace mjs
 
 #endif
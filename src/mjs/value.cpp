@@ -5,6 +5,7 @@
 #include <sstream>
 #include <cmath>
 #include <cstring>
+#include <charconv>
 
 namespace mjs {
 
@@ -33,7 +34,7 @@ const char* string_value(value_type t) {
 //
 
 value reference::get_value() const {
-    return base_->get(property_name_.view());
+    return base_->get(property_name_);
 }
 
 void reference::put_value(const value& val) const {
@@ -107,7 +108,7 @@ bool operator==(const value& l, const value& r) {
         const double lv = l.number_value(), rv = r.number_value();
         return lv == rv || (std::isnan(lv) && std::isnan(rv));
     }
-    case value_type::string:    return l.string_value().view() == r.string_value().view();
+    case value_type::string:    return l.string_value() == r.string_value();
     case value_type::object:    return l.object_value().get() == r.object_value().get();
     case value_type::reference: break;
     }
@@ -138,13 +139,14 @@ value to_primitive(const value& v, value_type hint) {
     }
 
     assert(hint == value_type::number || hint == value_type::string);
+    gc_handle_scope scope{o.heap()};
     for (int i = 0; i < 2; ++i) {
         const wchar_t* const id = (hint == value_type::string) ^ i ? L"toString" : L"valueOf";
         const auto fo = o->get(id);
         if (fo.type() != value_type::object) {
             continue;
         }
-        auto f = fo.object_value()->call_function();
+        auto f = fo.object_value()->call_function_handle();
         if (!f) {
             continue;
         }
@@ -164,7 +166,7 @@ bool to_boolean(const value& v) {
     case value_type::null:      return false;
     case value_type::boolean:   return v.boolean_value();
     case value_type::number:    return v.number_value() != 0 && !std::isnan(v.number_value());
-    case value_type::string:    return !v.string_value().view().empty();
+    case value_type::string:    return v.string_value().length() != 0;
     case value_type::object:    return true;
     case value_type::reference: break;
     }
@@ -233,40 +235,93 @@ uint16_t to_uint16(const value& v) {
     return to_uint16(to_number(v));
 }
 
-std::wstring do_format_double(double m, int k) {
-    assert(k >= 1);             // k is the number of decimal digits in the representation
-    int n;                      // n is the position of the decimal point in s
-    int sign;                   // sign is set if the value is negative (never true since to_string handles that)
-#ifdef _MSC_VER
-    char s[_CVTBUFSIZE + 1];    // s is the decimal representation of the number
-    _ecvt_s(s, m, k, &n, &sign);
-#else
-    const char* s = ecvt(m, k, &n, &sign);
-#endif
-    assert(sign == 0);
+namespace {
+
+char* copy_chars(char* out, const char* s, int count) {
+    std::memcpy(out, s, count);
+    return out + count;
+}
+
+char* fill_chars(char* out, char c, int count) {
+    std::memset(out, c, count);
+    return out + count;
+}
+
+// Write "e+X" or "e-X" where X is abs(exponent) (with no leading zeros)
+char* exponent_chars(char* out, int exponent) {
+    *out++ = 'e';
+    *out++ = exponent >= 0 ? '+' : '-';
+    return std::to_chars(out, out + 3, std::abs(exponent)).ptr;
+}
+
+} // unnamed namespace
+
+char* number_to_chars(char* buf, double m) {
+    // Handle special cases
+    if (std::isnan(m)) {
+        return copy_chars(buf, "NaN", 3);
+    }
+    if (m == 0) {
+        *buf = '0';
+        return buf + 1;
+    }
+    if (m < 0) {
+        *buf++ = '-';
+        m = -m;
+    }
+    if (std::isinf(m)) {
+        return copy_chars(buf, "Infinity", 8);
+    }
+
+    assert(std::isfinite(m) && m > 0);
+
+    // 9.8.1 ToString Applied to the Number Type
+
+    // std::to_chars gives the shortest representation that round trips (the common standard libraries implement it with Ryu),
+    // in scientific notation: "d[.ddd]e[+-]xx"
+    char sci[32];
+    const auto [sci_end, ec] = std::to_chars(sci, sci + sizeof(sci), m, std::chars_format::scientific);
+    assert(ec == std::errc{});
+    (void)ec;
+
+    char s[17];                 // s is the decimal representation of the number
+    int k = 0;                  // k is the number of decimal digits in the representation
+    const char* p = sci;
+    for (; *p != 'e'; ++p) {
+        if (*p != '.') {
+            assert(k < static_cast<int>(sizeof(s)));
+            s[k++] = *p;
+        }
+    }
+    int exponent = 0;
+    std::from_chars(p + 2, sci_end, exponent);
+    const int n = (p[1] == '-' ? -exponent : exponent) + 1; // n is the position of the decimal point in s
 
-    std::wostringstream woss;
     if (k <= n && n <= 21) {
         // 6. If k <= n <= 21, return the string consisting of the k digits of the decimal
         // representation of s (in order, with no leading zeroes), followed by n - k
         // occurences of the character 0
-        woss << s << std::wstring(n-k, '0');
+        return fill_chars(copy_chars(buf, s, k), '0', n - k);
     } else if (0 < n && n <= 21) {
         // 7. If 0 < n <= 21, return the string consisting of the most significant n digits
         // of the decimal representation of s, followed by a decimal point ., followed
         // by the remaining k - n digits of the decimal representation of s.
-        woss << std::wstring(s, s + n) << '.' << std::wstring(s + n, s + std::strlen(s));
+        buf = copy_chars(buf, s, n);
+        *buf++ = '.';
+        return copy_chars(buf, s + n, k - n);
     } else if (-6 < n && n <= 0) {
         // 8. If -6 < n <= 0, return the string consisting of the character 0, followed
         // by a decimal point ., followed by -n occurences of the character 0, followed
         // by the k digits of the decimal representation of s.
-        woss << "0." << std::wstring(-n, '0') << s;
+        buf = fill_chars(copy_chars(buf, "0.", 2), '0', -n);
+        return copy_chars(buf, s, k);
     } else if (k == 1) {
         // 9.  Otherwise, if k = 1, return the string consisting of the single digit of s,
         // followed by lowercase character e, followed by a plus sign + or minus sign
         // - according to whether n - 1 is positive or negative, followed by the decimal
         // representation of the integer abs(n - 1) (with no leading zeros).
-        woss << s << 'e' << (n-1>=0?'+':'-') << std::abs(n-1);
+        *buf++ = s[0];
+        return exponent_chars(buf, n - 1);
     } else {
         // 10. Return the string consisting of the most significant digit of the decimal
         // representation of s, followed by a decimal point ., followed by the remaining
@@ -274,46 +329,24 @@ std::wstring do_format_double(double m, int k) {
         // e, followed by a plus sign + or minus sign - according to whether n - 1 is positive
         // or negative, followed by the decimal representation of the integer abs(n - 1)
         // (with no leading zeros)
-        woss << s[0] << '.' << s+1 << 'e' << (n-1>=0?'+':'-') << std::abs(n-1);
+        *buf++ = s[0];
+        *buf++ = '.';
+        return exponent_chars(copy_chars(buf, s + 1, k - 1), n - 1);
     }
-    return woss.str();
 }
 
 std::wstring to_string(double m) {
-    // Handle special cases
-    if (std::isnan(m)) {
-        return L"NaN";
-    }
-    if (m == 0) {
-        return L"0";
-    }
-    if (m < 0) {
-        return L"-" + to_string(-m);
-    }
-    if (std::isinf(m)) {
-        return L"Infinity";
-    }
-
-    assert(std::isfinite(m) && m > 0);
-
-    // 9.8.1 ToString Applied to the Number Type    
-
-    // Use really slow method to determine shortest representation of m
-    for (int k = 1; k <= 17; ++k) {
-        std::ostringstream woss;
-        woss.precision(k);
-        woss << std::defaultfloat << m;
-        if (double t; std::istringstream{woss.str()} >> t && t == m) {
-            return do_format_double(m, k);
-        }
-    }
-    // More than 17 digits should never happen
-    assert(false);
-    NOT_IMPLEMENTED(m);
+    char buf[max_number_chars];
+    return std::wstring(buf, number_to_chars(buf, m));
 }
 
 string to_string(gc_heap& h, double m) {
-    return string{h, to_string(m)};
+    // Integers (array indices in particular) are common enough to be cached
+    if (m >= 0 && m <= UINT32_MAX && static_cast<uint32_t>(m) == m) {
+        return index_string(h, static_cast<uint32_t>(m));
+    }
+    char buf[max_number_chars];
+    return string{h, std::string_view(buf, number_to_chars(buf, m) - buf)};
 }
 
 string to_string(gc_heap& h, const value& v) {
@@ -343,19 +376,22 @@ void debug_print(std::wostream& os, const value& v, int indent_incr, int max_nes
         break;
     case value_type::string:
         os << "'";
-        for (const auto& ch: v.string_value().view()) {
-            switch (ch) {
-            case '\'': os << "\\'"; break;
-            case '\\': os << "\\\\"; break;
-            case '\b': os << "\\b"; break;
-            case '\f': os << "\\f"; break;
-            case '\n': os << "\\n"; break;
-            case '\r': os << "\\r"; break;
-            case '\t': os << "\\t"; break;
-            default:
-                os << ch;
+        v.string_value().visit([&os](const auto& sv) {
+            for (const auto c: sv) {
+                const wchar_t ch = static_cast<std::make_unsigned_t<decltype(c)>>(c);
+                switch (ch) {
+                case '\'': os << "\\'"; break;
+                case '\\': os << "\\\\"; break;
+                case '\b': os << "\\b"; break;
+                case '\f': os << "\\f"; break;
+                case '\n': os << "\\n"; break;
+                case '\r': os << "\\r"; break;
+                case '\t': os << "\\t"; break;
+                default:
+                    os << ch;
+                }
             }
-        }
+        });
         os << "'";
         break;
     case value_type::object:
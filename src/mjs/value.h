@@ -118,6 +118,10 @@ uint32_t to_uint32(const value& v);
 uint16_t to_uint16(double n);
 uint16_t to_uint16(const value& v);
 string to_string(gc_heap& h, double n);
+// 9.8.1 ToString Applied to the Number Type: writes the shortest representation of 'n' that converts back to it to 'buf'
+// (which must have room for max_number_chars characters) and returns the end
+constexpr int max_number_chars = 25;
+char* number_to_chars(char* buf, double n);
 string to_string(gc_heap& h, const value& v);
 
 void debug_print(std::wostream& os, const value& v, int indent_incr, int max_nest = INT_MAX, int indent = 0);
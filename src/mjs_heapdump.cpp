@@ -0,0 +1,333 @@
+// Offline analysis of heap snapshots written by gc_heap::write_snapshot()
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <iomanip>
+
+namespace {
+
+struct node {
+    uint32_t    pos;
+    uint32_t    size;       // In slots (including the allocation header)
+    uint32_t    type;
+    std::string label;
+    uint32_t    edge_begin; // Index into snapshot::edges
+    uint32_t    edge_end;
+};
+
+struct snapshot {
+    uint32_t                 slot_size;
+    std::vector<std::string> type_names;
+    std::vector<uint32_t>    roots;  // Node indices
+    std::vector<node>        nodes;  // Ordered by position
+    std::vector<uint32_t>    edges;  // Node indices
+
+    std::string group(uint32_t n) const {
+        // Objects are grouped by their [[Class]], everything else by type
+        const auto& nd = nodes[n];
+        return nd.label.empty() ? type_names[nd.type] : nd.label;
+    }
+
+    uint64_t bytes(uint32_t n) const {
+        return static_cast<uint64_t>(nodes[n].size) * slot_size;
+    }
+};
+
+class reader {
+public:
+    explicit reader(std::istream& in) : in_(in) {}
+
+    uint32_t get() {
+        uint32_t n;
+        if (!in_.read(reinterpret_cast<char*>(&n), sizeof(n))) {
+            throw std::runtime_error("Unexpected end of snapshot");
+        }
+        return n;
+    }
+
+    std::string get_string() {
+        std::string s(get(), '\0');
+        if (!in_.read(s.data(), s.size())) {
+            throw std::runtime_error("Unexpected end of snapshot");
+        }
+        return s;
+    }
+
+private:
+    std::istream& in_;
+};
+
+snapshot read_snapshot(std::istream& in) {
+    char magic[8];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, "MJSHEAP", 8)) {
+        throw std::runtime_error("Not a heap snapshot");
+    }
+    reader r{in};
+    if (const auto version = r.get(); version != 1) {
+        throw std::runtime_error("Unsupported snapshot version " + std::to_string(version));
+    }
+
+    snapshot s;
+    s.slot_size = r.get();
+    for (uint32_t i = 0, n = r.get(); i < n; ++i) {
+        s.type_names.push_back(r.get_string());
+    }
+
+    std::vector<uint32_t> root_positions(r.get());
+    for (auto& pos: root_positions) {
+        pos = r.get();
+    }
+
+    // Edges are read as positions and translated once all nodes are known
+    for (uint32_t pos; (pos = r.get()) != 0;) {
+        node n;
+        n.pos = pos;
+        n.size = r.get();
+        n.type = r.get();
+        n.label = r.get_string();
+        if (n.type >= s.type_names.size() || (!s.nodes.empty() && s.nodes.back().pos >= pos)) {
+            throw std::runtime_error("Invalid snapshot");
+        }
+        n.edge_begin = static_cast<uint32_t>(s.edges.size());
+        for (uint32_t i = 0, num_edges = r.get(); i < num_edges; ++i) {
+            s.edges.push_back(r.get());
+        }
+        n.edge_end = static_cast<uint32_t>(s.edges.size());
+        s.nodes.push_back(std::move(n));
+    }
+
+    auto index_of = [&s](uint32_t pos) {
+        auto it = std::lower_bound(s.nodes.begin(), s.nodes.end(), pos, [](const node& n, uint32_t p) { return n.pos < p; });
+        if (it == s.nodes.end() || it->pos != pos) {
+            throw std::runtime_error("Edge to unknown position " + std::to_string(pos));
+        }
+        return static_cast<uint32_t>(it - s.nodes.begin());
+    };
+    for (auto& e: s.edges) {
+        e = index_of(e);
+    }
+    for (const auto pos: root_positions) {
+        s.roots.push_back(index_of(pos));
+    }
+    return s;
+}
+
+// Dominator tree of the nodes reachable from the roots (Cooper, Harvey and Kennedy: "A Simple, Fast Dominance Algorithm").
+// A virtual root (index nodes.size()) has edges to all roots. Unreachable nodes get 'unreachable' as their immediate dominator.
+class dominator_tree {
+public:
+    static constexpr uint32_t unreachable = UINT32_MAX;
+
+    explicit dominator_tree(const snapshot& s) : s_(s), root_(static_cast<uint32_t>(s.nodes.size())) {
+        compute_postorder();
+        compute_dominators();
+    }
+
+    uint32_t root() const { return root_; }
+    uint32_t idom(uint32_t n) const { return idom_[n]; }
+    bool reachable(uint32_t n) const { return idom_[n] != unreachable; }
+
+    // Reachable nodes (including the root) in reverse postorder, dominators always come before the nodes they dominate
+    const std::vector<uint32_t>& reverse_postorder() const { return rpo_; }
+
+private:
+    const snapshot& s_;
+    const uint32_t root_;
+    std::vector<uint32_t> rpo_;
+    std::vector<uint32_t> order_; // Postorder number of each node
+    std::vector<uint32_t> idom_;
+
+    template<typename F>
+    void for_each_successor(uint32_t n, F f) const {
+        if (n == root_) {
+            for (const auto r: s_.roots) f(r);
+        } else {
+            for (uint32_t i = s_.nodes[n].edge_begin; i < s_.nodes[n].edge_end; ++i) f(s_.edges[i]);
+        }
+    }
+
+    void compute_postorder() {
+        // Iterative DFS, the graph can be arbitrarily deep
+        const auto num_nodes = root_ + 1;
+        std::vector<bool> visited(num_nodes);
+        std::vector<std::pair<uint32_t, std::vector<uint32_t>>> stack;
+        auto push = [&](uint32_t n) {
+            visited[n] = true;
+            std::vector<uint32_t> succ;
+            for_each_successor(n, [&](uint32_t m) { succ.push_back(m); });
+            std::reverse(succ.begin(), succ.end());
+            stack.emplace_back(n, std::move(succ));
+        };
+        push(root_);
+        while (!stack.empty()) {
+            auto& [n, succ] = stack.back();
+            if (succ.empty()) {
+                rpo_.push_back(n);
+                stack.pop_back();
+                continue;
+            }
+            const auto m = succ.back();
+            succ.pop_back();
+            if (!visited[m]) {
+                push(m);
+            }
+        }
+        order_.assign(num_nodes, unreachable);
+        for (uint32_t i = 0; i < rpo_.size(); ++i) {
+            order_[rpo_[i]] = i;
+        }
+        std::reverse(rpo_.begin(), rpo_.end());
+    }
+
+    void compute_dominators() {
+        const auto num_nodes = root_ + 1;
+        std::vector<std::vector<uint32_t>> predecessors(num_nodes);
+        for (const auto n: rpo_) {
+            for_each_successor(n, [&](uint32_t m) { predecessors[m].push_back(n); });
+        }
+
+        idom_.assign(num_nodes, unreachable);
+        idom_[root_] = root_;
+        auto intersect = [&](uint32_t a, uint32_t b) {
+            while (a != b) {
+                while (order_[a] < order_[b]) a = idom_[a];
+                while (order_[b] < order_[a]) b = idom_[b];
+            }
+            return a;
+        };
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (const auto n: rpo_) {
+                if (n == root_) {
+                    continue;
+                }
+                uint32_t new_idom = unreachable;
+                for (const auto p: predecessors[n]) {
+                    if (idom_[p] != unreachable) {
+                        new_idom = new_idom == unreachable ? p : intersect(p, new_idom);
+                    }
+                }
+                if (idom_[n] != new_idom) {
+                    idom_[n] = new_idom;
+                    changed = true;
+                }
+            }
+        }
+    }
+};
+
+struct group_stats {
+    uint64_t count = 0;
+    uint64_t shallow = 0;
+    uint64_t retained = 0; // Only counting the outermost members of the group (so nothing is counted twice)
+};
+
+void analyze(const snapshot& s, size_t top, std::ostream& os) {
+    const dominator_tree dt{s};
+    const auto num_nodes = s.nodes.size() + 1;
+
+    // Retained size: the node itself and everything it dominates
+    std::vector<uint64_t> retained(num_nodes);
+    uint64_t total_bytes = 0, reachable_bytes = 0, reachable_count = 0;
+    for (uint32_t n = 0; n < s.nodes.size(); ++n) {
+        total_bytes += s.bytes(n);
+        if (dt.reachable(n)) {
+            retained[n] = s.bytes(n);
+            reachable_bytes += s.bytes(n);
+            ++reachable_count;
+        }
+    }
+    const auto& rpo = dt.reverse_postorder();
+    for (auto it = rpo.rbegin(); it != rpo.rend(); ++it) {
+        if (*it != dt.root()) {
+            retained[dt.idom(*it)] += retained[*it];
+        }
+    }
+
+    // Walk the dominator tree top down keeping track of the groups on the path to avoid counting nested members twice
+    std::vector<std::vector<uint32_t>> children(num_nodes);
+    for (const auto n: rpo) {
+        if (n != dt.root()) {
+            children[dt.idom(n)].push_back(n);
+        }
+    }
+    std::map<std::string, group_stats> groups;
+    std::map<std::string, uint32_t> on_path;
+    std::vector<std::pair<uint32_t, bool>> stack{{dt.root(), false}};
+    while (!stack.empty()) {
+        auto [n, leaving] = stack.back();
+        stack.pop_back();
+        if (n == dt.root()) {
+            if (!leaving) {
+                for (const auto c: children[n]) stack.emplace_back(c, false);
+            }
+            continue;
+        }
+        const auto g = s.group(n);
+        if (leaving) {
+            --on_path[g];
+            continue;
+        }
+        auto& gs = groups[g];
+        ++gs.count;
+        gs.shallow += s.bytes(n);
+        if (on_path[g]++ == 0) {
+            gs.retained += retained[n];
+        }
+        stack.emplace_back(n, true);
+        for (const auto c: children[n]) stack.emplace_back(c, false);
+    }
+
+    os << "Objects: " << s.nodes.size() << " (" << total_bytes << " bytes), reachable: " << reachable_count << " (" << reachable_bytes << " bytes)\n";
+    os << "Roots: " << s.roots.size() << "\n\n";
+
+    std::vector<std::pair<std::string, group_stats>> sorted_groups{groups.begin(), groups.end()};
+    std::sort(sorted_groups.begin(), sorted_groups.end(), [](const auto& l, const auto& r) { return l.second.retained > r.second.retained; });
+    os << "Top retainers by [[Class]] (or type):\n";
+    os << std::setw(12) << "retained" << std::setw(12) << "shallow" << std::setw(10) << "count" << "  class\n";
+    for (size_t i = 0; i < std::min(top, sorted_groups.size()); ++i) {
+        const auto& [name, gs] = sorted_groups[i];
+        os << std::setw(12) << gs.retained << std::setw(12) << gs.shallow << std::setw(10) << gs.count << "  " << name << "\n";
+    }
+
+    std::vector<uint32_t> objects;
+    for (uint32_t n = 0; n < s.nodes.size(); ++n) {
+        if (dt.reachable(n)) {
+            objects.push_back(n);
+        }
+    }
+    const auto num_objects = std::min(top, objects.size());
+    std::partial_sort(objects.begin(), objects.begin() + num_objects, objects.end(), [&](uint32_t l, uint32_t r) { return retained[l] > retained[r]; });
+    os << "\nTop objects by retained size:\n";
+    os << std::setw(12) << "retained" << std::setw(12) << "shallow" << std::setw(12) << "position" << "  class\n";
+    for (size_t i = 0; i < num_objects; ++i) {
+        const auto n = objects[i];
+        os << std::setw(12) << retained[n] << std::setw(12) << s.bytes(n) << std::setw(12) << s.nodes[n].pos << "  " << s.group(n) << "\n";
+    }
+}
+
+} // unnamed namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " snapshot-file [number of entries to show]\n";
+        return 2;
+    }
+    try {
+        std::ifstream in{argv[1], std::ios::binary};
+        if (!in) {
+            throw std::runtime_error("Could not open " + std::string(argv[1]));
+        }
+        const auto s = read_snapshot(in);
+        analyze(s, argc > 2 ? std::stoul(argv[2]) : 20, std::cout);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,1259 @@
+#include <sstream>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <mjs/value.h>
+#include <mjs/object.h>
+#include <mjs/gc_heap.h>
+
+#define CATCH_CONFIG_RUNNER
+#include "catch.hpp"
+
+using namespace mjs;
+
+int main( int argc, char* argv[] ) {
+    return Catch::Session().run( argc, argv );
+}
+
+gc_heap_config small_growable_config() {
+    gc_heap_config c{};
+    c.initial_capacity = c.min_capacity = 64;
+    c.max_capacity = 1<<14;
+    c.nursery_capacity = 0; // Allocate directly in the (growable) old generation
+    return c;
+}
+
+gc_heap_config generational_config() {
+    gc_heap_config c{};
+    c.initial_capacity = c.min_capacity = 1<<10;
+    c.max_capacity = 1<<16;
+    c.nursery_capacity = 1<<10;
+    c.promotion_age = 2;
+    return c;
+}
+
+TEST_CASE("gc_heap - grows when full") {
+    gc_heap h{small_growable_config()};
+    REQUIRE(h.capacity() == 64);
+    {
+        std::vector<string> strings;
+        for (int i = 0; i < 100; ++i) {
+            strings.push_back(string{h, "test string " + std::to_string(i)});
+        }
+        REQUIRE(h.capacity() > 64);
+        REQUIRE(h.capacity() <= h.config().max_capacity);
+        h.garbage_collect();
+        for (int i = 0; i < 100; ++i) {
+            REQUIRE(strings[i].view() == string{h, "test string " + std::to_string(i)}.view());
+        }
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - shrinks after collection") {
+    gc_heap h{small_growable_config()};
+    {
+        auto o = object::make(h, string{h, "Object"}, nullptr);
+        for (int i = 0; i < 200; ++i) {
+            o->put(string{h, "p" + std::to_string(i)}, value{static_cast<double>(i)});
+        }
+        h.garbage_collect();
+        const auto grown = h.capacity();
+        REQUIRE(grown > 64);
+        REQUIRE(h.calc_used() <= grown * h.config().grow_occupancy + 1);
+        REQUIRE(o->get(L"p123") == value{123.0});
+    }
+    // Shrinking happens gradually
+    uint32_t last_capacity;
+    do {
+        last_capacity = h.capacity();
+        h.garbage_collect();
+    } while (h.capacity() < last_capacity);
+    REQUIRE(h.capacity() == h.config().min_capacity);
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - repeated collections") {
+    gc_heap h{1024};
+    {
+        auto o = object::make(h, string{h, "Object"}, nullptr);
+        for (int i = 0; i < 10; ++i) {
+            // Create some garbage
+            for (int j = 0; j < 10; ++j) {
+                string{h, "garbage " + std::to_string(j)};
+            }
+            o->put(string{h, "p" + std::to_string(i)}, value{string{h, "value " + std::to_string(i)}});
+            h.garbage_collect();
+            for (int j = 0; j <= i; ++j) {
+                REQUIRE(o->get(string{h, "p" + std::to_string(j)}.view()) == value{string{h, "value " + std::to_string(j)}});
+            }
+        }
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - fixed capacity") {
+    gc_heap h{128};
+    REQUIRE(h.capacity() == 128);
+    REQUIRE(h.config().min_capacity == 128);
+    REQUIRE(h.config().max_capacity == 128);
+    {
+        string s{h, "test"};
+        h.garbage_collect();
+        REQUIRE(h.capacity() == 128);
+        REQUIRE(s.view() == L"test");
+    }
+    h.garbage_collect();
+    REQUIRE(h.capacity() == 128);
+}
+
+TEST_CASE("gc_heap - invalid configuration") {
+    gc_heap_config c{};
+    c.min_capacity = c.initial_capacity + 1;
+    REQUIRE_THROWS(gc_heap{c});
+    c = gc_heap_config{};
+    c.growth_factor = 1;
+    REQUIRE_THROWS(gc_heap{c});
+}
+
+TEST_CASE("gc_heap - young collection promotes survivors") {
+    gc_heap h{generational_config()};
+    REQUIRE(h.has_young_generation());
+    {
+        string s{h, "survivor"};
+        const auto initially_used = h.young_generation_used();
+        REQUIRE(initially_used > 0);
+        string{h, "garbage"};
+        h.garbage_collect_young();
+        // Survived once, still young
+        REQUIRE(h.young_generation_used() == initially_used);
+        REQUIRE(s.view() == L"survivor");
+        h.garbage_collect_young();
+        // Survived twice, promoted
+        REQUIRE(h.young_generation_used() == 0);
+        REQUIRE(h.calc_used() == initially_used);
+        REQUIRE(s.view() == L"survivor");
+        h.garbage_collect_young();
+        REQUIRE(s.view() == L"survivor");
+    }
+    // Only a full collection gets rid of old objects
+    h.garbage_collect_young();
+    REQUIRE(h.calc_used() != 0);
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - write barrier") {
+    gc_heap h{generational_config()};
+    {
+        auto o = object::make(h, string{h, "Object"}, nullptr);
+        h.garbage_collect(); // Make o old
+        REQUIRE(h.young_generation_used() == 0);
+
+        // The values are only reachable through the old object
+        for (int i = 0; i < 50; ++i) {
+            o->put(string{h, "p" + std::to_string(i)}, value{string{h, "value " + std::to_string(i)}});
+            h.garbage_collect_young();
+        }
+        o->internal_value(value{string{h, "internal"}});
+        o->put(string{h, "p0"}, value{string{h, "updated"}});
+        h.garbage_collect_young();
+
+        auto check = [&] {
+            REQUIRE(o->get(L"p0") == value{string{h, "updated"}});
+            for (int i = 1; i < 50; ++i) {
+                REQUIRE(o->get(string{h, "p" + std::to_string(i)}.view()) == value{string{h, "value " + std::to_string(i)}});
+            }
+            REQUIRE(o->internal_value() == value{string{h, "internal"}});
+        };
+        check();
+        for (int i = 0; i < 3; ++i) {
+            h.garbage_collect_young();
+            check();
+        }
+        h.garbage_collect();
+        check();
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - large allocations bypass young generation") {
+    gc_heap h{generational_config()};
+    {
+        string small{h, "small"};
+        const auto young_used = h.young_generation_used();
+        string large{h, std::string(h.config().nursery_capacity * gc_heap::slot_size, 'x')};
+        REQUIRE(h.young_generation_used() == young_used);
+        h.garbage_collect_young();
+        REQUIRE(large.view().length() == h.config().nursery_capacity * gc_heap::slot_size);
+        REQUIRE(small.view() == L"small");
+    }
+    h.garbage_collect();
+    REQUIRE(h.young_generation_used() == 0);
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - incremental collection") {
+    gc_heap h{generational_config()};
+    {
+        // Build a long chain of objects so the collection takes many slices
+        auto head = object::make(h, string{h, "Object"}, nullptr);
+        auto o = head;
+        for (int i = 0; i < 500; ++i) {
+            auto next = object::make(h, string{h, "Object"}, nullptr);
+            o->put(string{h, "value"}, value{string{h, "value " + std::to_string(i)}});
+            o->put(string{h, "next"}, value{next});
+            o = next;
+        }
+        o = nullptr;
+        h.garbage_collect();
+        const auto used = h.calc_used();
+
+        int slices = 0;
+        for (bool done = false; !done; ++slices) {
+            done = h.garbage_collect_incremental(std::chrono::microseconds{0});
+            // Keep using the heap while the collection is in progress
+            head->put(string{h, "value"}, value{string{h, "new value " + std::to_string(slices)}});
+            string{h, "garbage"};
+        }
+        REQUIRE(slices > 1);
+        REQUIRE(!h.collection_in_progress());
+
+        REQUIRE(head->get(L"value") == value{string{h, "new value " + std::to_string(slices - 1)}});
+        o = head->get(L"next").object_value();
+        for (int i = 1; i < 500; ++i) {
+            REQUIRE(o->get(L"value") == value{string{h, "value " + std::to_string(i)}});
+            o = o->get(L"next").object_value();
+        }
+        o = nullptr;
+        head->put(string{h, "value"}, value{string{h, "value 0"}});
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == used);
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+
+    // Destroy the heap while a collection is in progress
+    gc_heap h2{generational_config()};
+    auto o = object::make(h2, string{h2, "Object"}, nullptr);
+    for (int i = 0; i < 500; ++i) {
+        o->put(string{h2, "p" + std::to_string(i)}, value{object::make(h2, string{h2, "Object"}, nullptr)});
+    }
+    REQUIRE(!h2.garbage_collect_incremental(std::chrono::microseconds{0}));
+    REQUIRE(h2.collection_in_progress());
+    REQUIRE(o->get(L"p42").type() == value_type::object);
+}
+
+TEST_CASE("gc_heap - idle notification") {
+    gc_heap h{generational_config()};
+    {
+        auto o = object::make(h, string{h, "Object"}, nullptr);
+        REQUIRE(h.young_generation_used() != 0);
+        // The object is promoted after surviving two young collections
+        REQUIRE(h.notify_idle(std::chrono::microseconds{1000}));
+        REQUIRE(h.notify_idle(std::chrono::microseconds{1000}));
+        REQUIRE(h.young_generation_used() == 0);
+        for (int i = 0; i < 300; ++i) {
+            auto v = object::make(h, string{h, "Object"}, nullptr);
+            v->put(string{h, "i"}, value{static_cast<double>(i)});
+            o->put(string{h, "p" + std::to_string(i)}, value{v});
+            h.garbage_collect_young();
+        }
+        // The old generation has grown a lot so work on a full collection until there's nothing more to do
+        int calls = 0;
+        while (!h.notify_idle(std::chrono::microseconds{0})) {
+            ++calls;
+        }
+        REQUIRE(calls > 0);
+        REQUIRE(!h.collection_in_progress());
+        REQUIRE(o->get(L"p299").object_value()->get(L"i") == value{299.0});
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - handles") {
+    gc_heap h{generational_config()};
+    {
+        gc_handle_scope outer{h};
+        const gc_handle<object> o{object::make(h, string{h, "Object"}, nullptr)};
+        o->put(string{h, "x"}, value{string{h, "test"}});
+        {
+            gc_handle_scope inner{h};
+            const gc_handle<gc_string> s{string{h, "inner"}.unsafe_raw_get()};
+            h.garbage_collect_young();
+            REQUIRE(s->view(h) == L"inner");
+            h.garbage_collect();
+            REQUIRE(s->view(h) == L"inner");
+            REQUIRE(o->get(L"x") == value{string{h, "test"}});
+        }
+        // The inner handle is gone
+        h.garbage_collect();
+        const auto used = h.calc_used();
+        for (int i = 0; i < 3; ++i) {
+            h.garbage_collect_young();
+        }
+        REQUIRE(h.young_generation_used() == 0);
+        REQUIRE(o->get(L"x") == value{string{h, "test"}});
+
+        // Handles created while an incremental collection is in progress
+        for (int i = 0; i < 100; ++i) {
+            o->put(string{h, "p" + std::to_string(i)}, value{string{h, "value " + std::to_string(i)}});
+        }
+        REQUIRE(!h.garbage_collect_incremental(std::chrono::microseconds{0}));
+        const gc_handle<object> o2{object::make(h, string{h, "Object"}, nullptr)};
+        const gc_handle<object> o3{o->get(L"x").type() == value_type::string ? o.track() : nullptr};
+        while (!h.garbage_collect_incremental(std::chrono::microseconds{0})) {
+        }
+        REQUIRE(o2->class_name().view() == L"Object");
+        REQUIRE(o3.get() == o.get());
+        REQUIRE(o3.track()->get(L"x") == value{string{h, "test"}});
+        REQUIRE(h.calc_used() > used);
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - automatic collection") {
+    gc_heap h{generational_config()};
+    {
+        auto o = object::make(h, string{h, "Object"}, nullptr);
+        uint32_t max_used = 0;
+        for (int i = 0; i < 20000; ++i) {
+            o->put(string{h, "p" + std::to_string(i % 10)}, value{string{h, "value " + std::to_string(i)}});
+            h.collect_if_needed();
+            max_used = std::max(max_used, h.calc_used());
+        }
+        // Way more than the maximum capacity has been allocated
+        REQUIRE(max_used < h.config().max_capacity * h.config().grow_occupancy + h.config().nursery_capacity);
+        REQUIRE(h.capacity() < h.config().max_capacity);
+        REQUIRE(o->get(L"p9") == value{string{h, "value 19999"}});
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+
+    // Nothing happens when disabled
+    gc_heap_config c = generational_config();
+    c.young_collection_trigger = c.full_collection_trigger = 0;
+    gc_heap h2{c};
+    {
+        string s{h2, "test"};
+        for (int i = 0; i < 100; ++i) {
+            string{h2, "garbage"};
+        }
+        const auto used = h2.calc_used();
+        h2.collect_if_needed();
+        REQUIRE(h2.calc_used() == used);
+    }
+
+    // Or while a gc_no_safepoint_scope is open
+    gc_heap h3{generational_config()};
+    {
+        const auto collections = h3.stats().young_collections;
+        {
+            gc_no_safepoint_scope no_safepoints{h3};
+            for (int i = 0; i < 1000; ++i) {
+                string{h3, "garbage"};
+                h3.collect_if_needed();
+            }
+            REQUIRE(h3.stats().young_collections == collections);
+        }
+        h3.collect_if_needed();
+        REQUIRE(h3.stats().young_collections == collections + 1);
+    }
+}
+
+TEST_CASE("gc_heap - parallel collection") {
+    for (const uint32_t threads: {1, 2, 4}) {
+        gc_heap_config c = generational_config();
+        c.gc_threads = threads;
+        gc_heap h{c};
+        {
+            // A wide tree with shared leaves so the workers race to copy the same objects
+            auto root = object::make(h, string{h, "Object"}, nullptr);
+            std::vector<object_ptr> leaves;
+            for (int i = 0; i < 20; ++i) {
+                leaves.push_back(object::make(h, string{h, "Object"}, nullptr));
+                leaves.back()->put(string{h, "i"}, value{static_cast<double>(i)});
+            }
+            for (int i = 0; i < 200; ++i) {
+                auto o = object::make(h, string{h, "Object"}, nullptr);
+                o->put(string{h, "s"}, value{string{h, "value " + std::to_string(i)}});
+                o->put(string{h, "leaf"}, value{leaves[i % leaves.size()]});
+                root->put(string{h, "p" + std::to_string(i)}, value{o});
+            }
+            // gc_function contains tracked pointers
+            root->call_function(gc_function::make(h, [root = leaves[0]](const value&, const std::vector<value>&) { return root->get(L"i"); }));
+            leaves.clear();
+            h.garbage_collect();
+            const auto used = h.calc_used();
+            for (int i = 0; i < 3; ++i) {
+                h.garbage_collect();
+                REQUIRE(h.calc_used() == used);
+            }
+            for (int i = 0; i < 200; ++i) {
+                auto o = root->get(string{h, "p" + std::to_string(i)}.view()).object_value();
+                REQUIRE(o->get(L"s") == value{string{h, "value " + std::to_string(i)}});
+                REQUIRE(o->get(L"leaf").object_value()->get(L"i") == value{static_cast<double>(i % 20)});
+            }
+            REQUIRE(root->get(L"p20").object_value()->get(L"leaf").object_value().get() == root->get(L"p0").object_value()->get(L"leaf").object_value().get());
+            // The tracked accessors work without a handle scope, the handle ones need one
+            REQUIRE(root->call_function()->call(value::undefined, {}) == value{0.0});
+            gc_handle_scope scope{h};
+            REQUIRE(root->call_function_handle()->call(value::undefined, {}) == value{0.0});
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+}
+
+// Holds a strong and a weak pointer to strings
+class weak_test_object {
+public:
+    friend gc_type_info_registration<weak_test_object>;
+
+    static gc_heap_ptr<weak_test_object> make(gc_heap& h) {
+        return h.make<weak_test_object>(h);
+    }
+
+    void weak(const string& s) { weak_ = s.unsafe_raw_get(); heap_.write_barrier(this); }
+    void strong(const string& s) { strong_ = s.unsafe_raw_get(); heap_.write_barrier(this); }
+
+    bool has_weak() const { return static_cast<bool>(weak_); }
+    std::wstring_view weak_view() const { return weak_.dereference(heap_).view(heap_); }
+
+private:
+    gc_heap& heap_;
+    gc_heap_ptr_weak<gc_string> weak_;
+    gc_heap_ptr_untracked<gc_string> strong_;
+
+    explicit weak_test_object(gc_heap& h) : heap_(h) {}
+    weak_test_object(weak_test_object&&) = default;
+
+    void fixup() {
+        weak_.fixup(heap_);
+        strong_.fixup(heap_);
+    }
+};
+
+TEST_CASE("gc_heap - weak pointers") {
+    enum class collection { full, young, incremental, parallel };
+    for (const auto kind: {collection::full, collection::young, collection::incremental, collection::parallel}) {
+        gc_heap_config c = generational_config();
+        if (kind == collection::parallel) {
+            c.gc_threads = 4;
+        }
+        gc_heap h{c};
+        auto collect = [&] {
+            switch (kind) {
+            case collection::full:
+            case collection::parallel:
+                h.garbage_collect();
+                break;
+            case collection::young:
+                h.garbage_collect_young();
+                break;
+            case collection::incremental:
+                while (!h.garbage_collect_incremental(std::chrono::microseconds{0})) {
+                }
+                break;
+            }
+        };
+        {
+            auto only_weak = weak_test_object::make(h);
+            auto tracked = weak_test_object::make(h);
+            auto also_strong = weak_test_object::make(h);
+            only_weak->weak(string{h, "garbage"});
+            string s{h, "tracked"};
+            tracked->weak(s);
+            // Also strongly referenced from the same object
+            {
+                string t{h, "same"};
+                also_strong->weak(t);
+                also_strong->strong(t);
+            }
+
+            collect();
+            // Weakly held objects are reclaimed
+            REQUIRE(!only_weak->has_weak());
+            // Strongly held ones survive (and the weak pointers follow them)
+            REQUIRE(tracked->has_weak());
+            REQUIRE(tracked->weak_view() == L"tracked");
+            REQUIRE(also_strong->has_weak());
+            REQUIRE(also_strong->weak_view() == L"same");
+
+            // And keep doing so
+            for (int i = 0; i < 3; ++i) {
+                collect();
+                REQUIRE(tracked->weak_view() == L"tracked");
+                REQUIRE(also_strong->weak_view() == L"same");
+            }
+
+            // Until the target dies
+            s = string{h, "other"};
+            collect();
+            if (kind == collection::young) {
+                // Old objects aren't collected by young collections
+                h.garbage_collect();
+            }
+            REQUIRE(!tracked->has_weak());
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+}
+
+TEST_CASE("gc_heap - large objects") {
+    enum class collection { full, young, incremental, parallel };
+    for (const auto kind: {collection::full, collection::young, collection::incremental, collection::parallel}) {
+        gc_heap_config c = generational_config();
+        c.large_object_threshold = 64;
+        c.large_object_capacity = 1<<12;
+        if (kind == collection::parallel) {
+            c.gc_threads = 4;
+        }
+        gc_heap h{c};
+        auto collect = [&] {
+            switch (kind) {
+            case collection::full:
+            case collection::parallel:
+                h.garbage_collect();
+                break;
+            case collection::young:
+                h.garbage_collect_young();
+                break;
+            case collection::incremental:
+                while (!h.garbage_collect_incremental(std::chrono::microseconds{0})) {
+                }
+                break;
+            }
+        };
+        {
+            const std::string big(1000, 'x');
+            string s{h, big};
+            REQUIRE(h.large_object_space_used() > 0);
+            // The characters are stored in one byte each, view() would return a (widened) copy
+            auto chars = [&s] { return s.visit([](const auto& v) { return static_cast<const void*>(v.data()); }); };
+            const auto data = chars();
+
+            auto weak = weak_test_object::make(h);
+            weak->weak(string{h, big + "y"});
+
+            auto o = object::make(h, string{h, "Object"}, nullptr);
+            for (int i = 0; i < 50; ++i) {
+                o->put(string{h, "p" + std::to_string(i)}, value{string{h, "value " + std::to_string(i)}});
+            }
+            // The property table is reallocated (in the large object space) while a collection is in progress
+            h.garbage_collect_incremental(std::chrono::microseconds{0});
+            for (int i = 50; i < 100; ++i) {
+                o->put(string{h, "p" + std::to_string(i)}, value{string{h, "value " + std::to_string(i)}});
+            }
+
+            collect();
+            if (kind == collection::young) {
+                h.garbage_collect();
+            }
+            // Large objects are never moved
+            REQUIRE(chars() == data);
+            REQUIRE(s.view() == string{h, big}.view());
+            REQUIRE(!weak->has_weak());
+            for (int i = 0; i < 100; ++i) {
+                REQUIRE(o->get(string{h, "p" + std::to_string(i)}.view()) == value{string{h, "value " + std::to_string(i)}});
+            }
+
+            // The space of dead objects is reused
+            h.garbage_collect();
+            const auto used = h.large_object_space_used();
+            for (int i = 0; i < 10; ++i) {
+                string garbage{h, big};
+                collect();
+            }
+            h.garbage_collect();
+            REQUIRE(h.large_object_space_used() == used);
+            REQUIRE(chars() == data);
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+        REQUIRE(h.large_object_space_used() == 0);
+    }
+}
+
+TEST_CASE("gc_heap - memory release") {
+    for (const bool huge_pages: {false, true}) {
+        gc_heap_config c{};
+        c.nursery_capacity = 0;
+        c.min_capacity = 1<<10;
+        c.max_capacity = 1<<20;
+        c.large_object_threshold = 256;
+        c.large_object_capacity = 1<<16;
+        c.transparent_huge_pages = huge_pages;
+        gc_heap h{c};
+        {
+            std::vector<string> live;
+            for (int i = 0; i < 2000; ++i) {
+                // Every 8th string is large
+                string s{h, std::string(i % 8 ? 100 : 1000, static_cast<char>('a' + i % 26))};
+                if (i % 100 == 0) {
+                    live.push_back(s);
+                }
+            }
+            const auto capacity = h.capacity();
+            for (int i = 0; i < 10; ++i) {
+                h.garbage_collect();
+            }
+            REQUIRE(h.capacity() < capacity);
+            for (size_t i = 0; i < live.size(); ++i) {
+                const auto n = i * 100;
+                const auto expected = std::string(n % 8 ? 100 : 1000, static_cast<char>('a' + n % 26));
+                REQUIRE(live[i].view() == std::wstring(expected.begin(), expected.end()));
+            }
+
+            // Released memory can be used again
+            for (int i = 0; i < 2000; ++i) {
+                live.push_back(string{h, std::string(i % 8 ? 100 : 1000, 'z')});
+            }
+            h.garbage_collect();
+            REQUIRE(live.back().view() == std::wstring(100, L'z'));
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+}
+
+TEST_CASE("gc_heap - limits") {
+    gc_heap_config c = generational_config();
+    c.hard_limit = 64 << 10;
+    c.large_object_threshold = 64;
+    c.large_object_capacity = 1<<12;
+
+    // Going over the hard limit throws, but leaves the heap usable
+    for (const bool large: {false, true}) {
+        gc_heap h{c};
+        {
+            std::vector<string> live;
+            REQUIRE_THROWS_AS([&] {
+                for (;;) {
+                    live.push_back(string{h, std::string(large ? 1000 : 100, 'x')});
+                }
+            }(), gc_heap_limit_exceeded);
+            REQUIRE(h.calc_used() * gc_heap::slot_size <= c.hard_limit + c.nursery_capacity * gc_heap::slot_size);
+            live.clear();
+            h.garbage_collect();
+            live.push_back(string{h, std::string(large ? 1000 : 100, 'y')});
+            REQUIRE(live.back().view()[0] == 'y');
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+
+    // Allocations bigger than the heap can ever be
+    {
+        gc_heap h{c};
+        REQUIRE_THROWS_AS(string(h, std::string(c.max_capacity * gc_heap::slot_size, 'x')), gc_heap_limit_exceeded);
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+
+    // The soft limit callback can free memory, raise the limit or deny
+    c.soft_limit = 16 << 10;
+    gc_heap h{c};
+    {
+        std::vector<string> live, cache;
+        enum class action { free, grow, deny } act = action::free;
+        uint64_t calls = 0;
+        h.on_soft_limit([&](gc_heap& heap, uint64_t used) -> uint64_t {
+            REQUIRE(&heap == &h);
+            REQUIRE(used > heap.soft_limit());
+            ++calls;
+            switch (act) {
+            case action::free:
+                cache.clear();
+                heap.garbage_collect();
+                return heap.soft_limit();
+            case action::grow:
+                return heap.soft_limit() * 2;
+            case action::deny:
+                break;
+            }
+            return 0;
+        });
+        auto allocate_until_called = [&](std::vector<string>& v) {
+            for (const auto old_calls = calls; calls == old_calls;) {
+                v.push_back(string{h, std::string(100, 'x')});
+                h.collect_if_needed();
+            }
+        };
+
+        allocate_until_called(cache);
+        REQUIRE(cache.empty());
+        REQUIRE(h.soft_limit() == c.soft_limit);
+
+        act = action::grow;
+        allocate_until_called(live);
+        REQUIRE(h.soft_limit() == 2 * c.soft_limit);
+
+        act = action::deny;
+        REQUIRE_THROWS_AS(allocate_until_called(live), gc_heap_limit_exceeded);
+        REQUIRE(h.soft_limit() == 2 * c.soft_limit);
+        live.clear();
+        h.collect_if_needed();
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - dead objects are destroyed") {
+    enum class collection { full, young, incremental, parallel };
+    for (const auto kind: {collection::full, collection::young, collection::incremental, collection::parallel}) {
+        gc_heap_config c = generational_config();
+        if (kind == collection::parallel) {
+            c.gc_threads = 4;
+        }
+        auto counter = std::make_shared<int>(42);
+        auto make_function = [&counter](gc_heap& h) {
+            return gc_function::make(h, [counter](const value&, const std::vector<value>&) { return value{static_cast<double>(*counter)}; });
+        };
+        {
+            gc_heap h{c};
+            auto live = make_function(h);
+            for (int i = 0; i < 10; ++i) {
+                make_function(h);
+                string{h, "garbage " + std::to_string(i)};
+            }
+            REQUIRE(counter.use_count() == 12);
+
+            switch (kind) {
+            case collection::full:
+            case collection::parallel:
+                h.garbage_collect();
+                break;
+            case collection::young:
+                h.garbage_collect_young();
+                break;
+            case collection::incremental:
+                while (!h.garbage_collect_incremental(std::chrono::microseconds{0})) {
+                }
+                break;
+            }
+            REQUIRE(counter.use_count() == 2);
+            h.garbage_collect();
+            REQUIRE(counter.use_count() == 2);
+            REQUIRE(live->call(value::undefined, {}) == value{42.0});
+
+            // Objects that are still alive when the heap goes away (possibly during a collection) are destroyed too
+            make_function(h);
+            if (kind == collection::incremental) {
+                h.garbage_collect_incremental(std::chrono::microseconds{0});
+            }
+        }
+        REQUIRE(counter.use_count() == 1);
+    }
+}
+
+TEST_CASE("gc_heap - statistics") {
+    gc_heap h{generational_config()};
+    REQUIRE(h.stats().young_collections == 0);
+    REQUIRE(h.stats().full_collections == 0);
+    std::vector<gc_heap_stats> seen;
+    h.on_collection([&seen](const gc_heap& heap) { seen.push_back(heap.stats()); });
+    {
+        string live{h, "live"};
+        for (int i = 0; i < 10; ++i) {
+            string{h, "garbage " + std::to_string(i)};
+        }
+        REQUIRE(h.stats().bytes_allocated >= 11 * (gc_heap::slot_size + sizeof(gc_string)));
+
+        const auto types = h.type_statistics();
+        REQUIRE(types.size() == gc_type_info::num_types());
+        const auto& ts = types[gc_type_info_registration<gc_string>::index()];
+        REQUIRE(ts.name == gc_type_info_registration<gc_string>::get().name());
+        REQUIRE(ts.count == 11);
+
+        h.garbage_collect_young();
+        REQUIRE(h.stats().young_collections == 1);
+        REQUIRE(seen.size() == 1);
+        REQUIRE(h.stats().bytes_freed > 0);
+        REQUIRE(h.stats().bytes_survived > 0);
+        REQUIRE(h.stats().survival_rate() > 0);
+        REQUIRE(h.stats().survival_rate() < 1);
+        REQUIRE(h.type_statistics()[gc_type_info_registration<gc_string>::index()].count == 1);
+
+        // The string is promoted by the next young collection
+        h.garbage_collect_young();
+        REQUIRE(h.stats().bytes_promoted > 0);
+
+        h.garbage_collect();
+        REQUIRE(h.stats().full_collections == 1);
+        REQUIRE(seen.size() == 3);
+        REQUIRE(seen.back().full_collections == 1);
+        REQUIRE(h.stats().max_pause > std::chrono::nanoseconds{0});
+        REQUIRE(h.stats().total_pause >= h.stats().max_pause);
+        REQUIRE(h.stats().total_pause == seen.back().total_pause);
+
+        std::wostringstream woss;
+        woss << h.stats();
+        REQUIRE(woss.str().find(L"Collections: 2 young, 1 full") != std::wstring::npos);
+    }
+    h.on_collection(nullptr);
+    h.garbage_collect();
+    REQUIRE(seen.size() == 3);
+}
+
+TEST_CASE("gc_heap - allocation sampling") {
+    gc_heap h{1<<20};
+    uint64_t samples = 0, sampled_bytes = 0, sampled_tables = 0;
+    h.sample_allocations(256, [&](const gc_type_info& type, const void*, uint64_t bytes) {
+        ++samples;
+        sampled_bytes += bytes;
+        if (&type == &gc_type_info_registration<gc_table>::get()) {
+            sampled_tables += bytes;
+        }
+    });
+    const auto before = h.stats().bytes_allocated;
+    for (int i = 0; i < 20000; ++i) {
+        // Mix small and large allocations
+        string{h, std::string(i % 10 ? 5 : 500, 'x')};
+    }
+    const auto allocated = h.stats().bytes_allocated - before;
+    // Every large string is sampled, about every 256 bytes of the small ones
+    REQUIRE(samples > 2000);
+    REQUIRE(samples < allocated / 256);
+    REQUIRE(sampled_bytes > allocated * 0.9);
+    REQUIRE(sampled_bytes < allocated * 1.1);
+    REQUIRE(sampled_tables == 0);
+
+    h.sample_allocations(0, nullptr);
+    const auto old_samples = samples;
+    for (int i = 0; i < 1000; ++i) {
+        string{h, "x"};
+    }
+    REQUIRE(samples == old_samples);
+    h.garbage_collect();
+}
+
+TEST_CASE("gc_heap - snapshot") {
+    gc_heap h{generational_config()};
+    {
+        auto o = object::make(h, string{h, "Object"}, nullptr);
+        o->put(string{h, "a"}, value{string{h, "property value"}});
+        auto w = weak_test_object::make(h);
+        string s{h, "weakly held"};
+        w->weak(s);
+        string{h, "garbage"};
+
+        std::ostringstream oss;
+        h.write_snapshot(oss);
+        const auto data = oss.str();
+        size_t offset = 0;
+        auto get = [&] {
+            uint32_t n;
+            REQUIRE(offset + sizeof(n) <= data.size());
+            std::memcpy(&n, data.data() + offset, sizeof(n));
+            offset += sizeof(n);
+            return n;
+        };
+        auto get_string = [&] {
+            const auto len = get();
+            REQUIRE(offset + len <= data.size());
+            std::string res = data.substr(offset, len);
+            offset += len;
+            return res;
+        };
+
+        REQUIRE(data.compare(0, 8, std::string("MJSHEAP\0", 8)) == 0);
+        offset = 8;
+        REQUIRE(get() == 1);
+        REQUIRE(get() == gc_heap::slot_size);
+        REQUIRE(get() == gc_type_info::num_types());
+        for (uint32_t i = 0; i < gc_type_info::num_types(); ++i) {
+            REQUIRE(get_string() == gc_type_info::from_index(i).name());
+        }
+        REQUIRE(get() == 3); // o, w and s
+        for (int i = 0; i < 3; ++i) {
+            get();
+        }
+
+        uint64_t count = 0;
+        uint32_t object_edges = 0, weak_test_edges = 0;
+        for (uint32_t pos; (pos = get()) != 0; ++count) {
+            get(); // size
+            const auto type = get();
+            const auto label = get_string();
+            const auto num_edges = get();
+            for (uint32_t i = 0; i < num_edges; ++i) {
+                get();
+            }
+            if (type == gc_type_info_registration<object>::index()) {
+                REQUIRE(label == "Object");
+                object_edges = num_edges;
+            } else if (type == gc_type_info_registration<weak_test_object>::index()) {
+                weak_test_edges = num_edges;
+            } else {
+                REQUIRE(label.empty());
+            }
+        }
+        REQUIRE(offset == data.size());
+
+        // Dead objects are included too
+        uint64_t expected_count = 0;
+        for (const auto& ts: h.type_statistics()) {
+            expected_count += ts.count;
+        }
+        REQUIRE(count == expected_count);
+        // [[Class]] and property table
+        REQUIRE(object_edges == 2);
+        // Weak pointers aren't edges
+        REQUIRE(weak_test_edges == 0);
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+}
+
+TEST_CASE("gc_heap - atoms") {
+    for (const bool generational: {false, true}) {
+        gc_heap h{generational ? generational_config() : small_growable_config()};
+        auto& atoms = h.weak_table<atom_table>();
+        {
+            const string s{h, "test"};
+            REQUIRE(!s.is_atom());
+            REQUIRE(!atoms.find(L"test"));
+            // The string itself becomes the atom
+            const auto a = atomize(s);
+            REQUIRE(a.is_atom());
+            REQUIRE(s.is_atom());
+            REQUIRE(atomize(h, std::wstring_view{L"test"}).unsafe_raw_get().get() == s.unsafe_raw_get().get());
+            REQUIRE(atomize(string{h, "test"}).unsafe_raw_get().get() == s.unsafe_raw_get().get());
+            REQUIRE(atoms.size() == 1);
+
+            std::vector<string> keep;
+            for (int i = 0; i < 1000; ++i) {
+                auto k = atomize(h, std::string_view{"k" + std::to_string(i)});
+                if (i % 10 == 0) {
+                    keep.push_back(k);
+                }
+            }
+            REQUIRE(atoms.size() == 1001);
+            if (generational) {
+                // Atoms are moved out of the nursery (dead old ones are only removed by full collections)
+                h.garbage_collect_young();
+                REQUIRE(atoms.find(L"k10"));
+            } else {
+                // Atoms are moved by an incremental collection
+                while (!h.garbage_collect_incremental(std::chrono::microseconds{0})) {
+                    REQUIRE(atoms.find(L"k10"));
+                }
+            }
+            h.garbage_collect();
+            // Dead atoms are removed from the table
+            REQUIRE(atoms.size() == 101);
+            REQUIRE(!atoms.find(L"k1"));
+            for (int i = 0; i < 1000; i += 10) {
+                const auto k = atomize(h, std::string_view{"k" + std::to_string(i)});
+                REQUIRE(k.unsafe_raw_get().get() == keep[i / 10].unsafe_raw_get().get());
+                REQUIRE(k.view() == std::wstring{L"k"} + std::to_wstring(i));
+            }
+            REQUIRE(atoms.size() == 101);
+
+            // Properties are found by their atoms
+            auto o = object::make(h, string{h, "Object"}, nullptr);
+            o->put(string{h, "prop"}, value{42.0});
+            REQUIRE(atoms.find(L"prop"));
+            REQUIRE(o->get(L"prop") == value{42.0});
+            REQUIRE(o->get(string{h, "prop"}) == value{42.0});
+            REQUIRE(o->get(L"missing") == value::undefined);
+            REQUIRE(!atoms.find(L"missing"));
+            REQUIRE(o->delete_property(L"prop"));
+            REQUIRE(!o->has_property(L"prop"));
+        }
+        h.garbage_collect();
+        REQUIRE(atoms.size() == 0);
+        REQUIRE(h.calc_used() == 0);
+    }
+}
+
+TEST_CASE("gc_heap - index strings") {
+    for (const bool generational: {false, true}) {
+        gc_heap h{generational ? generational_config() : small_growable_config()};
+        auto& indices = h.weak_table<index_string_table>();
+        REQUIRE(indices.limit() == index_string_table::default_limit);
+        {
+            const auto s0 = index_string(h, 0);
+            REQUIRE(s0.view() == L"0");
+            REQUIRE(s0.is_atom());
+            REQUIRE(index_string(h, 0).unsafe_raw_get().get() == s0.unsafe_raw_get().get());
+            REQUIRE(index_string(h, 1234).view() == L"1234");
+            REQUIRE(index_string(h, UINT32_MAX).view() == L"4294967295");
+            // Integral numbers come from the cache too
+            REQUIRE(to_string(h, 0.0).unsafe_raw_get().get() == s0.unsafe_raw_get().get());
+            REQUIRE(to_string(h, -0.0).unsafe_raw_get().get() == s0.unsafe_raw_get().get());
+            REQUIRE(to_string(h, 1.5).view() == L"1.5");
+            REQUIRE(to_string(h, -1.0).view() == L"-1");
+
+            // The atom is shared with property names
+            auto o = object::make(h, string{h, "Object"}, nullptr);
+            o->put(string{h, "42"}, value{1.0});
+            const auto s42 = index_string(h, 42);
+            REQUIRE(o->get(s42) == value{1.0});
+            REQUIRE(atomize(h, std::string_view{"42"}).unsafe_raw_get().get() == s42.unsafe_raw_get().get());
+
+            // Cached strings survive (and move with) collections, but aren't kept alive
+            if (generational) {
+                h.garbage_collect_young();
+            } else {
+                while (!h.garbage_collect_incremental(std::chrono::microseconds{0})) {
+                    REQUIRE(index_string(h, 0).unsafe_raw_get().get() == s0.unsafe_raw_get().get());
+                }
+            }
+            REQUIRE(index_string(h, 0).unsafe_raw_get().get() == s0.unsafe_raw_get().get());
+            h.garbage_collect();
+            REQUIRE(index_string(h, 0).unsafe_raw_get().get() == s0.unsafe_raw_get().get());
+            REQUIRE(index_string(h, 42).unsafe_raw_get().get() == s42.unsafe_raw_get().get());
+
+            // Integers above the limit aren't cached (or atomized)
+            indices.limit(10);
+            REQUIRE(indices.limit() == 10);
+            REQUIRE(index_string(h, 9).is_atom());
+            const auto s10 = index_string(h, 10);
+            REQUIRE(s10.view() == L"10");
+            REQUIRE(!s10.is_atom());
+            REQUIRE(index_string(h, 10).unsafe_raw_get().get() != s10.unsafe_raw_get().get());
+        }
+        h.garbage_collect();
+        REQUIRE(h.weak_table<atom_table>().size() == 0);
+        REQUIRE(h.calc_used() == 0);
+    }
+}
+
+TEST_CASE("gc_heap - ropes") {
+    for (const bool generational: {false, true}) {
+        auto config = generational ? generational_config() : small_growable_config();
+        config.max_capacity = 1<<22;
+        gc_heap h{config};
+        {
+            const string a{h, "abcdefghijklmnopqrstuvwxyz"};
+            const string b{h, "0123456789"};
+            // Short results and empty operands don't create ropes
+            REQUIRE((string{h, "ab"} + string{h, "cd"}).unsafe_raw_get()->is_flat());
+            REQUIRE((a + string{h, ""}).unsafe_raw_get().get() == a.unsafe_raw_get().get());
+            REQUIRE((string{h, ""} + b).unsafe_raw_get().get() == b.unsafe_raw_get().get());
+
+            std::vector<string> filler; // So incremental collections take a while
+            for (int i = 0; i < 1000; ++i) {
+                filler.push_back(string{h, "filler"});
+            }
+            auto ab = a + b;
+            REQUIRE(!ab.unsafe_raw_get()->is_flat());
+            REQUIRE(ab.length() == 36);
+            // The parts survive collections (including incremental ones that finish after the rope was flattened)
+            h.garbage_collect();
+            REQUIRE(ab.length() == 36);
+            REQUIRE(!h.garbage_collect_incremental(std::chrono::microseconds{0}));
+            REQUIRE(ab.view() == L"abcdefghijklmnopqrstuvwxyz0123456789");
+            while (!h.garbage_collect_incremental(std::chrono::microseconds{0})) {
+            }
+            REQUIRE(ab.view() == L"abcdefghijklmnopqrstuvwxyz0123456789");
+            REQUIRE(ab == string{h, "abcdefghijklmnopqrstuvwxyz0123456789"});
+
+            // Deep ropes (in both directions) are flattened without recursion
+            string left{h, "x"}, right{h, "x"};
+            for (int i = 0; i < 100'000; ++i) {
+                left = left + b;
+                right = b + right;
+                if (i % 10'000 == 0) {
+                    h.garbage_collect();
+                }
+            }
+            REQUIRE(left.length() == 1'000'001);
+            const auto lv = left.view();
+            REQUIRE(lv.length() == 1'000'001);
+            REQUIRE(lv.substr(0, 11) == L"x0123456789");
+            REQUIRE(lv.substr(lv.length() - 10) == L"0123456789");
+            REQUIRE(right.view().substr(right.length() - 11) == L"0123456789x");
+            REQUIRE(left.unsafe_raw_get()->is_flat() == false);
+            h.garbage_collect();
+            // The parts are released once the rope is flattened
+            REQUIRE(h.calc_used() * gc_heap::slot_size < 3 * 1'000'001 * sizeof(wchar_t));
+            REQUIRE(left.view().substr(0, 11) == L"x0123456789");
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+}
+
+TEST_CASE("gc_heap - one-byte strings") {
+    gc_heap h{small_growable_config()};
+    {
+        auto is_narrow = [](const string& s) { return s.visit([](const auto& v) { return std::is_same_v<std::decay_t<decltype(v)>, std::string_view>; }); };
+        const auto used = h.calc_used();
+        const string narrow{h, std::string(800, 'a')};
+        const auto narrow_used = h.calc_used() - used;
+        const string wide{h, std::wstring(800, L'\x2603')};
+        const auto wide_used = h.calc_used() - used - narrow_used;
+        REQUIRE(narrow.unsafe_raw_get()->is_one_byte());
+        REQUIRE(!wide.unsafe_raw_get()->is_one_byte());
+        REQUIRE(narrow_used * 3 < wide_used);
+        REQUIRE(is_narrow(narrow));
+        REQUIRE(!is_narrow(wide));
+
+        // Latin-1 characters fit in one byte as well
+        const string latin1{h, L"caf\xe9"};
+        REQUIRE(latin1.unsafe_raw_get()->is_one_byte());
+        REQUIRE(latin1.view() == L"caf\xe9");
+        REQUIRE(latin1 == string{h, "caf\xe9"});
+        REQUIRE(latin1 == L"caf\xe9");
+        REQUIRE(!(latin1 == string{h, L"caf\x2603"}));
+
+        // Concatenations (flat and ropes) stay narrow unless a part is wide
+        const auto short_concat = string{h, "ab"} + latin1;
+        REQUIRE(is_narrow(short_concat));
+        REQUIRE(short_concat.view() == L"abcaf\xe9");
+        const auto long_narrow = narrow + latin1;
+        REQUIRE(is_narrow(long_narrow));
+        REQUIRE(long_narrow.view().substr(798) == L"aacaf\xe9");
+        const auto mixed = latin1 + wide;
+        REQUIRE(!is_narrow(mixed));
+        REQUIRE(mixed.view().substr(0, 5) == L"caf\xe9\x2603");
+
+        // Atoms are found regardless of how their contents are given
+        const auto a = atomize(h, std::string_view{"caf\xe9"});
+        REQUIRE(a.unsafe_raw_get()->is_one_byte());
+        REQUIRE(atomize(h, std::wstring_view{L"caf\xe9"}).unsafe_raw_get().get() == a.unsafe_raw_get().get());
+        REQUIRE(atomize(latin1).unsafe_raw_get().get() == a.unsafe_raw_get().get());
+
+        // Widened views stay valid until the next collection
+        const auto v = narrow.view();
+        REQUIRE(v == std::wstring(800, L'a'));
+        REQUIRE(narrow.view().data() == v.data());
+        h.garbage_collect();
+        REQUIRE(narrow.view() == std::wstring(800, L'a'));
+    }
+    h.garbage_collect();
+    REQUIRE(h.calc_used() == 0);
+
+    // Widened copies count against the heap's collection triggers (and are freed by the collection)
+    gc_heap h2{generational_config()};
+    {
+        std::vector<string> strings;
+        for (int i = 0; i < 100; ++i) {
+            strings.push_back(string{h2, std::string(100, 'a') + std::to_string(i)});
+        }
+        h2.garbage_collect();
+        const auto collections = h2.stats().full_collections;
+        for (const auto& s: strings) {
+            REQUIRE(s.view().substr(100) == std::to_wstring(&s - strings.data()));
+            h2.collect_if_needed();
+        }
+        REQUIRE(h2.stats().full_collections > collections);
+        REQUIRE(h2.stats().young_collections == 0);
+    }
+}
+
+TEST_CASE("gc_heap - sliced strings") {
+    for (const bool generational: {false, true}) {
+        auto config = generational ? generational_config() : small_growable_config();
+        config.max_capacity = 1<<22;
+        gc_heap h{config};
+        {
+            const std::wstring letters = L"abcdefghijklmnopqrstuvwxyz";
+            const std::wstring chars = letters + letters + letters + L"\x2603";
+            const string digits{h, "0123456789"};
+            const string parent{h, chars + std::wstring(10'000, L'.')};
+            // Short results and the whole string aren't slices
+            REQUIRE(substring(parent, 1, 3).unsafe_raw_get()->is_flat());
+            REQUIRE(substring(parent, 1, 3) == L"bcd");
+            REQUIRE(substring(parent, 0, parent.length()).unsafe_raw_get().get() == parent.unsafe_raw_get().get());
+
+            auto s = substring(parent, 2, 77);
+            REQUIRE(s.unsafe_raw_get()->is_slice());
+            REQUIRE(s.length() == 77);
+            REQUIRE(s == chars.substr(2));
+            // Slices of slices refer to the original
+            const auto ss = substring(s, 72, 5);
+            REQUIRE(ss == L"wxyz\x2603");
+            auto sss = substring(s, 1, 70);
+            REQUIRE(sss.unsafe_raw_get()->is_slice());
+            REQUIRE(sss.view() == chars.substr(3, 70));
+            // Slices of ropes (and ropes of slices)
+            const auto rope = digits + s + digits;
+            REQUIRE(substring(rope, 8, 70) == L"89" + chars.substr(2, 68));
+            REQUIRE(rope.view() == L"0123456789" + chars.substr(2) + L"0123456789");
+            // Narrow slices stay narrow
+            const string narrow{h, std::string(100, 'a') + "bcdefghijklmnopqrstuvwxyz"};
+            const auto ns = substring(narrow, 90, 35);
+            REQUIRE(ns.unsafe_raw_get()->is_one_byte());
+            REQUIRE(ns == std::wstring(10, L'a') + letters.substr(1));
+            REQUIRE(atomize(ns).unsafe_raw_get()->is_flat());
+
+            // A parent that's still used keeps sharing its characters with slices that refer to most of it
+            const auto most = substring(parent, 1, parent.length() - 1);
+            h.garbage_collect();
+            REQUIRE(most.unsafe_raw_get()->is_slice());
+            REQUIRE(most.view().substr(0, 3) == L"bcd");
+            REQUIRE(s == chars.substr(2));
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+
+        {
+            // Once the parent is only used by slices that refer to a small part of it, they get their own copies
+            std::vector<string> pieces;
+            {
+                const string text{h, std::wstring(100'000, L'x') + std::wstring(100, L'y') + L"\x2603"};
+                pieces.push_back(substring(text, 100'000, 101));
+                pieces.push_back(substring(text, 0, 1000));
+            }
+            h.garbage_collect();
+            h.garbage_collect();
+            REQUIRE(h.calc_used() * gc_heap::slot_size < 100'000 * sizeof(wchar_t));
+            REQUIRE(pieces[0] == std::wstring(100, L'y') + L"\x2603");
+            REQUIRE(pieces[1] == std::wstring(1000, L'x'));
+            // Copies use one byte per character if they can
+            REQUIRE(pieces[1].unsafe_raw_get()->is_one_byte());
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+}
+
+TEST_CASE("gc_heap - sliced strings in a full heap") {
+    for (const bool hard_limit: {false, true}) {
+        auto config = gc_heap_config::fixed(1<<14);
+        if (hard_limit) {
+            config = small_growable_config();
+            config.hard_limit = (1<<14) * gc_heap::slot_size;
+        }
+        gc_heap h{config};
+        {
+            std::vector<string> filler;
+            string piece{h, ""};
+            {
+                const string text{h, std::string(50'000, 'x')};
+                piece = substring(text, 0, 1000);
+            }
+            REQUIRE(piece.unsafe_raw_get()->is_slice());
+            // Fill the heap up to its limit
+            try {
+                for (;;) {
+                    filler.push_back(string{h, "filler"});
+                }
+            } catch (const gc_heap_limit_exceeded&) {
+            }
+            // There's no room for a copy of the slice, so it keeps sharing its mostly dead parent
+            h.garbage_collect();
+            REQUIRE(piece.unsafe_raw_get()->is_slice());
+            REQUIRE(piece == std::wstring(1000, L'x'));
+            // Until there is
+            filler.clear();
+            h.garbage_collect();
+            REQUIRE(piece == std::wstring(1000, L'x'));
+            h.garbage_collect();
+            REQUIRE(h.calc_used() * gc_heap::slot_size < 50'000);
+        }
+        h.garbage_collect();
+        REQUIRE(h.calc_used() == 0);
+    }
+}
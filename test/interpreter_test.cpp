@@ -7,6 +7,7 @@
 #include <mjs/parser.h>
 #include <mjs/printer.h>
 #include <mjs/object.h>
+#include <mjs/allocation_profiler.h>
 
 #include "test_spec.h"
 
@@ -309,12 +310,19 @@ function f(x) {
     test(L"''+Array('March', 'Jan', 'Feb', 'Dec').sort()", value{string{h, "Dec,Feb,Jan,March"}});
     test(L"''+Array(1,30,4,21).sort()", value{string{h, "1,21,30,4"}});
     test(L"function c(x,y) { return x-y; }; ''+Array(1,30,4,21).sort(c)", value{string{h, "1,4,21,30"}});
+    test(L"a=Array(String.fromCharCode(9731), String.fromCharCode(233), 'z', 'zz', String.fromCharCode(233)+'a').sort(); a.join().charCodeAt(5) + a.join().length", value{233.0+11});
+    test(L"a=Array(String.fromCharCode(9731), String.fromCharCode(233), 'z').sort().join('-'); a == 'z-' + String.fromCharCode(233, 45, 9731)", value{true});
     test(L"new Array(1).toString()", value{string{h, ""}});
     test(L"new Array(1,2).toString()", value{string{h, "1,2"}});
     test(L"+new Array(1)", value{0.});
     test(L"+new Array(1,2)", value{NAN});
     // Make sure we handle "large" arrays
     test(L"a=new Array(500);for (var i=0; i<a.length; ++i) a[i] = i; sum=0; for (var i=0; i<a.length; ++i) sum += a[i]; sum", value{499*500/2.});
+    test(L"a=new Array(); a[70000]=1; a[4294967294]=2; a[4294967295]=3; a.length", value{4294967295.});
+    test(L"a=new Array(); a['07']=1; a['1.0']=2; a[1.5]=3; a.length", value{0.});
+    test(L"a=new Array(); a[1e4]='x'; a['10000']+a[10000]+a.length", value{string{h, "xx10001"}});
+    test(L"a=new Array(1,2,3,4,5); a.reverse(); a.length=3; a.reverse()+''", value{string{h, "3,4,5"}});
+    test(L"function f() { return arguments[2] + arguments['1']; } f(1, 2, 3)", value{5.});
 
     // String
     test(L"String()", value{string{h, ""}});
@@ -356,6 +364,19 @@ function f(x) {
     test(L"'foo bar'.substring(1, 0)", value{string{h, "f"}});
     test(L"'foo bar'.substring(1000, -1)", value{string{h, "foo bar"}});
     test(L"'foo bar'.substring(1, 4)", value{string{h, "oo "}});
+    test(L"var s = ''; for (var i = 0; i < 1000; ++i) s = s + 'abcdefghij'; s.length", value{10000.0});
+    test(L"var s = ''; for (var i = 0; i < 1000; ++i) s += i % 10; s.substring(985, 995)", value{string{h, "5678901234"}});
+    test(L"var s = 'x'; for (var i = 0; i < 20; ++i) s = i + s; s.charAt(0) + s.charAt(s.length - 1)", value{string{h, "1x"}});
+    test(L"String.fromCharCode(65, 233, 9731).charCodeAt(1)", value{233.0});
+    test(L"String.fromCharCode(65, 233, 9731).charCodeAt(2)", value{9731.0});
+    test(L"(String.fromCharCode(9731) + 'abc').indexOf('c')", value{3.0});
+    test(L"'abcabc'.lastIndexOf(String.fromCharCode(98))", value{4.0});
+    test(L"'abc'.indexOf(String.fromCharCode(9731))", value{-1.0});
+    test(L"(String.fromCharCode(233) + 'x' + String.fromCharCode(233)).split('x').length", value{2.0});
+    test(L"var s = ''; for (var i = 0; i < 100; ++i) s += 'line number ' + i + '\\n'; var l = s.split('\\n'); l[42] + l.length", value{string{h, "line number 42100"}});
+    test(L"var s = String.fromCharCode(9731); for (var i = 0; i < 10; ++i) s += ',item number ' + i + ' 0123456789012345678901234567890123456789012345678901234567890123456789'; var l = s.split(','); l[10].substring(5, 13) + l.length", value{string{h, "number 911"}});
+    test(L"var s = ''; for (var i = 0; i < 20; ++i) s += 'abcdefghij'; var t = s.substring(3, 190); t.substring(100, 110) + t.length", value{string{h, "defghijabc187"}});
+    test(L"String.fromCharCode(201) == String.fromCharCode(201).toUpperCase()", value{true});
     test(L"'ABc'.toLowerCase()", value{string{h, "abc"}});
     test(L"'ABc'.toUpperCase()", value{string{h, "ABC"}});
     // Boolean
@@ -377,6 +398,11 @@ function f(x) {
     test(L"Number.MIN_VALUE", value{5e-324});
     test(L"Number('1.2')", value{1.2});
     test(L"Number('1,2')", value{NAN});
+    test(L"Number(' 0x1f ') + Number('\\t-2.5e2\\n')", value{-219.0});
+    test(L"Number('\\u00a0 12\\r\\n')", value{12.0});
+    test(L"Number('Infinity') == 1e400", value{true});
+    test(L"0.1 + 0.2 == 0.30000000000000004", value{true});
+    test(L"1.7976931348623157e308 + 4.9406564584124654e-324", value{1.7976931348623157e308});
     test(L"new Number(42.42).toString()", value{string{h, "42.42"}});
     test(L"''+new Number(60)", value{string{h, "60"}});
     test(L"new Number(123).valueOf()", value{123.0});
@@ -437,6 +463,8 @@ parseInt(' 123', 16); //$ number 291
 parseInt(' 123', 37); //$ number NaN
 parseInt(' 123', 1); //$ number NaN
 parseInt(' x', 1); //$ number NaN
+parseInt('\u00ff1'); //$ number NaN
+parseInt('zZ\u00ff', 36); //$ number 1295
 )");
 
     // parseFloat
@@ -445,6 +473,13 @@ parseFloat('0'); //$ number 0
 parseFloat(42); //$ number 42
 parseFloat(' 42.25x'); //$ number 42.25
 parseFloat('h'); //$ number NaN
+parseFloat('-.5e-3abc'); //$ number -0.0005
+parseFloat(' Infinity and beyond'); //$ number Infinity
+parseFloat('1e'); //$ number 1
+parseFloat('\n1.5'); //$ number 1.5
+parseFloat('\r\n 2'); //$ number 2
+parseFloat('\u00a0\t-3x'); //$ number -3
+parseFloat('\u2028\u3000' + '4'); //$ number 4
 )");
 
     // escape / unescape
@@ -456,11 +491,13 @@ escape('42') //$ string '42'
 escape('(hel lo)') //$ string '%28hel%20lo%29'
 escape('\u1234') //$ string '%u1234'
 escape('\u0029') //$ string '%29'
+escape('caf\u00e9') //$ string 'caf%e9'
 
 unescape('') //$ string ''
 unescape('test') //$ string 'test'
 unescape('%28%29') //$ string '()'
 unescape('%u1234').charCodeAt(0) //$ number 4660
+unescape('%e9%u00E9').charCodeAt(1) //$ number 233
 
 )");
 
@@ -632,6 +669,132 @@ null
 )", value::null);
 }
 
+void test_automatic_collection() {
+    // Allocates much more than fits in the heap, the interpreter has to collect garbage on its own
+    gc_heap h{1<<14};
+    auto bs = parse(std::make_shared<source_file>(L"test", LR"(
+var s = 0;
+for (var i = 0; i < 20000; ++i) {
+    var o = new Object();
+    o.x = 'value ' + i;
+    s += o.x.length;
+}
+s
+)"));
+    interpreter i{h, *bs};
+    value res{};
+    for (const auto& s: bs->l()) {
+        res = i.eval(*s).result;
+    }
+    if (res != value{208890.0}) {
+        std::wostringstream woss;
+        woss << "Unexpected result of automatic collection test: " << debug_string(res);
+        THROW_RUNTIME_ERROR(woss.str());
+    }
+}
+
+void test_collection_in_callbacks() {
+    // Builtins calling back into scripts (through toString/valueOf) that allocate enough to trigger collections
+    gc_heap_config config{};
+    config.initial_capacity = config.min_capacity = 1<<14;
+    config.max_capacity = 1<<20;
+    config.nursery_capacity = 1<<10;
+    gc_heap h{config};
+    auto bs = parse(std::make_shared<source_file>(L"test", LR"(
+var s = ''; for (var i = 0; i < 4; ++i) s = s + '0123456789'; s = s + 'needle;' + s;
+function garbage() { for (var i = 0; i < 200; ++i) { var o = new Object(); o.t = 'garbage ' + i; } }
+function needle() { garbage(); return 'needle'; }
+function semicolon() { garbage(); return ';'; }
+function four() { garbage(); return 4; }
+var n = new Object(); n.toString = needle;
+var c = new Object(); c.toString = semicolon;
+var p = new Object(); p.valueOf = four;
+var l = s.split(c);
+s.indexOf(n) + ',' + s.lastIndexOf(n) + ',' + s.lastIndexOf('0123', p) + ',' + s.substring(p, 6) + ',' + l.length + ',' + l[1].length
+)"));
+    const auto collections_before = h.stats().young_collections + h.stats().full_collections;
+    interpreter i{h, *bs};
+    value res{};
+    for (const auto& s: bs->l()) {
+        res = i.eval(*s).result;
+    }
+    if (res != value{string{h, "40,40,0,45,2,40"}} || h.stats().young_collections + h.stats().full_collections == collections_before) {
+        std::wostringstream woss;
+        woss << "Unexpected result of collection in callbacks test: " << debug_string(res);
+        THROW_RUNTIME_ERROR(woss.str());
+    }
+}
+
+void test_heap_limit() {
+    // A runaway script is terminated when the heap reaches its hard limit, the heap can be used for the next script
+    gc_heap_config c{};
+    c.hard_limit = 4 << 20;
+    gc_heap h{c};
+    auto run = [&h](const std::wstring_view& text) {
+        auto bs = parse(std::make_shared<source_file>(L"test", text));
+        interpreter i{h, *bs};
+        value res{};
+        for (const auto& s: bs->l()) {
+            res = i.eval(*s).result;
+        }
+        return res;
+    };
+    bool thrown = false;
+    try {
+        run(L"var l = null; for (;;) { var o = new Object(); o.prev = l; o.s = 'some string'; l = o; }");
+    } catch (const gc_heap_limit_exceeded&) {
+        thrown = true;
+    }
+    if (!thrown) {
+        THROW_RUNTIME_ERROR("Runaway script not terminated");
+    }
+    if (run(L"var s = 0; for (var i = 0; i < 1000; ++i) { var o = new Object(); o.x = i; s += o.x; } s") != value{499500.0}) {
+        THROW_RUNTIME_ERROR("Heap not usable after running out of memory");
+    }
+    h.garbage_collect();
+}
+
+void test_allocation_profiler() {
+    gc_heap h{1<<20};
+    auto bs = parse(std::make_shared<source_file>(L"test", LR"(
+function f() {
+    return new Object();
+}
+for (var i = 0; i < 20000; ++i) {
+    f();
+}
+0
+)"));
+    {
+        interpreter i{h, *bs};
+        allocation_profiler profiler{h, i, 1024};
+        for (const auto& s: bs->l()) {
+            i.eval(*s);
+        }
+        std::ostringstream oss;
+        profiler.write_collapsed(oss);
+        const auto profile = oss.str();
+        // Almost everything is allocated by calling f() from the loop
+        uint64_t in_loop = 0;
+        std::istringstream iss{profile};
+        for (std::string line; std::getline(iss, line);) {
+            if (line.compare(0, 7, "test:6;") == 0) {
+                in_loop += std::stoull(line.substr(line.rfind(' ') + 1));
+            }
+        }
+        const auto total = profiler.total_bytes();
+        if (profiler.num_samples() < 100 || in_loop < total * 9 / 10 || profile.find("test:6;test:3;Object ") == std::string::npos || profile.find("test:6;test:6;") != std::string::npos) {
+            THROW_RUNTIME_ERROR("Unexpected allocation profile (" + std::to_string(in_loop) + " of " + std::to_string(total) + " bytes in loop):\n" + profile);
+        }
+        // The estimate should be close to what was actually allocated while profiling
+        const auto allocated = h.stats().bytes_allocated;
+        if (total < allocated / 2 || total > allocated * 2) {
+            THROW_RUNTIME_ERROR("Estimated " + std::to_string(total) + " bytes allocated, actual " + std::to_string(allocated));
+        }
+    }
+    h.garbage_collect();
+}
+
 int main() {
     try {
         eval_tests();
@@ -640,6 +803,10 @@ int main() {
         test_date_functions();
         test_semicolon_insertion();
         test_long_object_chain();
+        test_automatic_collection();
+        test_collection_in_callbacks();
+        test_heap_limit();
+        test_allocation_profiler();
     } catch (const std::exception& e) {
         std::cerr << e.what() << '\n';
         return 1;
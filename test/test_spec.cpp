@@ -99,9 +99,17 @@ struct test_spec {
     value expected;
 };
 
+// How garbage is collected after each statement
+enum class test_spec_gc {
+    full,        // Full collection
+    young,       // Only collect the young generation (exercises the write barriers)
+    incremental, // Do a little bit of work on an incremental collection (exercises the read and write barriers)
+    parallel,    // Full collection using multiple threads
+};
+
 class test_spec_runner {
 public:
-    static size_t run(gc_heap& h, const std::vector<test_spec>& specs, const block_statement& statements) {
+    static size_t run(gc_heap& h, const std::vector<test_spec>& specs, const block_statement& statements, test_spec_gc gc) {
 #ifdef TEST_SPEC_DEBUG
         std::wcout << "Running test spec for " << statements.extend().file->text << "\nSpecs:\n";
         for (const auto& s: specs) {
@@ -109,7 +117,7 @@ public:
         }
         std::wcout << "\n";
 #endif
-        test_spec_runner tsr{h, specs, statements};
+        test_spec_runner tsr{h, specs, statements, gc};
         tsr.i_.eval(statements);
         tsr.check_test_spec_done(statements.extend().end);
 #ifdef TEST_SPEC_DEBUG
@@ -126,10 +134,10 @@ private:
     uint32_t last_line_ = 0;
     completion last_result_{};
 
-    explicit test_spec_runner(gc_heap& h, const std::vector<test_spec>& specs, const block_statement& statements)
+    explicit test_spec_runner(gc_heap& h, const std::vector<test_spec>& specs, const block_statement& statements, test_spec_gc gc)
         : specs_(specs)
         , source_(statements.extend().file)
-        , i_(h, statements, [&h, this](const statement& s, const completion& res) {
+        , i_(h, statements, [&h, this, gc](const statement& s, const completion& res) {
 #ifdef TEST_SPEC_DEBUG
             std::wcout << pos_w << s.extend().start << "-" << pos_w << s.extend().end << ": ";
             print(std::wcout, s);
@@ -140,7 +148,13 @@ private:
                 last_result_ = res;
                 last_line_ = s.extend().start;
             }
-            h.garbage_collect(); // Run garbage collection after each statement to help catch bugs
+            // Run garbage collection after each statement to help catch bugs
+            switch (gc) {
+            case test_spec_gc::full:        [[fallthrough]];
+            case test_spec_gc::parallel:    h.garbage_collect(); break;
+            case test_spec_gc::young:       h.garbage_collect_young(); break;
+            case test_spec_gc::incremental: h.garbage_collect_incremental(std::chrono::microseconds{0}); break;
+            }
         }) {
     }
 
@@ -168,12 +182,29 @@ private:
     }
 };
 
-void run_test_spec(const std::string_view& source_text, const std::string_view& name) {
+namespace {
+
+gc_heap_config test_spec_heap_config(test_spec_gc gc) {
+    auto config = gc_heap_config::fixed(1<<20);
+    if (gc == test_spec_gc::young) {
+        // Keep the young generation small so objects also get allocated directly in the old generation
+        config.nursery_capacity = 1<<12;
+    } else if (gc == test_spec_gc::parallel) {
+        config.gc_threads = 4;
+    }
+    if (gc != test_spec_gc::full) {
+        // Use a low threshold so large (moderately sized) strings and tables end up in the large object space
+        config.large_object_capacity = 1<<18;
+        config.large_object_threshold = 64;
+    }
+    return config;
+}
+
+void run_test_spec(const std::string_view& source_text, const std::string_view& name, test_spec_gc gc) {
     constexpr const char delim[] = "//$";
     constexpr const int delim_len = sizeof(delim)-1;
 
-
-    gc_heap heap{1<<20};
+    gc_heap heap{test_spec_heap_config(gc)};
 
     {
         std::vector<test_spec> specs;
@@ -197,7 +228,7 @@ void run_test_spec(const std::string_view& source_text, const std::string_view&
         }
 
         auto bs = parse(std::make_shared<source_file>(std::wstring(name.begin(), name.end()), std::wstring(source_text.begin(), source_text.end())));
-        const auto index = test_spec_runner::run(heap, specs, *bs);
+        const auto index = test_spec_runner::run(heap, specs, *bs, gc);
         if (index != specs.size()) {
             throw std::runtime_error("Invalid test spec." + std::string(name) + ": Only " + std::to_string(index) + " of " + std::to_string(specs.size()) + " specs ran");
         }
@@ -211,7 +242,14 @@ void run_test_spec(const std::string_view& source_text, const std::string_view&
         heap.debug_print(oss);
         THROW_RUNTIME_ERROR(oss.str());
     }
+}
 
+} // unnamed namespace
+
+void run_test_spec(const std::string_view& source_text, const std::string_view& name) {
+    for (const auto gc: {test_spec_gc::full, test_spec_gc::young, test_spec_gc::incremental, test_spec_gc::parallel}) {
+        run_test_spec(source_text, name, gc);
+    }
 }
 
 } // namespace mjs
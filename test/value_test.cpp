@@ -1,9 +1,15 @@
 #include <sstream>
 #include <string>
+#include <random>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
 
 #include <mjs/value.h>
 #include <mjs/object.h>
 #include <mjs/gc_heap.h>
+#include <mjs/lexer.h>
 
 #define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
@@ -124,6 +130,14 @@ TEST_CASE("Type Conversions") {
     REQUIRE(to_number(value{string{h,"42.25"}}) == 42.25);
     REQUIRE(to_number(value{string{h,"1e80"}}) == 1e80);
     REQUIRE(to_number(value{string{h,"-60"}}) == -60);
+    REQUIRE(to_number(value{string{h," \t12.5e1\n"}}) == 125);
+    REQUIRE(to_number(value{string{h,"  "}}) == 0);
+    REQUIRE(to_number(value{string{h,"0x1F"}}) == 31);
+    REQUIRE(to_number(value{string{h,"-Infinity"}}) == -INFINITY);
+    REQUIRE(std::isnan(to_number(value{string{h,"12px"}})));
+    REQUIRE(std::isnan(to_number(value{string{h,"0x"}})));
+    REQUIRE(std::isnan(to_number(value{string{h,"1e"}})));
+    REQUIRE(std::isnan(to_number(value{string{h,L"1\x2603"}})));
     // TODO: Object
 
 
@@ -160,10 +174,122 @@ TEST_CASE("NumberToString") {
     REQUIRE(to_string(h, 1234.0                   ) == string{h, "1234"});
     REQUIRE(to_string(h, 1e20                     ) == string{h, "100000000000000000000"});
     REQUIRE(to_string(h, 1e21                     ) == string{h, "1e+21"});
-// FIXME: Why doesn't this work on w/ g++ 8.2.0 on Linux?
-//    REQUIRE(to_string(h, 1.7976931348623157e+308  ) == string{h, "1.7976931348623157e+308"});
+    REQUIRE(to_string(h, 1.7976931348623157e+308  ) == string{h, "1.7976931348623157e+308"});
     REQUIRE(to_string(h, 5e-324                   ) == string{h, "5e-324"});
+    REQUIRE(to_string(h, -0.1                     ) == string{h, "-0.1"});
+    REQUIRE(to_string(h, 0.1 + 0.2                ) == string{h, "0.30000000000000004"});
+    REQUIRE(to_string(h, 123.456                  ) == string{h, "123.456"});
+    REQUIRE(to_string(h, 1.5e300                  ) == string{h, "1.5e+300"});
+    REQUIRE(to_string(h, -1.2345e-7               ) == string{h, "-1.2345e-7"});
+    REQUIRE(to_string(h, 9007199254740993.0       ) == string{h, "9007199254740992"});
+    REQUIRE(to_string(h, -2.2250738585072014e-308 ) == string{h, "-2.2250738585072014e-308"});
+    REQUIRE(to_string(h, -1.2345678901234567e-6   ) == string{h, "-0.0000012345678901234567"});
 
     h.garbage_collect();
     assert(h.calc_used() == 0);
 }
+
+// Checks that number_to_chars(m) converts back to m and that no representation with fewer digits does
+void check_number_round_trip(double m) {
+    char buf[max_number_chars + 1];
+    const auto end = number_to_chars(buf, m);
+    REQUIRE(end - buf <= max_number_chars);
+    *end = '\0';
+    INFO(buf);
+    REQUIRE(std::strtod(buf, nullptr) == m);
+    if (m == 0 || std::isinf(m)) {
+        return;
+    }
+    // The significant digits are those before the exponent without leading and trailing zeros
+    std::string digits;
+    for (const char* p = buf; p != end && *p != 'e'; ++p) {
+        if (std::isdigit(*p) && (*p != '0' || !digits.empty())) {
+            digits.push_back(*p);
+        }
+    }
+    while (!digits.empty() && digits.back() == '0') {
+        digits.pop_back();
+    }
+    REQUIRE(!digits.empty());
+    if (digits.size() > 1) {
+        char shorter[32];
+        std::snprintf(shorter, sizeof(shorter), "%.*e", static_cast<int>(digits.size()) - 2, m);
+        REQUIRE(std::strtod(shorter, nullptr) != m);
+    }
+}
+
+TEST_CASE("NumberToString round trip") {
+    for (int i = 0; i <= 100'000; ++i) {
+        check_number_round_trip(i);
+        check_number_round_trip(i / 1000.0);
+    }
+    for (int e = -324; e <= 308; ++e) {
+        check_number_round_trip(std::pow(10.0, e));
+    }
+    for (const double m: {DBL_MIN, DBL_MAX, DBL_EPSILON, DBL_TRUE_MIN, 9007199254740992.0, 4294967295.0, 1e21 - 65536, 0.000001, 0.0000009999999999999999}) {
+        check_number_round_trip(m);
+        check_number_round_trip(-m);
+        check_number_round_trip(std::nextafter(m, 0.0));
+        check_number_round_trip(std::nextafter(m, HUGE_VAL));
+    }
+    // Random bit patterns cover all exponents
+    std::mt19937_64 rng{42};
+    for (int i = 0; i < 1'000'000; ++i) {
+        const uint64_t bits = rng();
+        double m;
+        std::memcpy(&m, &bits, sizeof(m));
+        if (std::isfinite(m)) {
+            check_number_round_trip(m);
+        }
+    }
+}
+
+TEST_CASE("parse_decimal") {
+    auto parse = [](const char* s) { return parse_decimal(std::string_view{s}); };
+    REQUIRE(parse("42") == std::pair<double, size_t>{42, 2});
+    REQUIRE(parse("-1.5e3x") == std::pair<double, size_t>{-1500, 6});
+    REQUIRE(parse(".5") == std::pair<double, size_t>{0.5, 2});
+    REQUIRE(parse("5.") == std::pair<double, size_t>{5, 2});
+    REQUIRE(parse("1e") == std::pair<double, size_t>{1, 1});
+    REQUIRE(parse("1e+") == std::pair<double, size_t>{1, 1});
+    REQUIRE(parse("+Infinity") == std::pair<double, size_t>{INFINITY, 9});
+    REQUIRE(parse("000123.4500") == std::pair<double, size_t>{123.45, 11});
+    REQUIRE(parse("1e400") == std::pair<double, size_t>{INFINITY, 5});
+    REQUIRE(parse("-1e-400").first == 0);
+    REQUIRE(std::signbit(parse("-1e-400").first));
+    REQUIRE(parse("1e99999999999") == std::pair<double, size_t>{INFINITY, 13});
+    REQUIRE(parse("0.0000000000000000000000000000001e31") == std::pair<double, size_t>{1, 36});
+    for (const char* s: {"", "+", "-", ".", "e5", "x", "Inf", "-.e1"}) {
+        INFO(s);
+        REQUIRE(parse(s).second == 0);
+        REQUIRE(std::isnan(parse(s).first));
+    }
+    REQUIRE(parse_decimal(std::wstring_view{L"3.25\x2603"}) == std::pair<double, size_t>{3.25, 4});
+
+    // Hard cases: halfway between two doubles, needing more than 19 digits to decide, and the extremes
+    for (const char* s: {"9007199254740993", "9007199254740993.0000000000000000001", "2.2250738585072011e-308", "2.2250738585072012e-308",
+        "4.9406564584124654e-324", "2.4703282292062327e-324", "2.4703282292062328e-324", "1.7976931348623157e308", "1.7976931348623158e308",
+        "179769313486231580793728971405301e276", "0.1000000000000000055511151231257827021181583404541015625",
+        "0.1000000000000000055511151231257827021181583404541015626", "123456789012345678901234567890", "7.038531e-26"}) {
+        INFO(s);
+        const auto [d, len] = parse(s);
+        REQUIRE(len == std::strlen(s));
+        REQUIRE(d == std::strtod(s, nullptr));
+    }
+    // Numbers formatted by number_to_chars (or with all 17 digits) parse back to themselves
+    std::mt19937_64 rng{42};
+    for (int i = 0; i < 1'000'000; ++i) {
+        const uint64_t bits = rng();
+        double m;
+        std::memcpy(&m, &bits, sizeof(m));
+        if (!std::isfinite(m)) {
+            continue;
+        }
+        char buf[max_number_chars];
+        const auto end = number_to_chars(buf, m);
+        REQUIRE(parse_decimal(std::string_view(buf, end - buf)) == std::pair<double, size_t>{m, end - buf});
+        char full[32];
+        const int len = std::snprintf(full, sizeof(full), "%.16e", m);
+        REQUIRE(parse_decimal(std::string_view(full, len)).first == m);
+    }
+}